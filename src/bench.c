@@ -0,0 +1,597 @@
+#define _XOPEN_SOURCE 700 // mkdtemp, nftw, clock_gettime
+
+#include <err.h>
+#include <errno.h>
+#include <ftw.h>
+#include <limits.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h> // sysconf
+
+#include "core.h"
+#include "database.h"
+#include "libtagmage.h"
+#include "tags.h"
+#include "util.h"
+#include "view.h"
+
+/*
+ * bench.c -- tagmage benchmarks. Fills a temporary store with a synthetic
+ * library, whose tags are drawn from a Zipf distribution like real ones,
+ * then times the operations behind each command on it and prints the
+ * results as JSON.
+ */
+
+// Filters listed and viewed, by shape. "%r" stands for the rarest tag and
+// "%m" for the median one.
+static const struct {
+	const char *name;
+	const char *query;
+} shapes[] = {
+	{"all", ""},
+	{"tag", "t0"},
+	{"rare", "%r"},
+	{"and", "t0 t1"},
+	{"and_rare", "t0 %m"},
+	{"or", "t1 | t2"},
+	{"not", "!t0"},
+	{"prefix", "t1*"},
+	{"mixed", "(t1 | t2) !t0"},
+	{"untagged", ":untagged"},
+};
+
+// Title searches timed, each with a tag query to narrow it down. Files
+// are titled fileN.txt.
+static const struct {
+	const char *name;
+	const char *terms;
+	const char *query;
+} searches[] = {
+	{"word", "file42", ""},
+	{"prefix", "file1*", ""},
+	{"prefix_tag", "file1*", "t0"},
+};
+
+typedef struct Result {
+	char name[64];
+	double *lat; // Seconds per operation.
+	int n, max;
+	double total; // Seconds for all of them, commit included.
+	long long rows; // Files listed per operation, or -1.
+} Result;
+
+static Result *results = NULL;
+static int nresults = 0;
+
+static int nfiles = 20000;
+static int ntags = 1000;
+static int per_file = 8;
+static double zipf_s = 1.0;
+static int runs = 20;
+static int view_runs = 3;
+static unsigned long long seed = 1;
+static long jobs = 1;
+
+// Leaves room for the names of what's kept inside it.
+static char root[PATH_MAX - 64];
+
+static void usage(int status)
+{
+	fprintf(status ? stderr : stdout,
+                "Usage: tagmage-bench [-n FILES] [-t TAGS] [-k TAGS_PER_FILE]\n"
+                "                     [-s EXPONENT] [-r RUNS] [-v VIEW_RUNS]\n"
+                "                     [-S SEED] [-d DIR]\n"
+                "\n"
+                "  -n FILES          - Files in the library.\n"
+                "  -t TAGS           - Distinct tags, ranked t0, t1, ...\n"
+                "  -k TAGS_PER_FILE  - Tags drawn for each file.\n"
+                "  -s EXPONENT       - Zipf exponent of the tags' ranks.\n"
+                "  -r RUNS           - Times each listing is timed.\n"
+                "  -v VIEW_RUNS      - Times each view build is timed.\n"
+                "  -S SEED           - Seed of the library's tags.\n"
+                "  -d DIR            - Keep the library in DIR.\n");
+	exit(status);
+}
+
+static int estrtoi(const char *str, int min)
+{
+	char *end = NULL;
+	long n;
+
+	errno = 0;
+	n = strtol(str, &end, 0);
+	if (errno || *end || n < min || n > INT_MAX)
+		errx(1, "Invalid number: '%s'", str);
+
+	return (int) n;
+}
+
+static double now()
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// xorshift64*, so runs with the same seed build the same library.
+static unsigned long long rand64()
+{
+	seed ^= seed >> 12;
+	seed ^= seed << 25;
+	seed ^= seed >> 27;
+	return seed * 0x2545F4914F6CDD1DULL;
+}
+
+// Cumulative weights of each tag's rank, 1/rank^s.
+static double *zipf = NULL;
+
+static void zipf_init()
+{
+	double sum = 0;
+
+	zipf = malloc(ntags * sizeof(*zipf));
+	if (zipf == NULL)
+		err(1, "malloc");
+
+	for (int i = 0; i < ntags; i++) {
+		sum += 1 / pow(i + 1, zipf_s);
+		zipf[i] = sum;
+	}
+}
+
+static int zipf_draw()
+{
+	double x = (rand64() >> 11) / 9007199254740992.0 * zipf[ntags - 1];
+	int lo = 0, hi = ntags - 1;
+
+	while (lo < hi) {
+		int mid = lo + (hi - lo) / 2;
+		if (zipf[mid] < x)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	return lo;
+}
+
+static Result *result_start(const char *name, int max)
+{
+	Result *res = NULL;
+
+	results = realloc(results, (nresults + 1) * sizeof(*results));
+	if (results == NULL)
+		err(1, "realloc");
+
+	res = &results[nresults++];
+	memset(res, 0, sizeof(*res));
+	snprintf(res->name, sizeof(res->name), "%s", name);
+	res->max = max;
+	res->rows = -1;
+	res->lat = malloc((max > 0 ? max : 1) * sizeof(*res->lat));
+	if (res->lat == NULL)
+		err(1, "malloc");
+
+	fprintf(stderr, "bench: %s\n", name);
+	return res;
+}
+
+static void result_add(Result *res, double seconds)
+{
+	if (res->n < res->max)
+		res->lat[res->n++] = seconds;
+}
+
+static int cmp_double(const void *a, const void *b)
+{
+	double x = *(const double*) a, y = *(const double*) b;
+
+	return (x > y) - (x < y);
+}
+
+// Nearest-rank percentile of the sorted latencies, in microseconds.
+static double percentile(const Result *res, double p)
+{
+	int rank = (int) ceil(p / 100 * res->n);
+
+	if (res->n == 0)
+		return 0;
+	return res->lat[rank > 0 ? rank - 1 : 0] * 1e6;
+}
+
+static void print_results()
+{
+	printf("{\n");
+	printf("  \"files\": %d,\n", nfiles);
+	printf("  \"tags\": %d,\n", ntags);
+	printf("  \"tags_per_file\": %d,\n", per_file);
+	printf("  \"zipf_exponent\": %g,\n", zipf_s);
+	printf("  \"runs\": %d,\n", runs);
+	printf("  \"view_runs\": %d,\n", view_runs);
+	printf("  \"jobs\": %ld,\n", jobs);
+	printf("  \"results\": [");
+
+	for (int i = 0; i < nresults; i++) {
+		Result *res = &results[i];
+
+		qsort(res->lat, res->n, sizeof(*res->lat), &cmp_double);
+		printf("%s\n    {\"name\": \"%s\", \"ops\": %d, \"seconds\": %.6f,"
+		       " \"ops_per_sec\": %.1f, \"p50_us\": %.1f,"
+		       " \"p90_us\": %.1f, \"p99_us\": %.1f, \"max_us\": %.1f",
+		       i ? "," : "", res->name, res->n, res->total,
+		       res->total > 0 ? res->n / res->total : 0,
+		       percentile(res, 50), percentile(res, 90),
+		       percentile(res, 99), percentile(res, 100));
+		if (res->rows >= 0)
+			printf(", \"rows\": %lld", res->rows);
+		printf("}");
+	}
+
+	printf("\n  ]\n}\n");
+}
+
+// Split a filter into its words, with "%r" and "%m" replaced by tags.
+static TagVector split_query(const char *query)
+{
+	TagVector vec = {0};
+	char buf[BUFF_MAX];
+	char *word = NULL, *save = NULL;
+
+	snprintf(buf, sizeof(buf), "%s", query);
+	vec.tags = calloc(strlen(query) / 2 + 1, sizeof(*vec.tags));
+	if (vec.tags == NULL)
+		err(1, "calloc");
+
+	for (word = strtok_r(buf, " ", &save); word;
+	     word = strtok_r(NULL, " ", &save)) {
+		char tag[32];
+
+		if (STREQ(word, "%r"))
+			snprintf(tag, sizeof(tag), "t%d", ntags - 1);
+		else if (STREQ(word, "%m"))
+			snprintf(tag, sizeof(tag), "t%d", ntags / 2);
+		else
+			snprintf(tag, sizeof(tag), "%s", word);
+
+		vec.tags[vec.size] = strdup(tag);
+		if (vec.tags[vec.size++] == NULL)
+			err(1, "strdup");
+	}
+
+	return vec;
+}
+
+static void free_vector(TagVector *vec)
+{
+	for (int i = 0; i < vec->size; i++)
+		free(vec->tags[i]);
+	free(vec->tags);
+}
+
+static int count_file(const TMFile *file, void *arg)
+{
+	UNUSED(file);
+	(*(long long*) arg)++;
+	return 0;
+}
+
+static void begin()
+{
+	if (tm_begin() < 0)
+		errx(1, "tm_begin: %s", tm_get_error());
+}
+
+static void commit()
+{
+	if (tm_commit() < 0)
+		errx(1, "tm_commit: %s", tm_get_error());
+}
+
+// Write the library's files outside the store, each with its own contents.
+static void make_sources()
+{
+	char path[PATH_MAX + 1];
+
+	snprintf(path, sizeof(path), "%s/src", root);
+	if (mkpath(path, 0700) < 0)
+		err(1, "%s", path);
+
+	for (int i = 0; i < nfiles; i++) {
+		FILE *fp = NULL;
+
+		snprintf(path, sizeof(path), "%s/src/file%d.txt", root, i);
+		fp = fopen(path, "w");
+		if (fp == NULL)
+			err(1, "%s", path);
+		fprintf(fp, "%d\n", i);
+		fclose(fp);
+	}
+}
+
+static void bench_add(int *ids)
+{
+	char path[PATH_MAX + 1];
+	Result *res = result_start("add", nfiles);
+	double start = now();
+
+	begin();
+	for (int i = 0; i < nfiles; i++) {
+		TMFile file;
+		double t;
+
+		snprintf(path, sizeof(path), "%s/src/file%d.txt", root, i);
+		t = now();
+		if (tm_add_file(path, &file) < 0)
+			errx(1, "tm_add_file: %s", tm_get_error());
+		result_add(res, now() - t);
+		ids[i] = file.id;
+	}
+	commit();
+
+	res->total = now() - start;
+}
+
+// Give each file `per_file` distinct tags, and remember them in `tags`.
+static void bench_tag(const int *ids, int *tags)
+{
+	Result *res = result_start("tag", nfiles * per_file);
+	double start = now();
+
+	begin();
+	for (int i = 0; i < nfiles; i++) {
+		int *own = &tags[i * per_file];
+
+		for (int j = 0; j < per_file; j++) {
+			char name[32];
+			double t;
+			int k;
+
+			do {
+				own[j] = zipf_draw();
+				for (k = 0; k < j && own[k] != own[j]; k++)
+					;
+			} while (k < j);
+
+			snprintf(name, sizeof(name), "t%d", own[j]);
+			t = now();
+			if (tmdb_add_tag(ids[i], name) < 0)
+				errx(1, "tmdb_add_tag: %s", tmdb_get_error());
+			result_add(res, now() - t);
+		}
+	}
+	commit();
+
+	res->total = now() - start;
+}
+
+// List each shape of filter `runs` times, from wherever tm_get_files()
+// answers it.
+static void bench_list(const char *prefix)
+{
+	for (size_t i = 0; i < LEN(shapes); i++) {
+		char name[64];
+		TagVector filters = split_query(shapes[i].query);
+		Result *res = NULL;
+		double start;
+
+		snprintf(name, sizeof(name), "%s/%s", prefix, shapes[i].name);
+		res = result_start(name, runs);
+
+		start = now();
+		for (int r = 0; r < runs; r++) {
+			long long rows = 0;
+			double t = now();
+
+			if (tm_get_files(&filters, &count_file, &rows) < 0)
+				errx(1, "tm_get_files: %s", tm_get_error());
+			result_add(res, now() - t);
+			res->rows = rows;
+		}
+		res->total = now() - start;
+
+		free_vector(&filters);
+	}
+}
+
+// Run each title search `runs` times.
+static void bench_search()
+{
+	for (size_t i = 0; i < LEN(searches); i++) {
+		char name[64];
+		TagVector filters = split_query(searches[i].query);
+		Result *res = NULL;
+		double start;
+
+		snprintf(name, sizeof(name), "search/%s", searches[i].name);
+		res = result_start(name, runs);
+
+		start = now();
+		for (int r = 0; r < runs; r++) {
+			long long rows = 0;
+			double t = now();
+
+			if (tmtag_search(searches[i].terms, &filters, 0,
+			                 &count_file, &rows) < 0)
+				errx(1, "tmtag_search: %s", tmtag_get_err());
+			result_add(res, now() - t);
+			res->rows = rows;
+		}
+		res->total = now() - start;
+
+		free_vector(&filters);
+	}
+}
+
+static void bench_index()
+{
+	Result *res = result_start("index", 1);
+	double start = now();
+
+	if (tm_index() < 0)
+		errx(1, "tm_index: %s", tm_get_error());
+	result_add(res, now() - start);
+	res->total = res->lat[0];
+}
+
+static void bench_view(const char *name, const char *query, int by_tag,
+                       int rebuild)
+{
+	char dir[PATH_MAX + 1];
+	TagVector filters = split_query(query);
+	Result *res = result_start(name, view_runs);
+	double start = now();
+
+	snprintf(dir, sizeof(dir), "%s/view", root);
+	for (int r = 0; r < view_runs; r++) {
+		double t = now();
+
+		if (tmview_build(dir, &filters, by_tag, jobs, rebuild) < 0)
+			errx(1, "tmview_build: %s", tmview_get_err());
+		result_add(res, now() - t);
+	}
+	res->total = now() - start;
+
+	free_vector(&filters);
+}
+
+// Untag every tenth file, from its most common tag to its rarest.
+static void bench_untag(const int *ids, const int *tags)
+{
+	Result *res = result_start("untag", (nfiles / 10 + 1) * per_file);
+	double start = now();
+
+	begin();
+	for (int i = 0; i < nfiles; i += 10) {
+		for (int j = 0; j < per_file; j++) {
+			char name[32];
+			double t;
+
+			snprintf(name, sizeof(name), "t%d", tags[i * per_file + j]);
+			t = now();
+			if (tmdb_remove_tag(ids[i], name) < 0)
+				errx(1, "tmdb_remove_tag: %s", tmdb_get_error());
+			result_add(res, now() - t);
+		}
+	}
+	commit();
+
+	res->total = now() - start;
+}
+
+// Remove every tenth file, starting past the untagged ones.
+static void bench_rm(const int *ids)
+{
+	Result *res = result_start("rm", nfiles / 10 + 1);
+	double start = now();
+
+	begin();
+	for (int i = 5; i < nfiles; i += 10) {
+		TMFile file = {.id = ids[i], .title = "", .title_len = 0};
+		double t = now();
+
+		if (tm_rm_file(&file) < 0)
+			errx(1, "tm_rm_file: %s", tm_get_error());
+		result_add(res, now() - t);
+	}
+	commit();
+
+	res->total = now() - start;
+}
+
+static int remove_entry(const char *path, const struct stat *st, int type,
+                        struct FTW *ftw)
+{
+	UNUSED(st);
+	UNUSED(type);
+	UNUSED(ftw);
+	return remove(path);
+}
+
+int main(int argc, char **argv)
+{
+	char store[PATH_MAX + 1];
+	const char *dir = NULL;
+	int *ids = NULL, *tags = NULL;
+	int opt;
+
+	jobs = sysconf(_SC_NPROCESSORS_ONLN);
+	if (jobs < 1)
+		jobs = 1;
+
+	while ((opt = getopt(argc, argv, "hn:t:k:s:r:v:S:d:")) != -1) {
+		switch (opt) {
+		case 'h': usage(0); break;
+		case 'n': nfiles = estrtoi(optarg, 1); break;
+		case 't': ntags = estrtoi(optarg, 1); break;
+		case 'k': per_file = estrtoi(optarg, 0); break;
+		case 's': zipf_s = atof(optarg); break;
+		case 'r': runs = estrtoi(optarg, 1); break;
+		case 'v': view_runs = estrtoi(optarg, 1); break;
+		case 'S': seed = estrtoi(optarg, 1); break;
+		case 'd': dir = optarg; break;
+		default: usage(1);
+		}
+	}
+	if (optind != argc || per_file > ntags)
+		usage(1);
+
+	// Keep the library in `dir` if given, or in a temporary directory
+	// that's removed afterwards.
+	if (dir) {
+		if (strlen(dir) >= sizeof(root))
+			errx(1, "%s: Path too long.", dir);
+		strcpy(root, dir);
+		if (mkpath(root, 0700) < 0)
+			err(1, "%s", root);
+	} else {
+		const char *tmp = getenv("TMPDIR");
+
+		snprintf(root, sizeof(root), "%s/tagmage-bench.XXXXXX",
+		         tmp ? tmp : "/tmp");
+		if (mkdtemp(root) == NULL)
+			err(1, "mkdtemp");
+	}
+
+	snprintf(store, sizeof(store), "%s/store", root);
+	if (tm_init(store) < 0)
+		errx(1, "tm_init: %s", tm_get_error());
+
+	ids = malloc(nfiles * sizeof(*ids));
+	tags = malloc((size_t) nfiles * per_file * sizeof(*tags) + 1);
+	if (ids == NULL || tags == NULL)
+		err(1, "malloc");
+
+	zipf_init();
+	make_sources();
+
+	bench_add(ids);
+	bench_tag(ids, tags);
+	bench_list("list");
+	bench_search();
+	bench_index();
+	bench_list("list_index");
+	bench_view("view", "t0", 0, 1);
+	bench_view("view_tags", "t1", 1, 1);
+	bench_untag(ids, tags);
+	bench_view("view_update", "t0", 0, 0);
+	bench_rm(ids);
+	bench_list("list_changed");
+
+	print_results();
+
+	tmdb_cleanup();
+	if (dir == NULL)
+		nftw(root, &remove_entry, 16, FTW_DEPTH | FTW_PHYS);
+
+	for (int i = 0; i < nresults; i++)
+		free(results[i].lat);
+	free(results);
+	free(zipf);
+	free(tags);
+	free(ids);
+	return 0;
+}
@@ -0,0 +1,716 @@
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "bitmap.h"
+#include "util.h"
+
+// Containers as bitmap_write() lays them out, followed by their data.
+typedef struct DiskHeader {
+	uint32_t n;
+	uint32_t reserved;
+} DiskHeader;
+
+typedef struct DiskContainer {
+	uint16_t key;
+	uint16_t is_bitmap;
+	uint32_t card;
+	uint32_t offset; // From the start of the DiskHeader.
+	uint32_t reserved;
+} DiskContainer;
+
+#define PAD8(N) (((N) + 7) & ~(size_t) 7)
+
+static size_t data_size(const Container *c)
+{
+	return c->is_bitmap ? BITMAP_WORDS * sizeof(uint64_t)
+		: c->card * sizeof(uint16_t);
+}
+
+static int has_bit(const uint64_t *words, uint16_t low)
+{
+	return (words[low >> 6] >> (low & 63)) & 1;
+}
+
+static uint32_t count_words(const uint64_t *words)
+{
+	uint32_t card = 0;
+
+	for (int i = 0; i < BITMAP_WORDS; i++)
+		card += __builtin_popcountll(words[i]);
+
+	return card;
+}
+
+// Find the container with `key`, or where it would be inserted.
+static uint32_t find(const Bitmap *bm, uint16_t key)
+{
+	uint32_t lo = 0, hi = bm->n;
+
+	// Ids mostly arrive in order, so try the end first.
+	if (bm->n && bm->containers[bm->n - 1].key < key)
+		return bm->n;
+
+	while (lo < hi) {
+		uint32_t mid = lo + (hi - lo) / 2;
+
+		if (bm->containers[mid].key < key)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	return lo;
+}
+
+// Make room for one more container.
+static int reserve(Bitmap *bm)
+{
+	uint32_t cap = bm->cap ? bm->cap * 2 : 4;
+	Container *grown = NULL;
+
+	if (bm->n < bm->cap)
+		return 0;
+
+	grown = realloc(bm->containers, cap * sizeof(*grown));
+	if (grown == NULL)
+		return -1;
+
+	bm->containers = grown;
+	bm->cap = cap;
+	return 0;
+}
+
+// Append a container to a bitmap being built, taking over its data. Empty
+// containers are freed instead.
+static int push(Bitmap *bm, Container *c)
+{
+	if (c->card == 0 || reserve(bm) < 0) {
+		free(c->data);
+		return c->card == 0 ? 0 : -1;
+	}
+
+	bm->containers[bm->n++] = *c;
+	return 0;
+}
+
+// Start a container owning a fresh array of `cap` values.
+static int new_array(Container *c, uint16_t key, uint32_t cap)
+{
+	c->key = key;
+	c->is_bitmap = 0;
+	c->card = 0;
+	c->cap = cap ? cap : 1;
+	c->data = malloc(c->cap * sizeof(uint16_t));
+	return c->data ? 0 : -1;
+}
+
+// Start a container owning a fresh, empty bitmap.
+static int new_bitmap(Container *c, uint16_t key)
+{
+	c->key = key;
+	c->is_bitmap = 1;
+	c->card = 0;
+	c->cap = BITMAP_WORDS;
+	c->data = calloc(BITMAP_WORDS, sizeof(uint64_t));
+	return c->data ? 0 : -1;
+}
+
+// Turn a full array container into a bitmap one.
+static int array_to_bitmap(Container *c)
+{
+	const uint16_t *values = c->data;
+	uint64_t *words = calloc(BITMAP_WORDS, sizeof(uint64_t));
+
+	if (words == NULL)
+		return -1;
+
+	for (uint32_t i = 0; i < c->card; i++)
+		words[values[i] >> 6] |= (uint64_t) 1 << (values[i] & 63);
+
+	free(c->data);
+	c->data = words;
+	c->is_bitmap = 1;
+	c->cap = BITMAP_WORDS;
+	return 0;
+}
+
+// Turn a bitmap container into an array one, if it's sparse enough.
+static int shrink(Container *c)
+{
+	const uint64_t *words = c->data;
+	uint16_t *values = NULL;
+	uint32_t n = 0;
+
+	if (!c->is_bitmap || c->card > BITMAP_ARRAY_MAX || c->card == 0)
+		return 0;
+
+	values = malloc(c->card * sizeof(*values));
+	if (values == NULL)
+		return -1;
+
+	for (int i = 0; i < BITMAP_WORDS; i++) {
+		uint64_t word = words[i];
+
+		while (word) {
+			values[n++] = i * 64 + __builtin_ctzll(word);
+			word &= word - 1;
+		}
+	}
+
+	free(c->data);
+	c->data = values;
+	c->is_bitmap = 0;
+	c->cap = c->card;
+	return 0;
+}
+
+static int container_add(Container *c, uint16_t low)
+{
+	uint16_t *values = c->data;
+	uint32_t lo = 0, hi = c->card;
+
+	if (c->is_bitmap) {
+		uint64_t *words = c->data;
+
+		if (!has_bit(words, low)) {
+			words[low >> 6] |= (uint64_t) 1 << (low & 63);
+			c->card++;
+		}
+		return 0;
+	}
+
+	// Try the end first here too.
+	if (c->card && values[c->card - 1] < low) {
+		lo = c->card;
+	} else {
+		while (lo < hi) {
+			uint32_t mid = lo + (hi - lo) / 2;
+
+			if (values[mid] < low)
+				lo = mid + 1;
+			else
+				hi = mid;
+		}
+
+		if (lo < c->card && values[lo] == low)
+			return 0;
+	}
+
+	if (c->card == BITMAP_ARRAY_MAX) {
+		if (array_to_bitmap(c) < 0)
+			return -1;
+		return container_add(c, low);
+	}
+
+	if (c->card == c->cap) {
+		uint32_t cap = c->cap * 2;
+		uint16_t *grown = realloc(c->data, cap * sizeof(*grown));
+
+		if (grown == NULL)
+			return -1;
+
+		c->data = values = grown;
+		c->cap = cap;
+	}
+
+	memmove(values + lo + 1, values + lo, (c->card - lo) * sizeof(*values));
+	values[lo] = low;
+	c->card++;
+	return 0;
+}
+
+// Copy a container into `out`, which owns its copy of the data.
+static int copy_container(Container *out, const Container *c)
+{
+	size_t size = data_size(c);
+
+	*out = *c;
+	out->cap = c->is_bitmap ? BITMAP_WORDS : c->card;
+	out->data = malloc(size ? size : 1);
+	if (out->data == NULL)
+		return -1;
+
+	memcpy(out->data, c->data, size);
+	return 0;
+}
+
+void bitmap_init(Bitmap *bm)
+{
+	bm->containers = NULL;
+	bm->n = bm->cap = 0;
+}
+
+void bitmap_free(Bitmap *bm)
+{
+	for (uint32_t i = 0; i < bm->n; i++) {
+		if (bm->containers[i].cap)
+			free(bm->containers[i].data);
+	}
+
+	free(bm->containers);
+	bitmap_init(bm);
+}
+
+int bitmap_add(Bitmap *bm, uint32_t id)
+{
+	uint16_t key = id >> 16;
+	uint32_t pos = find(bm, key);
+	Container c;
+
+	if (pos == bm->n || bm->containers[pos].key != key) {
+		if (reserve(bm) < 0 || new_array(&c, key, 4) < 0)
+			goto nomem;
+
+		memmove(bm->containers + pos + 1, bm->containers + pos,
+                        (bm->n - pos) * sizeof(c));
+		bm->containers[pos] = c;
+		bm->n++;
+	}
+
+	if (container_add(&bm->containers[pos], id & 0xffff) < 0)
+		goto nomem;
+
+	return 0;
+
+nomem:
+	errno = ENOMEM;
+	return -1;
+}
+
+int bitmap_copy(Bitmap *dst, const Bitmap *src)
+{
+	Bitmap out;
+
+	bitmap_init(&out);
+	for (uint32_t i = 0; i < src->n; i++) {
+		Container c;
+
+		if (copy_container(&c, &src->containers[i]) < 0
+		    || push(&out, &c) < 0)
+			goto nomem;
+	}
+
+	bitmap_free(dst);
+	*dst = out;
+	return 0;
+
+nomem:
+	bitmap_free(&out);
+	errno = ENOMEM;
+	return -1;
+}
+
+// Intersect two containers with the same key into `out`.
+static int container_and(Container *out, const Container *a,
+                         const Container *b)
+{
+	if (a->is_bitmap && b->is_bitmap) {
+		const uint64_t *wa = a->data, *wb = b->data;
+		uint64_t *words = NULL;
+
+		if (new_bitmap(out, a->key) < 0)
+			return -1;
+
+		words = out->data;
+		for (int i = 0; i < BITMAP_WORDS; i++)
+			words[i] = wa[i] & wb[i];
+		out->card = count_words(words);
+		return shrink(out);
+	}
+
+	// Arrays bound the result, so put one first.
+	if (a->is_bitmap) {
+		const Container *t = a;
+		a = b;
+		b = t;
+	}
+
+	if (new_array(out, a->key, MIN(a->card, b->card)) < 0)
+		return -1;
+
+	const uint16_t *va = a->data;
+	uint16_t *values = out->data;
+
+	if (b->is_bitmap) {
+		for (uint32_t i = 0; i < a->card; i++) {
+			if (has_bit(b->data, va[i]))
+				values[out->card++] = va[i];
+		}
+	} else {
+		const uint16_t *vb = b->data;
+		uint32_t i = 0, j = 0;
+
+		while (i < a->card && j < b->card) {
+			if (va[i] < vb[j]) {
+				i++;
+			} else if (va[i] > vb[j]) {
+				j++;
+			} else {
+				values[out->card++] = va[i];
+				i++;
+				j++;
+			}
+		}
+	}
+
+	return 0;
+}
+
+// Subtract a container from one with the same key into `out`.
+static int container_andnot(Container *out, const Container *a,
+                            const Container *b)
+{
+	if (a->is_bitmap) {
+		const uint64_t *wa = a->data;
+		uint64_t *words = NULL;
+
+		if (new_bitmap(out, a->key) < 0)
+			return -1;
+
+		words = out->data;
+		if (b->is_bitmap) {
+			const uint64_t *wb = b->data;
+
+			for (int i = 0; i < BITMAP_WORDS; i++)
+				words[i] = wa[i] & ~wb[i];
+		} else {
+			const uint16_t *vb = b->data;
+
+			memcpy(words, wa, BITMAP_WORDS * sizeof(*words));
+			for (uint32_t i = 0; i < b->card; i++)
+				words[vb[i] >> 6] &= ~((uint64_t) 1 << (vb[i] & 63));
+		}
+
+		out->card = count_words(words);
+		return shrink(out);
+	}
+
+	if (new_array(out, a->key, a->card) < 0)
+		return -1;
+
+	const uint16_t *va = a->data;
+	uint16_t *values = out->data;
+
+	if (b->is_bitmap) {
+		for (uint32_t i = 0; i < a->card; i++) {
+			if (!has_bit(b->data, va[i]))
+				values[out->card++] = va[i];
+		}
+	} else {
+		const uint16_t *vb = b->data;
+		uint32_t j = 0;
+
+		for (uint32_t i = 0; i < a->card; i++) {
+			while (j < b->card && vb[j] < va[i])
+				j++;
+			if (j == b->card || vb[j] != va[i])
+				values[out->card++] = va[i];
+		}
+	}
+
+	return 0;
+}
+
+// Unite two containers with the same key into `out`.
+static int container_or(Container *out, const Container *a,
+                        const Container *b)
+{
+	// Merge into a bitmap unless both are arrays.
+	if (a->is_bitmap || b->is_bitmap) {
+		uint64_t *words = NULL;
+
+		if (!a->is_bitmap) {
+			const Container *t = a;
+			a = b;
+			b = t;
+		}
+
+		if (copy_container(out, a) < 0)
+			return -1;
+
+		words = out->data;
+		if (b->is_bitmap) {
+			const uint64_t *wb = b->data;
+
+			for (int i = 0; i < BITMAP_WORDS; i++)
+				words[i] |= wb[i];
+		} else {
+			const uint16_t *vb = b->data;
+
+			for (uint32_t i = 0; i < b->card; i++)
+				words[vb[i] >> 6] |= (uint64_t) 1 << (vb[i] & 63);
+		}
+
+		out->card = count_words(words);
+		return 0;
+	}
+
+	if (new_array(out, a->key, a->card + b->card) < 0)
+		return -1;
+
+	const uint16_t *va = a->data, *vb = b->data;
+	uint16_t *values = out->data;
+	uint32_t i = 0, j = 0;
+
+	while (i < a->card || j < b->card) {
+		if (j == b->card || (i < a->card && va[i] < vb[j])) {
+			values[out->card++] = va[i++];
+		} else if (i == a->card || vb[j] < va[i]) {
+			values[out->card++] = vb[j++];
+		} else {
+			values[out->card++] = va[i++];
+			j++;
+		}
+	}
+
+	return out->card > BITMAP_ARRAY_MAX ? array_to_bitmap(out) : 0;
+}
+
+int bitmap_and(Bitmap *dst, const Bitmap *a, const Bitmap *b)
+{
+	Bitmap out;
+	uint32_t i = 0, j = 0;
+
+	bitmap_init(&out);
+	while (i < a->n && j < b->n) {
+		const Container *ca = &a->containers[i], *cb = &b->containers[j];
+		Container c;
+
+		if (ca->key < cb->key) {
+			i++;
+		} else if (ca->key > cb->key) {
+			j++;
+		} else {
+			if (container_and(&c, ca, cb) < 0 || push(&out, &c) < 0)
+				goto nomem;
+			i++;
+			j++;
+		}
+	}
+
+	bitmap_free(dst);
+	*dst = out;
+	return 0;
+
+nomem:
+	bitmap_free(&out);
+	errno = ENOMEM;
+	return -1;
+}
+
+int bitmap_andnot(Bitmap *dst, const Bitmap *a, const Bitmap *b)
+{
+	Bitmap out;
+	uint32_t j = 0;
+
+	bitmap_init(&out);
+	for (uint32_t i = 0; i < a->n; i++) {
+		const Container *ca = &a->containers[i];
+		Container c;
+		int rc;
+
+		while (j < b->n && b->containers[j].key < ca->key)
+			j++;
+
+		if (j < b->n && b->containers[j].key == ca->key) {
+			rc = container_andnot(&c, ca, &b->containers[j]);
+		} else {
+			// Nothing to subtract; copy the container as is.
+			rc = copy_container(&c, ca);
+		}
+
+		if (rc < 0 || push(&out, &c) < 0)
+			goto nomem;
+	}
+
+	bitmap_free(dst);
+	*dst = out;
+	return 0;
+
+nomem:
+	bitmap_free(&out);
+	errno = ENOMEM;
+	return -1;
+}
+
+int bitmap_or(Bitmap *dst, const Bitmap *a, const Bitmap *b)
+{
+	Bitmap out;
+	uint32_t i = 0, j = 0;
+
+	bitmap_init(&out);
+	while (i < a->n || j < b->n) {
+		const Container *ca = i < a->n ? &a->containers[i] : NULL;
+		const Container *cb = j < b->n ? &b->containers[j] : NULL;
+		Container c;
+		int rc;
+
+		if (cb == NULL || (ca && ca->key < cb->key)) {
+			rc = copy_container(&c, ca);
+			i++;
+		} else if (ca == NULL || cb->key < ca->key) {
+			rc = copy_container(&c, cb);
+			j++;
+		} else {
+			rc = container_or(&c, ca, cb);
+			i++;
+			j++;
+		}
+
+		if (rc < 0 || push(&out, &c) < 0)
+			goto nomem;
+	}
+
+	bitmap_free(dst);
+	*dst = out;
+	return 0;
+
+nomem:
+	bitmap_free(&out);
+	errno = ENOMEM;
+	return -1;
+}
+
+uint64_t bitmap_count(const Bitmap *bm)
+{
+	uint64_t count = 0;
+
+	for (uint32_t i = 0; i < bm->n; i++)
+		count += bm->containers[i].card;
+
+	return count;
+}
+
+void bitmap_each(const Bitmap *bm, bitmap_callback callback, void *arg)
+{
+	bitmap_each_from(bm, 0, callback, arg);
+}
+
+void bitmap_each_from(const Bitmap *bm, uint32_t first,
+                      bitmap_callback callback, void *arg)
+{
+	for (uint32_t i = find(bm, first >> 16); i < bm->n; i++) {
+		const Container *c = &bm->containers[i];
+		uint32_t high = (uint32_t) c->key << 16;
+		// Where to start within the first container.
+		uint16_t low = c->key == first >> 16 ? first & 0xffff : 0;
+
+		if (!c->is_bitmap) {
+			const uint16_t *values = c->data;
+			uint32_t lo = 0, hi = c->card;
+
+			while (lo < hi) {
+				uint32_t mid = lo + (hi - lo) / 2;
+
+				if (values[mid] < low)
+					lo = mid + 1;
+				else
+					hi = mid;
+			}
+
+			for (uint32_t j = lo; j < c->card; j++) {
+				if (callback(high | values[j], arg))
+					return;
+			}
+			continue;
+		}
+
+		const uint64_t *words = c->data;
+
+		for (int w = low >> 6; w < BITMAP_WORDS; w++) {
+			uint64_t word = words[w];
+
+			if (w == low >> 6)
+				word &= ~(uint64_t) 0 << (low & 63);
+
+			while (word) {
+				if (callback(high | (w * 64 + __builtin_ctzll(word)),
+                                             arg))
+					return;
+				word &= word - 1;
+			}
+		}
+	}
+}
+
+int bitmap_write(const Bitmap *bm, FILE *f)
+{
+	static const char zeros[8] = {0};
+	DiskHeader header = {.n = bm->n};
+	size_t offset = sizeof(header) + bm->n * sizeof(DiskContainer);
+
+	if (fwrite(&header, sizeof(header), 1, f) != 1)
+		return -1;
+
+	for (uint32_t i = 0; i < bm->n; i++) {
+		const Container *c = &bm->containers[i];
+		DiskContainer dc = {
+			.key = c->key,
+			.is_bitmap = c->is_bitmap,
+			.card = c->card,
+			.offset = offset,
+		};
+
+		if (fwrite(&dc, sizeof(dc), 1, f) != 1)
+			return -1;
+		offset += PAD8(data_size(c));
+	}
+
+	for (uint32_t i = 0; i < bm->n; i++) {
+		const Container *c = &bm->containers[i];
+		size_t size = data_size(c);
+
+		if (fwrite(c->data, 1, size, f) != size
+		    || fwrite(zeros, 1, PAD8(size) - size, f) != PAD8(size) - size)
+			return -1;
+	}
+
+	return 0;
+}
+
+int bitmap_map(Bitmap *bm, const void *data, size_t len)
+{
+	const DiskHeader *header = data;
+	const DiskContainer *dcs = NULL;
+
+	bitmap_init(bm);
+	if (len < sizeof(*header)
+	    || (len - sizeof(*header)) / sizeof(*dcs) < header->n)
+		goto invalid;
+
+	dcs = (const DiskContainer*) (header + 1);
+	bm->containers = calloc(header->n ? header->n : 1,
+                                sizeof(*bm->containers));
+	if (bm->containers == NULL) {
+		errno = ENOMEM;
+		return -1;
+	}
+	bm->cap = header->n;
+
+	for (uint32_t i = 0; i < header->n; i++) {
+		Container c = {
+			.key = dcs[i].key,
+			.is_bitmap = dcs[i].is_bitmap,
+			.card = dcs[i].card,
+			.cap = 0,
+		};
+
+		// Don't trust anything that would read past the end.
+		if ((!c.is_bitmap && c.card > BITMAP_ARRAY_MAX)
+		    || dcs[i].offset % 8 || dcs[i].offset > len
+		    || len - dcs[i].offset < data_size(&c)
+		    || (i && c.key <= bm->containers[i - 1].key))
+			goto invalid;
+
+		c.data = (char*) data + dcs[i].offset;
+		bm->containers[bm->n++] = c;
+	}
+
+	return 0;
+
+invalid:
+	bitmap_free(bm);
+	errno = EINVAL;
+	return -1;
+}
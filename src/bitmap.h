@@ -0,0 +1,107 @@
+#ifndef BITMAP_H
+#define BITMAP_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+// Ids sharing their upper 16 bits share a container, which holds the lower
+// 16 bits either as a sorted array, or as a bitmap once there are more
+// than BITMAP_ARRAY_MAX of them.
+#define BITMAP_ARRAY_MAX 4096
+#define BITMAP_WORDS (65536 / 64)
+
+typedef struct Container {
+	uint16_t key;
+	uint16_t is_bitmap;
+	uint32_t card;
+	uint32_t cap;  // Array capacity, or 0 if `data` is borrowed.
+	void *data;    // uint16_t[card], or uint64_t[BITMAP_WORDS].
+} Container;
+
+typedef struct Bitmap {
+	Container *containers; // Sorted by key.
+	uint32_t n, cap;
+} Bitmap;
+
+typedef int (*bitmap_callback)(uint32_t, void*);
+
+/*
+ * bitmap.h -- Compressed sets of file ids, in the style of roaring bitmaps.
+ * Sparse ranges of ids are kept as sorted arrays and dense ones as plain
+ * bitmaps, so set operations run over whole 64-bit words at a time.
+ *
+ * Functions returning int return 0 on success, or -1 and set errno on error.
+ */
+
+/**
+ * bitmap_init() - Start an empty bitmap.
+ */
+void bitmap_init(Bitmap *bm);
+
+/**
+ * bitmap_free() - Free a bitmap, and make it empty again.
+ */
+void bitmap_free(Bitmap *bm);
+
+/**
+ * bitmap_add() - Add an id to the bitmap. Adding ids in ascending order is
+ * fastest.
+ */
+int bitmap_add(Bitmap *bm, uint32_t id);
+
+/**
+ * bitmap_copy() - Replace `dst` with a copy of `src`.
+ */
+int bitmap_copy(Bitmap *dst, const Bitmap *src);
+
+/**
+ * bitmap_and() - Replace `dst` with the ids in both `a` and `b`.
+ */
+int bitmap_and(Bitmap *dst, const Bitmap *a, const Bitmap *b);
+
+/**
+ * bitmap_andnot() - Replace `dst` with the ids in `a` but not in `b`.
+ */
+int bitmap_andnot(Bitmap *dst, const Bitmap *a, const Bitmap *b);
+
+/**
+ * bitmap_or() - Replace `dst` with the ids in either `a` or `b`.
+ */
+int bitmap_or(Bitmap *dst, const Bitmap *a, const Bitmap *b);
+
+/**
+ * bitmap_count() - Return the number of ids in the bitmap.
+ */
+uint64_t bitmap_count(const Bitmap *bm);
+
+/**
+ * bitmap_each() - Call `callback` for every id in ascending order, until it
+ * returns nonzero.
+ *
+ * arg - A void pointer that also gets passed to `callback`.
+ */
+void bitmap_each(const Bitmap *bm, bitmap_callback callback, void *arg);
+
+/**
+ * bitmap_each_from() - Like bitmap_each(), but starting from the first id
+ * that is at least `first`.
+ */
+void bitmap_each_from(const Bitmap *bm, uint32_t first,
+                      bitmap_callback callback, void *arg);
+
+/**
+ * bitmap_write() - Write the bitmap to `f` in the form bitmap_map() reads,
+ * padded to a multiple of 8 bytes.
+ */
+int bitmap_write(const Bitmap *bm, FILE *f);
+
+/**
+ * bitmap_map() - Read a bitmap written by bitmap_write() from `len` bytes
+ * of 8-byte aligned memory. The bitmap borrows the memory instead of
+ * copying it, so it must outlive the bitmap, and the bitmap must not be
+ * added to.
+ */
+int bitmap_map(Bitmap *bm, const void *data, size_t len);
+
+#endif // BITMAP_H
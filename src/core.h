@@ -10,9 +10,36 @@
 
 #define BUFF_MAX 4096
 
+// Hex digits of a SHA-256 content hash.
+#define HASH_MAX 64
+
+// Tuning for the database connection. See tm_default_options().
+typedef struct TMOptions {
+	const char *journal_mode; // "WAL", "DELETE", "TRUNCATE", ...
+	const char *synchronous; // "OFF", "NORMAL", "FULL" or "EXTRA"
+	long long mmap_size; // Bytes of the database to memory-map.
+	long long cache_size; // Pages to cache, or KiB if negative.
+	int busy_timeout; // Milliseconds to wait for a locked database.
+} TMOptions;
+
+// A file's row. The title is borrowed rather than copied: files passed to
+// a callback only hold it until the callback returns. See tm_copy_file().
 typedef struct TMFile {
 	int id;
-	unsigned char title[TITLE_MAX + 1];
+	const char *title; // Null-terminated, `title_len` bytes long.
+	size_t title_len;
+	char hash[HASH_MAX + 1]; // Empty unless the file is deduplicated.
 } TMFile;
 
+typedef enum { TM_SORT_ID, TM_SORT_TITLE } TMSort;
+
+// One page of a listing. Pages start right after a given file in the sort
+// order rather than at an offset, so every page costs the same to fetch.
+typedef struct TMPage {
+	TMSort sort;
+	int limit; // Most files on the page, or 0 for no limit.
+	int after; // Id of the file the page follows, or 0 for the first page.
+	const char *after_title; // Title of that file, to sort by title.
+} TMPage;
+
 #endif // CORE_H
@@ -0,0 +1,425 @@
+#define _GNU_SOURCE // struct ucred, __fpurge
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdio_ext.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+
+#include "core.h"
+#include "daemon.h"
+#include "util.h"
+
+// Largest request accepted, which is well past the kernel's own limit on
+// a command line.
+#define REQUEST_MAX (16 << 20)
+
+// How long a client waits for the daemon to take its request before
+// running the command itself, in milliseconds.
+#define READY_TIMEOUT 200
+
+// Each request starts with this, alongside the client's standard input,
+// output and error. The working directory and arguments follow, each
+// null-terminated.
+typedef struct RequestHeader {
+	uint32_t len;
+} RequestHeader;
+
+static char err_buf[BUFF_MAX] = {0};
+static volatile sig_atomic_t stopping = 0;
+
+static void seterr(const char *what)
+{
+	snprintf(err_buf, sizeof(err_buf), "%s: %s", what, strerror(errno));
+}
+
+static void stop(int sig)
+{
+	UNUSED(sig);
+	stopping = 1;
+}
+
+static int socket_addr(struct sockaddr_un *addr, const char *path)
+{
+	memset(addr, 0, sizeof(*addr));
+	addr->sun_family = AF_UNIX;
+
+	if (strlen(path) >= sizeof(addr->sun_path)) {
+		errno = ENAMETOOLONG;
+		return -1;
+	}
+
+	strcpy(addr->sun_path, path);
+	return 0;
+}
+
+// Connect to the socket at `path`, or return -1.
+static int dial(const char *path)
+{
+	struct sockaddr_un addr;
+	int fd;
+
+	if (socket_addr(&addr, path) < 0)
+		return -1;
+
+	fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (fd < 0)
+		return -1;
+
+	if (connect(fd, (struct sockaddr*) &addr, sizeof(addr)) != 0) {
+		close(fd);
+		return -1;
+	}
+
+	return fd;
+}
+
+// Whether the other end of `conn` runs as the same user as we do.
+static int same_user(int conn)
+{
+	struct ucred cred;
+	socklen_t len = sizeof(cred);
+
+	return getsockopt(conn, SOL_SOCKET, SO_PEERCRED, &cred, &len) == 0
+	       && cred.uid == geteuid();
+}
+
+// Wait for the daemon to signal it's ready for the request, which it
+// does once it's done with the ones before it.
+static int wait_ready(int conn)
+{
+	struct pollfd pfd = {.fd = conn, .events = POLLIN};
+	char ready;
+	int rc;
+
+	do {
+		rc = poll(&pfd, 1, READY_TIMEOUT);
+	} while (rc < 0 && errno == EINTR);
+
+	if (rc <= 0 || recv(conn, &ready, 1, 0) != 1)
+		return -1;
+	return 0;
+}
+
+static int read_all(int fd, void *buf, size_t len)
+{
+	char *p = buf;
+
+	while (len > 0) {
+		ssize_t n = read(fd, p, len);
+
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			return -1;
+
+		p += n;
+		len -= n;
+	}
+
+	return 0;
+}
+
+static int send_all(int fd, const void *buf, size_t len)
+{
+	const char *p = buf;
+
+	while (len > 0) {
+		ssize_t n = send(fd, p, len, MSG_NOSIGNAL);
+
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n < 0)
+			return -1;
+
+		p += n;
+		len -= n;
+	}
+
+	return 0;
+}
+
+// Receive a request's header and the client's standard streams.
+static int recv_header(int conn, RequestHeader *header, int fds[3])
+{
+	char control[CMSG_SPACE(3 * sizeof(int))];
+	struct iovec iov = {.iov_base = header, .iov_len = sizeof(*header)};
+	struct msghdr msg = {
+		.msg_iov = &iov,
+		.msg_iovlen = 1,
+		.msg_control = control,
+		.msg_controllen = sizeof(control),
+	};
+	struct cmsghdr *cmsg = NULL;
+
+	if (recvmsg(conn, &msg, 0) != sizeof(*header))
+		return -1;
+
+	cmsg = CMSG_FIRSTHDR(&msg);
+	if (cmsg == NULL || cmsg->cmsg_level != SOL_SOCKET
+	    || cmsg->cmsg_type != SCM_RIGHTS
+	    || cmsg->cmsg_len != CMSG_LEN(3 * sizeof(int)))
+		return -1;
+
+	memcpy(fds, CMSG_DATA(cmsg), 3 * sizeof(int));
+	return 0;
+}
+
+static int send_header(int conn, RequestHeader *header)
+{
+	static const int fds[3] = {STDIN_FILENO, STDOUT_FILENO, STDERR_FILENO};
+	char control[CMSG_SPACE(sizeof(fds))];
+	struct iovec iov = {.iov_base = header, .iov_len = sizeof(*header)};
+	struct msghdr msg = {
+		.msg_iov = &iov,
+		.msg_iovlen = 1,
+		.msg_control = control,
+		.msg_controllen = sizeof(control),
+	};
+	struct cmsghdr *cmsg = NULL;
+
+	memset(control, 0, sizeof(control));
+	cmsg = CMSG_FIRSTHDR(&msg);
+	cmsg->cmsg_level = SOL_SOCKET;
+	cmsg->cmsg_type = SCM_RIGHTS;
+	cmsg->cmsg_len = CMSG_LEN(sizeof(fds));
+	memcpy(CMSG_DATA(cmsg), fds, sizeof(fds));
+
+	return sendmsg(conn, &msg, MSG_NOSIGNAL) == sizeof(*header) ? 0 : -1;
+}
+
+// Run one request in the client's directory, with the client's standard
+// streams in place of our own.
+static int run_request(const char *cwd, int argc, char **argv, int fds[3],
+                       request_handler handler)
+{
+	int saved[3] = {-1, -1, -1};
+	int saved_cwd = open(".", O_RDONLY);
+	int status = 1;
+
+	if (saved_cwd < 0)
+		return 1;
+
+	fflush(stdout);
+	fflush(stderr);
+	for (int i = 0; i < 3; i++) {
+		saved[i] = dup(i);
+		if (saved[i] < 0 || dup2(fds[i], i) < 0)
+			goto restore;
+	}
+	__fpurge(stdin);
+	clearerr(stdin);
+
+	if (chdir(cwd) != 0) {
+		fprintf(stderr, "tagmage: %s: %s\n", cwd, strerror(errno));
+		goto restore;
+	}
+
+	status = handler(argc, argv);
+
+restore:
+	// Write out what's left for the client, and discard what was read
+	// ahead from its input, so neither leaks into the next request.
+	fflush(stdout);
+	fflush(stderr);
+	__fpurge(stdin);
+	clearerr(stdin);
+
+	for (int i = 0; i < 3; i++) {
+		if (saved[i] >= 0) {
+			dup2(saved[i], i);
+			close(saved[i]);
+		}
+	}
+
+	if (fchdir(saved_cwd) != 0)
+		status = 1;
+	close(saved_cwd);
+	return status;
+}
+
+static void serve_conn(int conn, request_handler handler)
+{
+	RequestHeader header;
+	int fds[3] = {-1, -1, -1};
+	char *payload = NULL, **argv = NULL;
+	int32_t status = 1;
+	int argc = 0;
+
+	// The socket's mode already keeps other users out, but root gets
+	// past it.
+	if (!same_user(conn) || send_all(conn, "", 1) < 0)
+		return;
+
+	if (recv_header(conn, &header, fds) < 0 || header.len == 0
+	    || header.len > REQUEST_MAX)
+		goto cleanup;
+
+	payload = malloc(header.len);
+	if (payload == NULL || read_all(conn, payload, header.len) < 0
+	    || payload[header.len - 1] != '\0')
+		goto cleanup;
+
+	// The working directory comes first, then the arguments.
+	for (uint32_t i = 0; i < header.len; i++)
+		argc += payload[i] == '\0';
+	argc--;
+
+	argv = calloc(argc + 1, sizeof(*argv));
+	if (argv == NULL)
+		goto cleanup;
+
+	for (char *p = payload + strlen(payload) + 1, **arg = argv;
+	     p < payload + header.len; p += strlen(p) + 1)
+		*arg++ = p;
+
+	status = run_request(payload, argc, argv, fds, handler);
+
+cleanup:
+	send_all(conn, &status, sizeof(status));
+
+	for (int i = 0; i < 3; i++) {
+		if (fds[i] >= 0)
+			close(fds[i]);
+	}
+	free(argv);
+	free(payload);
+}
+
+const char *tmd_get_err()
+{
+	return err_buf;
+}
+
+int tmd_serve(const char *path, request_handler handler)
+{
+	struct sockaddr_un addr;
+	struct sigaction sa;
+	mode_t mask;
+	int fd, conn, rc;
+
+	if (socket_addr(&addr, path) < 0) {
+		seterr(path);
+		return -1;
+	}
+
+	// A socket nobody answers on is left over from a daemon that
+	// didn't exit cleanly.
+	conn = dial(path);
+	if (conn >= 0) {
+		close(conn);
+		snprintf(err_buf, sizeof(err_buf),
+                         "%s: A daemon is already running.", path);
+		return -1;
+	}
+	unlink(path);
+
+	fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (fd < 0) {
+		seterr("socket");
+		return -1;
+	}
+
+	// Create the socket accessible to us alone from the start.
+	mask = umask(077);
+	rc = bind(fd, (struct sockaddr*) &addr, sizeof(addr));
+	umask(mask);
+
+	if (rc != 0 || listen(fd, 16) != 0) {
+		seterr(path);
+		close(fd);
+		unlink(path);
+		return -1;
+	}
+
+	// Stop between requests, and never die from a client going away
+	// mid-request.
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = &stop;
+	sigemptyset(&sa.sa_mask);
+	sigaction(SIGINT, &sa, NULL);
+	sigaction(SIGTERM, &sa, NULL);
+	signal(SIGPIPE, SIG_IGN);
+
+	while (!stopping) {
+		conn = accept(fd, NULL, NULL);
+		if (conn < 0) {
+			if (errno == EINTR || errno == ECONNABORTED)
+				continue;
+
+			seterr("accept");
+			close(fd);
+			unlink(path);
+			return -1;
+		}
+
+		serve_conn(conn, handler);
+		close(conn);
+	}
+
+	close(fd);
+	unlink(path);
+	return 0;
+}
+
+int tmd_call(const char *path, int argc, char **argv)
+{
+	char cwd[PATH_MAX + 1];
+	RequestHeader header = {0};
+	char *payload = NULL, *end = NULL;
+	int32_t status = 1;
+	size_t len;
+	int conn;
+
+	if (getcwd(cwd, sizeof(cwd)) == NULL)
+		return -1;
+
+	len = strlen(cwd) + 1;
+	for (int i = 0; i < argc; i++)
+		len += strlen(argv[i]) + 1;
+	if (len > REQUEST_MAX)
+		return -1;
+
+	// Run the command ourselves rather than wait behind a slow request,
+	// or trust a daemon run by another user.
+	conn = dial(path);
+	if (conn < 0)
+		return -1;
+	if (!same_user(conn) || wait_ready(conn) < 0) {
+		close(conn);
+		return -1;
+	}
+
+	payload = malloc(len);
+	if (payload == NULL) {
+		close(conn);
+		return -1;
+	}
+
+	end = payload;
+	end += sprintf(end, "%s", cwd) + 1;
+	for (int i = 0; i < argc; i++)
+		end += sprintf(end, "%s", argv[i]) + 1;
+
+	// Past this point the daemon may have started running the command,
+	// so it can't be retried without one.
+	header.len = len;
+	if (send_header(conn, &header) < 0 || send_all(conn, payload, len) < 0
+	    || read_all(conn, &status, sizeof(status)) < 0) {
+		fprintf(stderr, "tagmage: Lost the daemon at %s.\n", path);
+		status = 1;
+	}
+
+	free(payload);
+	close(conn);
+	return status;
+}
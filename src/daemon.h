@@ -0,0 +1,37 @@
+#ifndef DAEMON_H
+#define DAEMON_H
+
+/*
+ * daemon.h -- tagmage daemon. A daemon keeps the store open and serves
+ * commands over a Unix socket in the store, so each command skips opening
+ * the database. Clients pass their working directory, their arguments, and
+ * their standard input, output and error, so a command behaves the same
+ * whether the daemon or the client runs it.
+ */
+
+// Name of the socket inside the store.
+#define TMD_SOCKET "tagmaged.sock"
+
+// Runs a command from its arguments, and returns its exit status.
+typedef int (*request_handler)(int argc, char **argv);
+
+/**
+ * tmd_get_err() - Return a cstring containing the latest error.
+ */
+const char *tmd_get_err();
+
+/**
+ * tmd_serve() - Listen on the socket at `path`, and run each request with
+ * `handler` one at a time, until interrupted or terminated. Returns 0 once
+ * stopped, or -1 on error.
+ */
+int tmd_serve(const char *path, request_handler handler);
+
+/**
+ * tmd_call() - Run a command with the daemon listening at `path`. Returns
+ * its exit status, or -1 if no daemon is listening, it runs as another
+ * user, or it's still busy with another request after a short wait.
+ */
+int tmd_call(const char *path, int argc, char **argv);
+
+#endif // DAEMON_H
@@ -1,9 +1,11 @@
 #include <err.h>
 #include <sqlite3.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 
 #include "database.h"
+#include "stats.h"
 #include "util.h"
 
 #define CHECK_STATUS(RC) if (RC != SQLITE_OK && RC != SQLITE_DONE) {	\
@@ -14,12 +16,10 @@
 
 #define PREPARE(STMT, QUERY)					\
 	sqlite3_prepare_v2(db, QUERY, -1, &(STMT), NULL)
-#define BIND(TYPE, STMT, NAME, VAL)				\
-	sqlite3_bind_##TYPE					\
-	(STMT, sqlite3_bind_parameter_index(STMT, NAME), VAL)
-#define BIND_TEXT(STMT, NAME, VAL)					\
-	sqlite3_bind_text						\
-	(STMT, sqlite3_bind_parameter_index(STMT, NAME), VAL, -1, NULL)
+#define BIND(TYPE, STMT, IDX, VAL)				\
+	sqlite3_bind_##TYPE(STMT, IDX, VAL)
+#define BIND_TEXT(STMT, IDX, VAL)				\
+	sqlite3_bind_text(STMT, IDX, VAL, -1, NULL)
 
 	static const char *db_setup_queries[] =
 		{"CREATE TABLE image ("
@@ -39,359 +39,2063 @@
 
 		 0};
 
+// Schema version stored in `PRAGMA user_version`. Databases made before
+// versioning have the tables from db_setup_queries and a version of 0,
+// which is treated as version 1.
+#define SCHEMA_VERSION 9
+
+// Version 2: Cluster image_tag by its primary key, and index it by tag so
+// tag-to-file lookups don't scan the whole table.
+static const char *db_migration_v2[] =
+	{"CREATE TABLE image_tag_new ("
+	 "  image INTEGER NOT NULL,"
+	 "  tag INTEGER NOT NULL,"
+	 "  PRIMARY KEY (image, tag),"
+	 "  FOREIGN KEY (image) REFERENCES image(id) ON DELETE CASCADE,"
+	 "  FOREIGN KEY (tag) REFERENCES tag(id) ON DELETE CASCADE)"
+	 " WITHOUT ROWID;",
+
+	 "INSERT INTO image_tag_new (image, tag)"
+	 " SELECT image, tag FROM image_tag;",
+
+	 "DROP TABLE image_tag;",
+
+	 "ALTER TABLE image_tag_new RENAME TO image_tag;",
+
+	 "CREATE INDEX image_tag_by_tag ON image_tag (tag, image);",
+
+	 0};
+
+// Version 3: Delete a tag as soon as its last file loses it, checking
+// only the tag that changed rather than sweeping the tag table.
+static const char *db_migration_v3[] =
+	{"CREATE TRIGGER image_tag_orphan AFTER DELETE ON image_tag"
+	 " WHEN NOT EXISTS (SELECT 1 FROM image_tag WHERE tag=OLD.tag)"
+	 " BEGIN"
+	 "  DELETE FROM tag WHERE id=OLD.tag;"
+	 " END;",
+
+	 "DELETE FROM tag WHERE id NOT IN (SELECT tag FROM image_tag);",
+
+	 0};
+
+// Version 4: Record the content hash of deduplicated files, which share
+// one stored copy per hash.
+static const char *db_migration_v4[] =
+	{"ALTER TABLE image ADD COLUMN hash TEXT;",
+
+	 "CREATE INDEX image_by_hash ON image (hash) WHERE hash IS NOT NULL;",
+
+	 0};
+
+// Version 5: Keep settings of the store itself. Stores with files keep
+// the flat layout until they're migrated; empty ones start sharded.
+static const char *db_migration_v5[] =
+	{"CREATE TABLE meta ("
+	 "  key TEXT PRIMARY KEY,"
+	 "  value INTEGER NOT NULL)"
+	 " WITHOUT ROWID;",
+
+	 "INSERT INTO meta (key, value)"
+	 " SELECT 'layout', NOT EXISTS (SELECT 1 FROM image);",
+
+	 0};
+
+// Version 6: Log every change to a file, its title or its tags, so views
+// of the store can catch up without being rebuilt. Each entry keeps the
+// title the file had before the change, and the tag for changes to its
+// tags.
+static const char *db_migration_v6[] =
+	{"CREATE TABLE change ("
+	 "  seq INTEGER PRIMARY KEY AUTOINCREMENT,"
+	 "  image INTEGER NOT NULL,"
+	 "  tag TEXT,"
+	 "  title TEXT);",
+
+	 "CREATE TRIGGER image_insert_change AFTER INSERT ON image"
+	 " BEGIN"
+	 "  INSERT INTO change (image, title) VALUES (NEW.id, NEW.title);"
+	 " END;",
+
+	 "CREATE TRIGGER image_title_change AFTER UPDATE OF title ON image"
+	 " BEGIN"
+	 "  INSERT INTO change (image, title) VALUES (OLD.id, OLD.title);"
+	 " END;",
+
+	 "CREATE TRIGGER image_delete_change AFTER DELETE ON image"
+	 " BEGIN"
+	 "  INSERT INTO change (image, title) VALUES (OLD.id, OLD.title);"
+	 " END;",
+
+	 "CREATE TRIGGER image_tag_insert_change AFTER INSERT ON image_tag"
+	 " BEGIN"
+	 "  INSERT INTO change (image, tag, title) VALUES (NEW.image,"
+	 "   (SELECT name FROM tag WHERE id=NEW.tag),"
+	 "   (SELECT title FROM image WHERE id=NEW.image));"
+	 " END;",
+
+	 // Before the delete, while image_tag_orphan hasn't yet taken the
+	 // tag's name with it.
+	 "CREATE TRIGGER image_tag_delete_change BEFORE DELETE ON image_tag"
+	 " BEGIN"
+	 "  INSERT INTO change (image, tag, title) VALUES (OLD.image,"
+	 "   (SELECT name FROM tag WHERE id=OLD.tag),"
+	 "   (SELECT title FROM image WHERE id=OLD.image));"
+	 " END;",
+
+	 0};
+
+// Version 7: Index titles, so listings sorted by title can seek to a page
+// instead of sorting every file.
+static const char *db_migration_v7[] =
+	{"CREATE INDEX image_by_title ON image (title);",
+
+	 0};
+
+// Version 8: Count each tag's files as they're tagged, so counting every
+// tag reads the tag table instead of grouping all of image_tag. Deletes
+// cascading from image and tag fire these triggers too.
+static const char *db_migration_v8[] =
+	{"ALTER TABLE tag ADD COLUMN files INTEGER NOT NULL DEFAULT 0;",
+
+	 "UPDATE tag SET files=(SELECT count(*) FROM image_tag"
+	 "                      WHERE image_tag.tag=tag.id);",
+
+	 "CREATE TRIGGER image_tag_insert_count AFTER INSERT ON image_tag"
+	 " BEGIN"
+	 "  UPDATE tag SET files=files+1 WHERE id=NEW.tag;"
+	 " END;",
+
+	 "CREATE TRIGGER image_tag_delete_count AFTER DELETE ON image_tag"
+	 " BEGIN"
+	 "  UPDATE tag SET files=files-1 WHERE id=OLD.tag;"
+	 " END;",
+
+	 0};
+
+// Version 9: Never give a new file the id of a removed one, even within the
+// transaction that removed it, where the old file is still stored until
+// it commits. SQLite can't add AUTOINCREMENT to a table, so image is
+// copied into a new one, and its indexes and triggers created again. The
+// title index's triggers are recreated once it's set up. Triggers on other
+// tables name image while it's gone, so the rename mustn't check them.
+static const char *db_migration_v9[] =
+	{"CREATE TABLE image_new ("
+	 "  id INTEGER PRIMARY KEY AUTOINCREMENT,"
+	 "  title VARCHAR(" TITLE_MAX_STR ") NOT NULL,"
+	 "  hash TEXT);",
+
+	 "INSERT INTO image_new (id, title, hash)"
+	 " SELECT id, title, hash FROM image;",
+
+	 "DROP TABLE image;",
+
+	 "PRAGMA legacy_alter_table=ON;",
+
+	 "ALTER TABLE image_new RENAME TO image;",
+
+	 "PRAGMA legacy_alter_table=OFF;",
+
+	 "CREATE INDEX image_by_hash ON image (hash) WHERE hash IS NOT NULL;",
+
+	 "CREATE INDEX image_by_title ON image (title);",
+
+	 "CREATE TRIGGER image_insert_change AFTER INSERT ON image"
+	 " BEGIN"
+	 "  INSERT INTO change (image, title) VALUES (NEW.id, NEW.title);"
+	 " END;",
+
+	 "CREATE TRIGGER image_title_change AFTER UPDATE OF title ON image"
+	 " BEGIN"
+	 "  INSERT INTO change (image, title) VALUES (OLD.id, OLD.title);"
+	 " END;",
+
+	 "CREATE TRIGGER image_delete_change AFTER DELETE ON image"
+	 " BEGIN"
+	 "  INSERT INTO change (image, title) VALUES (OLD.id, OLD.title);"
+	 " END;",
+
+	 0};
+
+// Queries that upgrade the schema from the version before each index.
+static const char **db_migrations[SCHEMA_VERSION + 1] = {
+	[2] = db_migration_v2,
+	[3] = db_migration_v3,
+	[4] = db_migration_v4,
+	[5] = db_migration_v5,
+	[6] = db_migration_v6,
+	[7] = db_migration_v7,
+	[8] = db_migration_v8,
+	[9] = db_migration_v9,
+};
+
+// Titles are searched through an FTS5 index, in builds of SQLite that have
+// it. It isn't part of the versioned schema, since builds without FTS5
+// must still open the store: they drop the triggers that keep it up to
+// date instead, and builds with it rebuild it when they next open it.
+static const char *title_index_queries[] =
+	{"CREATE VIRTUAL TABLE IF NOT EXISTS image_search USING fts5("
+	 "  title,"
+	 "  content='image',"
+	 "  content_rowid='id',"
+	 "  tokenize='unicode61 remove_diacritics 2',"
+	 "  prefix='2 3');",
+
+	 "INSERT INTO image_search (image_search) VALUES ('rebuild');",
+
+	 "CREATE TRIGGER IF NOT EXISTS image_search_insert"
+	 " AFTER INSERT ON image"
+	 " BEGIN"
+	 "  INSERT INTO image_search (rowid, title)"
+	 "   VALUES (NEW.id, NEW.title);"
+	 " END;",
+
+	 "CREATE TRIGGER IF NOT EXISTS image_search_delete"
+	 " AFTER DELETE ON image"
+	 " BEGIN"
+	 "  INSERT INTO image_search (image_search, rowid, title)"
+	 "   VALUES ('delete', OLD.id, OLD.title);"
+	 " END;",
+
+	 "CREATE TRIGGER IF NOT EXISTS image_search_update"
+	 " AFTER UPDATE OF title ON image"
+	 " BEGIN"
+	 "  INSERT INTO image_search (image_search, rowid, title)"
+	 "   VALUES ('delete', OLD.id, OLD.title);"
+	 "  INSERT INTO image_search (rowid, title)"
+	 "   VALUES (NEW.id, NEW.title);"
+	 " END;",
+
+	 0};
+
+static const char *title_index_drop_queries[] =
+	{"DROP TRIGGER IF EXISTS image_search_insert;",
+	 "DROP TRIGGER IF EXISTS image_search_delete;",
+	 "DROP TRIGGER IF EXISTS image_search_update;",
+	 0};
+
+// Number of changes tmdb_gc() keeps, so recently synced views still catch
+// up instead of being rebuilt.
+#define CHANGES_KEPT 65536
+
+// Every statement tagmage runs more than once is prepared a single time
+// in tmdb_setup(), and reset after each use. Parameters are bound by
+// position.
+enum {
+	STMT_NEW_FILE,
+	STMT_IMPORT_FILE,
+	STMT_EDIT_TITLE,
+	STMT_NEW_TAG,
+	STMT_GET_TAG_ID,
+	STMT_ADD_TAG,
+	STMT_REMOVE_TAG,
+	STMT_DELETE_FILE,
+	STMT_CLEANUP_TAGS,
+	STMT_GET_FILE,
+	STMT_GET_FILES,
+	STMT_HAS_TAG,
+	STMT_GET_TAGS,
+	STMT_GET_TAGS_BY_FILE,
+	STMT_GET_TAG_COUNTS,
+	STMT_GET_TAG_COUNTS_BY_FILE,
+	STMT_GET_COOCCURRING,
+	STMT_GET_MEMBERSHIPS,
+	STMT_EXPORT,
+	STMT_HAS_TAGS,
+	STMT_COUNT_HASH,
+	STMT_GET_CHANGE_SEQ,
+	STMT_GET_CHANGES,
+	STMT_GET_CHANGED_MEMBERSHIPS,
+	STMT_PRUNE_CHANGES,
+	STMT_GET_META,
+	STMT_SET_META,
+	STMT_DATA_VERSION,
+	STMT_BEGIN,
+	STMT_COMMIT,
+	STMT_ROLLBACK,
+	STMT_COUNT,
+
+	// Statements prepared anew for each query, kept here while they run
+	// so they're timed like the cached ones.
+	STMT_QUERY_FILES = STMT_COUNT,
+	STMT_COUNT_FILES,
+	STMT_SEARCH_FILES,
+	STMT_ALL
+};
+
+static const char *stmt_queries[STMT_COUNT] = {
+	[STMT_NEW_FILE] = "INSERT INTO image (title, hash) VALUES (?1, ?2)",
+	[STMT_IMPORT_FILE] =
+	"INSERT INTO image (id, title, hash) VALUES (?1, ?2, ?3)",
+	[STMT_EDIT_TITLE] = "UPDATE image SET title=?1 WHERE id=?2",
+	[STMT_NEW_TAG] = "INSERT OR IGNORE INTO tag (name) VALUES (?1)",
+	[STMT_GET_TAG_ID] = "SELECT id FROM tag WHERE name=?1",
+	[STMT_ADD_TAG] =
+	"INSERT OR IGNORE INTO image_tag (image, tag) VALUES (?1, ?2)",
+	[STMT_REMOVE_TAG] = "DELETE FROM image_tag WHERE image=?1 AND tag=?2",
+	[STMT_DELETE_FILE] = "DELETE FROM image WHERE id=?1",
+	[STMT_CLEANUP_TAGS] =
+	"DELETE FROM tag WHERE id NOT IN"
+	" (SELECT tag FROM image_tag)",
+	[STMT_GET_FILE] = "SELECT title,hash FROM image WHERE id=?1",
+	[STMT_GET_FILES] = "SELECT id,title,hash FROM image",
+	[STMT_HAS_TAG] = "SELECT image FROM image_tag WHERE image=?1 AND tag=?2",
+	[STMT_GET_TAGS] = "SELECT id, name FROM tag",
+	[STMT_GET_TAGS_BY_FILE] =
+	"SELECT id, name FROM tag"
+	" WHERE id IN (SELECT tag FROM image_tag"
+	"                WHERE image=?1)",
+	[STMT_GET_TAG_COUNTS] = "SELECT id, name, files FROM tag",
+	[STMT_GET_TAG_COUNTS_BY_FILE] =
+	"SELECT id, name, files FROM tag"
+	" WHERE id IN (SELECT tag FROM image_tag"
+	"                WHERE image=?1)",
+	// Walks the tag's files through image_tag_by_tag, and each of their
+	// tags through the primary key.
+	[STMT_GET_COOCCURRING] =
+	"SELECT other.tag, tag.name, count(*) FROM image_tag AS this"
+	" JOIN image_tag AS other"
+	"  ON other.image=this.image AND other.tag<>this.tag"
+	" JOIN tag ON tag.id=other.tag"
+	" WHERE this.tag=(SELECT id FROM tag WHERE name=?1)"
+	" GROUP BY other.tag"
+	" ORDER BY count(*) DESC, other.tag",
+	[STMT_GET_MEMBERSHIPS] =
+	"SELECT image_tag.image, tag.name FROM image_tag"
+	" JOIN tag ON tag.id=image_tag.tag"
+	" ORDER BY image_tag.tag, image_tag.image",
+	[STMT_EXPORT] =
+	"SELECT id, title, hash,"
+	"  (SELECT group_concat(name, ' ') FROM"
+	"   (SELECT tag.name FROM image_tag JOIN tag ON tag.id=image_tag.tag"
+	"    WHERE image_tag.image=image.id ORDER BY tag.name))"
+	" FROM image ORDER BY id",
+	[STMT_HAS_TAGS] = "SELECT tag FROM image_tag WHERE image=?1",
+	[STMT_COUNT_HASH] = "SELECT COUNT(*) FROM image WHERE hash=?1",
+	[STMT_GET_CHANGE_SEQ] =
+	"SELECT seq FROM sqlite_sequence WHERE name='change'",
+	[STMT_GET_CHANGES] =
+	"SELECT image, tag, title FROM change"
+	" WHERE seq>?1"
+	" ORDER BY image, seq",
+	[STMT_GET_CHANGED_MEMBERSHIPS] =
+	"SELECT image_tag.image, tag.name FROM image_tag"
+	" JOIN tag ON tag.id=image_tag.tag"
+	" WHERE image_tag.image IN (SELECT image FROM change WHERE seq>?1)"
+	" ORDER BY image_tag.image",
+	[STMT_PRUNE_CHANGES] = "DELETE FROM change WHERE seq<=?1",
+	[STMT_GET_META] = "SELECT value FROM meta WHERE key=?1",
+	[STMT_SET_META] =
+	"INSERT OR REPLACE INTO meta (key, value) VALUES (?1, ?2)",
+	[STMT_DATA_VERSION] = "PRAGMA data_version",
+	[STMT_BEGIN] = "BEGIN IMMEDIATE",
+	[STMT_COMMIT] = "COMMIT",
+	[STMT_ROLLBACK] = "ROLLBACK",
+};
+
+// Names each statement's stats are recorded under.
+static const char *stmt_names[STMT_ALL] = {
+	[STMT_NEW_FILE] = "sql.new_file",
+	[STMT_IMPORT_FILE] = "sql.import_file",
+	[STMT_EDIT_TITLE] = "sql.edit_title",
+	[STMT_NEW_TAG] = "sql.new_tag",
+	[STMT_GET_TAG_ID] = "sql.get_tag_id",
+	[STMT_ADD_TAG] = "sql.add_tag",
+	[STMT_REMOVE_TAG] = "sql.remove_tag",
+	[STMT_DELETE_FILE] = "sql.delete_file",
+	[STMT_CLEANUP_TAGS] = "sql.cleanup_tags",
+	[STMT_GET_FILE] = "sql.get_file",
+	[STMT_GET_FILES] = "sql.get_files",
+	[STMT_HAS_TAG] = "sql.has_tag",
+	[STMT_GET_TAGS] = "sql.get_tags",
+	[STMT_GET_TAGS_BY_FILE] = "sql.get_tags_by_file",
+	[STMT_GET_TAG_COUNTS] = "sql.get_tag_counts",
+	[STMT_GET_TAG_COUNTS_BY_FILE] = "sql.get_tag_counts_by_file",
+	[STMT_GET_COOCCURRING] = "sql.get_cooccurring",
+	[STMT_GET_MEMBERSHIPS] = "sql.get_memberships",
+	[STMT_EXPORT] = "sql.export",
+	[STMT_HAS_TAGS] = "sql.has_tags",
+	[STMT_COUNT_HASH] = "sql.count_hash",
+	[STMT_GET_CHANGE_SEQ] = "sql.get_change_seq",
+	[STMT_GET_CHANGES] = "sql.get_changes",
+	[STMT_GET_CHANGED_MEMBERSHIPS] = "sql.get_changed_memberships",
+	[STMT_PRUNE_CHANGES] = "sql.prune_changes",
+	[STMT_GET_META] = "sql.get_meta",
+	[STMT_SET_META] = "sql.set_meta",
+	[STMT_DATA_VERSION] = "sql.data_version",
+	[STMT_BEGIN] = "sql.begin",
+	[STMT_COMMIT] = "sql.commit",
+	[STMT_ROLLBACK] = "sql.rollback",
+	[STMT_QUERY_FILES] = "sql.query_files",
+	[STMT_COUNT_FILES] = "sql.count_files",
+	[STMT_SEARCH_FILES] = "sql.search_files",
+};
+
+static sqlite3_stmt *stmts[STMT_ALL] = {0};
+
+// Time and rows of each statement's run so far, recorded as one call once
+// it's released.
+static struct {
+	double seconds;
+	long long rows;
+	int stepped;
+} runs[STMT_ALL];
+
 static sqlite3 *db = NULL;
 static char err_buf[BUFF_MAX] = {0};
 
+// Whether titles are searched through image_search, rather than scanned.
+static int title_index = 0;
+
 static void seterr()
 {
 	snprintf(err_buf, sizeof(err_buf),
                  "(%i) %s", sqlite3_errcode(db), sqlite3_errmsg(db));
 }
 
+static int stmt_index(sqlite3_stmt *stmt)
+{
+	for (int i = 0; i < STMT_ALL; i++) {
+		if (stmts[i] == stmt)
+			return i;
+	}
+
+	return -1;
+}
+
+// sqlite3_step(), timed while stats are on.
+static int step(sqlite3_stmt *stmt)
+{
+	double start;
+	int rc, i;
+
+	if (!tmstat_on)
+		return sqlite3_step(stmt);
+
+	start = tmstat_now();
+	rc = sqlite3_step(stmt);
+
+	i = stmt_index(stmt);
+	if (i >= 0) {
+		runs[i].seconds += tmstat_now() - start;
+		runs[i].rows += rc == SQLITE_ROW;
+		runs[i].stepped = 1;
+	}
+
+	return rc;
+}
+
+// Record the statement's run, along with the work SQLite did for it.
+static void record_run(sqlite3_stmt *stmt)
+{
+	TMStat delta;
+	int i;
+
+	if (!tmstat_on)
+		return;
+
+	i = stmt_index(stmt);
+	if (i < 0 || !runs[i].stepped)
+		return;
+
+	memset(&delta, 0, sizeof(delta));
+	delta.rows = runs[i].rows;
+	delta.scanned = sqlite3_stmt_status(stmt,
+	                                    SQLITE_STMTSTATUS_FULLSCAN_STEP, 1);
+	delta.sorts = sqlite3_stmt_status(stmt, SQLITE_STMTSTATUS_SORT, 1)
+		+ sqlite3_stmt_status(stmt, SQLITE_STMTSTATUS_AUTOINDEX, 1);
+	delta.vm_steps = sqlite3_stmt_status(stmt, SQLITE_STMTSTATUS_VM_STEP, 1);
+	tmstat_record(stmt_names[i], runs[i].seconds, &delta);
+
+	memset(&runs[i], 0, sizeof(runs[i]));
+}
+
+// Reset a cached statement so it can be bound and stepped again.
+static void release(sqlite3_stmt *stmt)
+{
+	record_run(stmt);
+	sqlite3_reset(stmt);
+	sqlite3_clear_bindings(stmt);
+}
+
+// Prepare a statement for a single query, and time it as stmts[`which`].
+static int prepare_once(int which, const char *query, sqlite3_stmt **stmt)
+{
+	int rc = PREPARE(*stmt, query);
+
+	stmts[which] = *stmt;
+	memset(&runs[which], 0, sizeof(runs[which]));
+	return rc;
+}
+
+// Finalize a statement from prepare_once().
+static void finalize_once(int which, sqlite3_stmt *stmt)
+{
+	record_run(stmt);
+	sqlite3_finalize(stmt);
+	if (stmts[which] == stmt)
+		stmts[which] = NULL;
+}
+
+// Step a statement that returns no rows, then release it.
+static int exec_stmt(sqlite3_stmt *stmt)
+{
+	int rc = step(stmt);
+	if (rc != SQLITE_DONE)
+		seterr();
+
+	release(stmt);
+	return rc == SQLITE_DONE ? 0 : -1;
+}
+
+// Step a statement once, then release it. Returns 1 if it yielded a
+// row, 0 if it didn't, and -1 on error.
+static int exists_stmt(sqlite3_stmt *stmt)
+{
+	int rc = step(stmt);
+	int status = 0;
+
+	switch (rc) {
+	case SQLITE_DONE:
+		status = 0;
+		break;
+	case SQLITE_ROW:
+		status = 1;
+		break;
+	default:
+		seterr();
+		status = -1;
+		break;
+	}
+
+	release(stmt);
+	return status;
+}
+
+// Copy a file's hash from a column, which is NULL for files that aren't
+// deduplicated.
+static void copy_hash(TMFile *file, sqlite3_stmt *stmt, int col)
+{
+	const char *hash = (const char*) sqlite3_column_text(stmt, col);
+
+	file->hash[0] = '\0';
+	if (hash)
+		strncpy(file->hash, hash, HASH_MAX);
+	file->hash[HASH_MAX] = '\0';
+}
+
+// Point a file at the row the statement is on. The title is only valid
+// until the statement moves on.
+static void read_file(TMFile *file, sqlite3_stmt *stmt, int col)
+{
+	file->title = (const char*) sqlite3_column_text(stmt, col);
+	file->title_len = sqlite3_column_bytes(stmt, col);
+	copy_hash(file, stmt, col + 1);
+}
+
 static int iter_files(sqlite3_stmt *stmt, file_callback callback, void *arg)
 {
 	int rc;
 	TMFile file;
-	while ((rc = sqlite3_step(stmt)) == SQLITE_ROW) {
+	while ((rc = step(stmt)) == SQLITE_ROW) {
 		file.id = sqlite3_column_int(stmt, 0);
-		strncpy((char*) &file.title,
-                        (char*) sqlite3_column_text(stmt, 1), TITLE_MAX);
+		read_file(&file, stmt, 1);
 
 		// Exit early if the callback returns a nonzero status.
 		if (callback(&file, arg)) break;
 	}
 
-	if (rc != SQLITE_DONE) {
+	if (rc != SQLITE_DONE && rc != SQLITE_ROW) {
 		seterr();
+		release(stmt);
 		return -1;
 	}
 
+	release(stmt);
 	return 0;
 }
 
 static int iter_tags(sqlite3_stmt *stmt, tag_callback callback)
 {
 	int rc;
-	char tag[TAG_MAX + 1];
 
-	while ((rc = sqlite3_step(stmt)) == SQLITE_ROW) {
-		strncpy(tag, (char*) sqlite3_column_text(stmt, 1), TAG_MAX);
+	while ((rc = step(stmt)) == SQLITE_ROW) {
+		const char *tag = (const char*) sqlite3_column_text(stmt, 1);
 
 		// Exit early if the callback returns a nonzero status.
-		if (callback(tag)) break;
+		if (callback(tag, sqlite3_column_bytes(stmt, 1))) break;
 	}
 
-	if (rc != SQLITE_DONE) {
+	if (rc != SQLITE_DONE && rc != SQLITE_ROW) {
 		seterr();
+		release(stmt);
 		return -1;
 	}
 
+	release(stmt);
 	return 0;
 }
 
-static int cleanup_tags()
+static int iter_tag_counts(sqlite3_stmt *stmt, tag_count_callback callback,
+                           void *arg)
 {
-	int rc = sqlite3_exec(db,
-                             "DELETE FROM tag WHERE id NOT IN"
-                             " (SELECT tag FROM image_tag)",
-                             NULL, NULL, NULL);
-	CHECK_STATUS(rc);
+	int rc;
 
-	return 0;
-}
+	while ((rc = step(stmt)) == SQLITE_ROW) {
+		const char *tag = (const char*) sqlite3_column_text(stmt, 1);
 
+		// Exit early if the callback returns a nonzero status.
+		if (callback(tag, sqlite3_column_bytes(stmt, 1),
+		             sqlite3_column_int64(stmt, 2), arg))
+			break;
+	}
 
-const char *tmdb_get_error()
-{
-	return err_buf;
+	if (rc != SQLITE_DONE && rc != SQLITE_ROW) {
+		seterr();
+		release(stmt);
+		return -1;
+	}
+
+	release(stmt);
+	return 0;
 }
 
-int tmdb_setup(const char *db_path)
+static int iter_memberships(sqlite3_stmt *stmt, membership_callback callback,
+                            void *arg)
 {
-	sqlite3_stmt *stmt = NULL;
-	int rc = 0;
-	int count = 0;
-
-	// Use builtin memory by default
-	if (db_path == NULL)
-		db_path = ":memory:";
+	int rc;
 
-	if (db) {
-		if (tmdb_cleanup() < 0)
-			return -1;
+	while ((rc = step(stmt)) == SQLITE_ROW) {
+		// Exit early if the callback returns a nonzero status.
+		if (callback(sqlite3_column_int(stmt, 0),
+                             (const char*) sqlite3_column_text(stmt, 1), arg))
+			break;
 	}
 
-	rc = sqlite3_open(db_path, &db);
-	CHECK_STATUS(rc);
-
-	// double-check if the table is set up
-	rc = PREPARE(stmt,
-                     "SELECT COUNT(*) FROM sqlite_master WHERE type='table'"
-                     "AND name IN ('image', 'tag', 'image_tag')");
-	CHECK_STATUS(rc);
-
-	rc = sqlite3_step(stmt);
-
-	count = sqlite3_column_int(stmt, 0);
-	sqlite3_finalize(stmt);
-
-	if (count != 3) {
-		// Set up the new database
-		for (int i = 0; db_setup_queries[i] != 0; i++) {
-			rc = sqlite3_exec(db, db_setup_queries[i], NULL,
-                                          NULL, NULL);
-			CHECK_STATUS(rc);
-		}
+	if (rc != SQLITE_DONE && rc != SQLITE_ROW) {
+		seterr();
+		release(stmt);
+		return -1;
 	}
 
-	// Set up pragmas
-	rc = sqlite3_exec(db, "PRAGMA foreign_keys=TRUE",
-                          NULL, NULL, NULL);
-	CHECK_STATUS(rc);
-
-	rc = sqlite3_exec(db, "PRAGMA encoding='UTF-8'",
-                          NULL, NULL, NULL);
-	CHECK_STATUS(rc);
-
+	release(stmt);
 	return 0;
 }
 
-int tmdb_cleanup()
+
+const char *tmdb_get_error()
 {
-	int rc = sqlite3_close(db);
-	CHECK_STATUS(rc);
+	return err_buf;
+}
 
-	if (rc == SQLITE_OK)
-		db = NULL;
+// Run every query in a null-terminated list.
+static int exec_queries(const char **queries)
+{
+	for (int i = 0; queries[i] != 0; i++) {
+		int rc = sqlite3_exec(db, queries[i], NULL, NULL, NULL);
+		CHECK_STATUS(rc);
+	}
 
 	return 0;
 }
 
-
-int tmdb_new_file(const char *title)
+static int get_schema_version(int *version)
 {
 	sqlite3_stmt *stmt = NULL;
-	int rc = 0;
-
-	PREPARE(stmt,
-                "INSERT INTO image (title) VALUES (:title)");
-	BIND_TEXT(stmt, ":title", title);
+	int rc;
 
-	rc = sqlite3_step(stmt);
+	rc = PREPARE(stmt, "PRAGMA user_version");
 	CHECK_STATUS(rc);
 
-	sqlite3_finalize(stmt);
+	rc = step(stmt);
+	if (rc != SQLITE_ROW) {
+		seterr();
+		sqlite3_finalize(stmt);
+		return -1;
+	}
 
-	return sqlite3_last_insert_rowid(db);
+	*version = sqlite3_column_int(stmt, 0);
+	sqlite3_finalize(stmt);
+	return 0;
 }
 
-int tmdb_edit_title(int file_id, const char *title)
+// Create the tables if they don't exist, and bring them up to the current
+// schema version.
+static int migrate_schema()
 {
 	sqlite3_stmt *stmt = NULL;
+	char query[64];
+	int version = 0;
+	int count = 0;
+	int rc;
 
-	// Double-check it exists.
-	if (tmdb_get_file(file_id, NULL) < 0)
+	if (get_schema_version(&version) < 0)
 		return -1;
 
-	PREPARE(stmt,
-                "UPDATE image SET title=:newtitle WHERE id=:fileid");
-
-	BIND_TEXT(stmt, ":newtitle", title);
-	BIND(int, stmt, ":fileid", file_id);
+	if (version == SCHEMA_VERSION)
+		return 0;
 
-	int rc = sqlite3_step(stmt);
+	// Lock the database, and check again in case another process
+	// upgraded it first.
+	rc = sqlite3_exec(db, "BEGIN IMMEDIATE", NULL, NULL, NULL);
 	CHECK_STATUS(rc);
-	sqlite3_finalize(stmt);
 
-	return 0;
-}
+	if (get_schema_version(&version) < 0)
+		goto rollback;
 
+	if (version > SCHEMA_VERSION) {
+		snprintf(err_buf, sizeof(err_buf),
+                         "Database schema version %i is newer than this"
+                         " tagmage supports.", version);
+		goto rollback;
+	}
 
-int tmdb_add_tag(int file_id, const char *tag_name)
-{
-	sqlite3_stmt *stmt;
-	int rc;
+	if (version == 0) {
+		// double-check if the table is set up
+		rc = PREPARE(stmt,
+                             "SELECT COUNT(*) FROM sqlite_master WHERE type='table'"
+                             "AND name IN ('image', 'tag', 'image_tag')");
+		if (rc != SQLITE_OK) {
+			seterr();
+			goto rollback;
+		}
 
-	// Add tag if it doesn't exist
-	PREPARE(stmt, "INSERT OR IGNORE INTO tag (name) VALUES (:tag)");
-	BIND_TEXT(stmt, ":tag", tag_name);
-	rc = sqlite3_step(stmt);
-	CHECK_STATUS(rc);
-	sqlite3_finalize(stmt);
- 	stmt = NULL;
+		rc = step(stmt);
 
-	PREPARE(stmt,
-                "INSERT INTO image_tag (image, tag) VALUES (:img, "
-                "  (SELECT id FROM tag WHERE name=:tag))");
+		count = sqlite3_column_int(stmt, 0);
+		sqlite3_finalize(stmt);
 
-	BIND(int, stmt, ":img", file_id);
-	BIND_TEXT(stmt, ":tag", tag_name);
+		// Set up the new database
+		if (count != 3 && exec_queries(db_setup_queries) < 0)
+			goto rollback;
 
-	rc = sqlite3_step(stmt);
+		version = 1;
+	}
+
+	while (version < SCHEMA_VERSION) {
+		version++;
+		if (db_migrations[version] &&
+                    exec_queries(db_migrations[version]) < 0)
+			goto rollback;
+	}
+
+	snprintf(query, sizeof(query), "PRAGMA user_version=%i", version);
+	rc = sqlite3_exec(db, query, NULL, NULL, NULL);
+	if (rc != SQLITE_OK) {
+		seterr();
+		goto rollback;
+	}
+
+	rc = sqlite3_exec(db, "COMMIT", NULL, NULL, NULL);
 	CHECK_STATUS(rc);
-	sqlite3_finalize(stmt);
 
 	return 0;
+
+rollback:
+	sqlite3_exec(db, "ROLLBACK", NULL, NULL, NULL);
+	return -1;
 }
 
-int tmdb_remove_tag(int file_id, const char *tag_name)
+// Count the parts of the title index that exist.
+static int count_title_index(int *count)
 {
-	sqlite3_stmt *stmt;
+	sqlite3_stmt *stmt = NULL;
 	int rc;
 
 	rc = PREPARE(stmt,
-                     "DELETE FROM image_tag"
-                     " WHERE image=:file"
-                     " AND tag=(SELECT id FROM tag WHERE name=:tag)");
+	             "SELECT count(*) FROM sqlite_master WHERE name IN"
+	             " ('image_search', 'image_search_insert',"
+	             "  'image_search_delete', 'image_search_update')");
 	CHECK_STATUS(rc);
-	BIND(int, stmt, ":file", file_id);
-	BIND_TEXT(stmt, ":tag", tag_name);
 
-	rc = sqlite3_step(stmt);
-	CHECK_STATUS(rc);
-	sqlite3_finalize(stmt);
+	rc = step(stmt);
+	if (rc != SQLITE_ROW) {
+		seterr();
+		sqlite3_finalize(stmt);
+		return -1;
+	}
 
-	return cleanup_tags();
+	*count = sqlite3_column_int(stmt, 0);
+	sqlite3_finalize(stmt);
+	return 0;
 }
 
-int tmdb_delete_file(int file_id)
+// Build the title index if SQLite has FTS5, or stop keeping it up to date
+// if it doesn't.
+static int setup_title_index()
 {
-	sqlite3_stmt *stmt = NULL;
+	int fts5 = sqlite3_compileoption_used("ENABLE_FTS5");
+	int count = 0;
 	int rc;
 
-	PREPARE(stmt, "DELETE FROM image WHERE id=:fileid");
-	BIND(int, stmt, ":fileid", file_id);
+	if (count_title_index(&count) < 0)
+		return -1;
 
-	rc = sqlite3_step(stmt);
+	title_index = fts5 && count == 4;
+	if (title_index || (!fts5 && count <= 1))
+		return 0;
+
+	// Lock the database, and check again in case another process got
+	// there first.
+	rc = sqlite3_exec(db, "BEGIN IMMEDIATE", NULL, NULL, NULL);
 	CHECK_STATUS(rc);
-	sqlite3_finalize(stmt);
 
-	return cleanup_tags();
-}
+	if (count_title_index(&count) < 0)
+		goto rollback;
 
+	if (fts5 && count != 4 && exec_queries(title_index_queries) < 0)
+		goto rollback;
+	if (!fts5 && exec_queries(title_index_drop_queries) < 0)
+		goto rollback;
 
-int tmdb_get_file(int file_id, TMFile *file)
-{
-	sqlite3_stmt *stmt = NULL;
-	int rc, status = 0;
+	rc = sqlite3_exec(db, "COMMIT", NULL, NULL, NULL);
+	CHECK_STATUS(rc);
 
-	PREPARE(stmt, "SELECT title FROM image WHERE id=:file");
-	BIND(int, stmt, ":file", file_id);
+	title_index = fts5;
+	return 0;
 
-	rc = sqlite3_step(stmt);
+rollback:
+	sqlite3_exec(db, "ROLLBACK", NULL, NULL, NULL);
+	return -1;
+}
 
-	switch (rc) {
-	case SQLITE_DONE:
-		strncpy(err_buf, "File doesn't exist.", sizeof(err_buf));
-		status = -1;
-		break;
-	case SQLITE_ROW:
-		if (file) {
-			file->id = file_id;
-			strncpy((char*) &file->title,
-                                (char*) sqlite3_column_text(stmt, 0), TITLE_MAX);
-		}
-		break;
-	default:
-		seterr();
-		status = -1;
-		break;
+// Returns 1 if `value` is one of the null-terminated `allowed` keywords,
+// ignoring case. Keywords are pasted into pragmas, so nothing else may
+// get through.
+static int is_keyword(const char *value, const char **allowed)
+{
+	for (int i = 0; allowed[i] != 0; i++) {
+		if (sqlite3_stricmp(value, allowed[i]) == 0)
+			return 1;
 	}
 
-	sqlite3_finalize(stmt);
-	return status;
+	return 0;
 }
 
-int tmdb_get_files(file_callback callback, void *arg)
+static int set_pragmas(const TMOptions *opts)
 {
-	sqlite3_stmt *stmt = NULL;
+	static const char *journal_modes[] =
+		{"DELETE", "TRUNCATE", "PERSIST", "MEMORY", "WAL", "OFF", 0};
+	static const char *sync_levels[] =
+		{"OFF", "NORMAL", "FULL", "EXTRA", 0};
+	char query[128];
 	int rc;
 
-	rc = PREPARE(stmt, "SELECT id,title FROM image");
+	// Wait on other writers first, since switching the journal mode
+	// needs a lock.
+	rc = sqlite3_busy_timeout(db, opts->busy_timeout);
 	CHECK_STATUS(rc);
 
-	rc = iter_files(stmt, callback, arg);
-	sqlite3_finalize(stmt);
+	if (opts->journal_mode) {
+		if (!is_keyword(opts->journal_mode, journal_modes)) {
+			snprintf(err_buf, sizeof(err_buf),
+                                 "Invalid journal mode '%s'.",
+                                 opts->journal_mode);
+			return -1;
+		}
 
-	return rc;
-}
+		snprintf(query, sizeof(query), "PRAGMA journal_mode=%s",
+                         opts->journal_mode);
+		rc = sqlite3_exec(db, query, NULL, NULL, NULL);
+		CHECK_STATUS(rc);
+	}
 
+	if (opts->synchronous) {
+		if (!is_keyword(opts->synchronous, sync_levels)) {
+			snprintf(err_buf, sizeof(err_buf),
+                                 "Invalid synchronous level '%s'.",
+                                 opts->synchronous);
+			return -1;
+		}
 
-int tmdb_has_tag(int file_id, const char *tag_name) {
-	sqlite3_stmt *stmt = NULL;
-	int rc;
+		snprintf(query, sizeof(query), "PRAGMA synchronous=%s",
+                         opts->synchronous);
+		rc = sqlite3_exec(db, query, NULL, NULL, NULL);
+		CHECK_STATUS(rc);
+	}
 
-	rc = PREPARE(stmt,
-                     "SELECT image FROM image_tag"
-                     " WHERE image=:file"
-                     " AND tag=(SELECT id FROM tag WHERE name=:tag)");
-	BIND(int, stmt, ":file", file_id);
-	BIND_TEXT(stmt, ":tag", tag_name);
+	snprintf(query, sizeof(query), "PRAGMA mmap_size=%lld",
+                 opts->mmap_size);
+	rc = sqlite3_exec(db, query, NULL, NULL, NULL);
+	CHECK_STATUS(rc);
 
-	rc = sqlite3_step(stmt);
-	sqlite3_finalize(stmt);
+	snprintf(query, sizeof(query), "PRAGMA cache_size=%lld",
+                 opts->cache_size);
+	rc = sqlite3_exec(db, query, NULL, NULL, NULL);
+	CHECK_STATUS(rc);
 
-	switch (rc) {
-	case SQLITE_DONE:
-		return 0;
-	case SQLITE_ROW:
-		return 1;
-	default:
-		seterr();
-		return -1;
-	}
+	return 0;
 }
 
-int tmdb_get_tags(tag_callback callback)
-{
-	sqlite3_stmt *stmt = NULL;
-	int status;
+// Ids of tags by name, filled as tags are looked up, so tagging a file
+// is a lookup by primary key instead of by name. Slots are probed
+// linearly, and at most half of them are used.
+typedef struct TagSlot {
+	char *name; // NULL if the slot is free.
+	int id;
+} TagSlot;
 
-	PREPARE(stmt, "SELECT id, name FROM tag");
+static TagSlot *tag_ids = NULL;
+static size_t tag_ids_cap = 0, tag_ids_used = 0;
 
-	status = iter_tags(stmt, callback);
-	sqlite3_finalize(stmt);
+// Tags deleted since the cache was filled, or an insert rolled back, so
+// it must be forgotten. Ids of deleted tags may be given to new ones.
+static int tag_ids_stale = 0;
 
-	return status;
+// Whether the cache was checked against other connections' changes in
+// the current transaction, and their count then. Cleared as each
+// transaction begins and ends.
+static int tag_ids_checked = 0;
+static int tag_ids_version = -1;
+
+static size_t hash_name(const char *name)
+{
+	size_t hash = 2166136261u;
+
+	for (; *name; name++)
+		hash = (hash ^ (unsigned char) *name) * 16777619u;
+
+	return hash;
 }
 
-int tmdb_get_tags_by_file(int file_id, tag_callback callback)
+static void forget_tag_ids()
 {
-	sqlite3_stmt *stmt = NULL;
-	int status;
+	for (size_t i = 0; i < tag_ids_cap; i++) {
+		free(tag_ids[i].name);
+		tag_ids[i].name = NULL;
+	}
+
+	tag_ids_used = 0;
+	tag_ids_stale = 0;
+}
 
-	PREPARE(stmt,
-                "SELECT id, name FROM tag"
-                " WHERE id IN (SELECT tag FROM image_tag"
-                "                WHERE image=:file)");
-	BIND(int, stmt, ":file", file_id);
+// Return the slot of `name`, or the free slot it belongs in.
+static TagSlot *find_tag_slot(const char *name)
+{
+	size_t mask = tag_ids_cap - 1;
+	size_t i = hash_name(name) & mask;
 
-	status = iter_tags(stmt, callback);
-	sqlite3_finalize(stmt);
+	while (tag_ids[i].name && !STREQ(tag_ids[i].name, name))
+		i = (i + 1) & mask;
 
-	return status;
+	return &tag_ids[i];
 }
 
-int tmdb_has_tags(int file_id)
+static int grow_tag_ids()
 {
-	sqlite3_stmt *stmt = NULL;
-	int rc;
+	TagSlot *old = tag_ids;
+	size_t old_cap = tag_ids_cap;
+	size_t cap = old_cap ? 2 * old_cap : 64;
 
-	PREPARE(stmt,
-                "SELECT tag FROM image_tag "
-                " WHERE image=:file");
-	BIND(int, stmt, ":file", file_id);
+	tag_ids = calloc(cap, sizeof(*tag_ids));
+	if (tag_ids == NULL) {
+		tag_ids = old;
+		return -1;
+	}
 
-	rc = sqlite3_step(stmt);
-	sqlite3_finalize(stmt);
+	tag_ids_cap = cap;
+	for (size_t i = 0; i < old_cap; i++) {
+		if (old[i].name)
+			*find_tag_slot(old[i].name) = old[i];
+	}
 
-	switch (rc) {
+	free(old);
+	return 0;
+}
+
+// Cache the id of a tag. Running out of memory only costs lookups later.
+static void remember_tag_id(const char *name, int id)
+{
+	TagSlot *slot = NULL;
+	size_t len;
+
+	if (2 * (tag_ids_used + 1) > tag_ids_cap && grow_tag_ids() < 0)
+		return;
+
+	slot = find_tag_slot(name);
+	if (slot->name == NULL) {
+		len = strlen(name) + 1;
+		slot->name = malloc(len);
+		if (slot->name == NULL)
+			return;
+
+		memcpy(slot->name, name, len);
+		tag_ids_used++;
+	}
+
+	slot->id = id;
+}
+
+// Forget the cache if it may be out of date. Within a transaction, other
+// connections can't change the database once it's been checked.
+static int check_tag_ids()
+{
+	int version;
+
+	if (!tag_ids_checked || sqlite3_get_autocommit(db)) {
+		if (tmdb_data_version(&version) < 0)
+			return -1;
+
+		if (version != tag_ids_version)
+			tag_ids_stale = 1;
+		tag_ids_version = version;
+		tag_ids_checked = 1;
+	}
+
+	if (tag_ids_stale)
+		forget_tag_ids();
+
+	return 0;
+}
+
+// Returns the id of the tag named `name`, 0 if there's none, or -1 on
+// error.
+static int get_tag_id(const char *name)
+{
+	sqlite3_stmt *stmt = stmts[STMT_GET_TAG_ID];
+	int id = 0;
+	int rc;
+
+	if (check_tag_ids() < 0)
+		return -1;
+
+	if (tag_ids_used) {
+		TagSlot *slot = find_tag_slot(name);
+		if (slot->name)
+			return slot->id;
+	}
+
+	BIND_TEXT(stmt, 1, name);
+	rc = step(stmt);
+	if (rc == SQLITE_ROW) {
+		id = sqlite3_column_int(stmt, 0);
+	} else if (rc != SQLITE_DONE) {
+		seterr();
+		release(stmt);
+		return -1;
+	}
+
+	release(stmt);
+	if (id)
+		remember_tag_id(name, id);
+	return id;
+}
+
+// Called for every row this connection changes, including in triggers
+// such as image_tag_orphan.
+static void row_changed(void *arg, int op, const char *db_name,
+                        const char *table, sqlite3_int64 rowid)
+{
+	UNUSED(arg);
+	UNUSED(rowid);
+
+	if (op == SQLITE_DELETE && STREQ(table, "tag")
+	    && STREQ(db_name, "main"))
+		tag_ids_stale = 1;
+}
+
+static int committed(void *arg)
+{
+	UNUSED(arg);
+	tag_ids_checked = 0;
+	return 0;
+}
+
+static void rolled_back(void *arg)
+{
+	UNUSED(arg);
+	tag_ids_checked = 0;
+	tag_ids_stale = 1;
+}
+
+int tmdb_setup(const char *db_path, const TMOptions *opts)
+{
+	int rc = 0;
+
+	// Use builtin memory by default
+	if (db_path == NULL)
+		db_path = ":memory:";
+
+	if (db) {
+		if (tmdb_cleanup() < 0)
+			return -1;
+	}
+
+	rc = sqlite3_open_v2(db_path, &db,
+                             SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE, NULL);
+	CHECK_STATUS(rc);
+
+	// Keep the tag id cache in step with this connection's changes.
+	forget_tag_ids();
+	tag_ids_checked = 0;
+	tag_ids_version = -1;
+	sqlite3_update_hook(db, &row_changed, NULL);
+	sqlite3_commit_hook(db, &committed, NULL);
+	sqlite3_rollback_hook(db, &rolled_back, NULL);
+
+	if (opts && set_pragmas(opts) < 0)
+		return -1;
+
+	if (migrate_schema() < 0 || setup_title_index() < 0)
+		return -1;
+
+	// Set up pragmas
+	rc = sqlite3_exec(db, "PRAGMA foreign_keys=TRUE",
+                          NULL, NULL, NULL);
+	CHECK_STATUS(rc);
+
+	rc = sqlite3_exec(db, "PRAGMA encoding='UTF-8'",
+                          NULL, NULL, NULL);
+	CHECK_STATUS(rc);
+
+	// Prepare every statement up front.
+	for (int i = 0; i < STMT_COUNT; i++) {
+		rc = sqlite3_prepare_v3(db, stmt_queries[i], -1,
+                                        SQLITE_PREPARE_PERSISTENT,
+                                        &stmts[i], NULL);
+		CHECK_STATUS(rc);
+	}
+
+	return 0;
+}
+
+int tmdb_cleanup()
+{
+	for (int i = 0; i < STMT_COUNT; i++) {
+		sqlite3_finalize(stmts[i]);
+		stmts[i] = NULL;
+	}
+
+	forget_tag_ids();
+	free(tag_ids);
+	tag_ids = NULL;
+	tag_ids_cap = 0;
+
+	int rc = sqlite3_close(db);
+	CHECK_STATUS(rc);
+
+	if (rc == SQLITE_OK)
+		db = NULL;
+
+	return 0;
+}
+
+
+int tmdb_reset()
+{
+	sqlite3_stmt *stmt = sqlite3_next_stmt(db, NULL);
+
+	while (stmt) {
+		sqlite3_stmt *next = sqlite3_next_stmt(db, stmt);
+		int cached = 0;
+
+		for (int i = 0; i < STMT_COUNT; i++)
+			cached |= stmts[i] == stmt;
+
+		if (cached)
+			release(stmt);
+		else
+			sqlite3_finalize(stmt);
+
+		stmt = next;
+	}
+
+	for (int i = STMT_COUNT; i < STMT_ALL; i++)
+		stmts[i] = NULL;
+
+	return 0;
+}
+
+int tmdb_data_version(int *version)
+{
+	sqlite3_stmt *stmt = stmts[STMT_DATA_VERSION];
+
+	if (step(stmt) != SQLITE_ROW) {
+		seterr();
+		release(stmt);
+		return -1;
+	}
+
+	*version = sqlite3_column_int(stmt, 0);
+	release(stmt);
+	return 0;
+}
+
+int tmdb_begin()
+{
+	// The commit hook misses transactions that only read, so check
+	// again in every new one.
+	tag_ids_checked = 0;
+	return exec_stmt(stmts[STMT_BEGIN]);
+}
+
+int tmdb_commit()
+{
+	return exec_stmt(stmts[STMT_COMMIT]);
+}
+
+int tmdb_rollback()
+{
+	return exec_stmt(stmts[STMT_ROLLBACK]);
+}
+
+
+int tmdb_new_file(const char *title, const char *hash)
+{
+	sqlite3_stmt *stmt = stmts[STMT_NEW_FILE];
+
+	BIND_TEXT(stmt, 1, title);
+	if (hash)
+		BIND_TEXT(stmt, 2, hash);
+	if (exec_stmt(stmt) < 0)
+		return -1;
+
+	return sqlite3_last_insert_rowid(db);
+}
+
+int tmdb_edit_title(int file_id, const char *title)
+{
+	sqlite3_stmt *stmt = stmts[STMT_EDIT_TITLE];
+
+	// Double-check it exists.
+	if (tmdb_get_file(file_id, NULL, NULL) < 0)
+		return -1;
+
+	BIND_TEXT(stmt, 1, title);
+	BIND(int, stmt, 2, file_id);
+
+	return exec_stmt(stmt);
+}
+
+
+int tmdb_add_tag(int file_id, const char *tag_name)
+{
+	sqlite3_stmt *stmt = stmts[STMT_NEW_TAG];
+	int tag_id = get_tag_id(tag_name);
+
+	if (tag_id < 0)
+		return -1;
+
+	// Add tag if it doesn't exist
+	if (tag_id == 0) {
+		BIND_TEXT(stmt, 1, tag_name);
+		if (exec_stmt(stmt) < 0)
+			return -1;
+
+		// Another connection may have added it first.
+		if (sqlite3_changes(db) == 0)
+			tag_id = get_tag_id(tag_name);
+		else
+			tag_id = sqlite3_last_insert_rowid(db);
+
+		if (tag_id < 0)
+			return -1;
+		if (tag_id == 0) {
+			snprintf(err_buf, sizeof(err_buf),
+			         "Tag '%s' was deleted while adding it.",
+			         tag_name);
+			return -1;
+		}
+		remember_tag_id(tag_name, tag_id);
+	}
+
+	stmt = stmts[STMT_ADD_TAG];
+	BIND(int, stmt, 1, file_id);
+	BIND(int, stmt, 2, tag_id);
+
+	return exec_stmt(stmt);
+}
+
+int tmdb_remove_tag(int file_id, const char *tag_name)
+{
+	sqlite3_stmt *stmt = stmts[STMT_REMOVE_TAG];
+	int tag_id = get_tag_id(tag_name);
+
+	// No file has a tag that doesn't exist.
+	if (tag_id <= 0)
+		return tag_id;
+
+	BIND(int, stmt, 1, file_id);
+	BIND(int, stmt, 2, tag_id);
+
+	return exec_stmt(stmt);
+}
+
+// Files and tags of a bulk change. They're temporary, so only this
+// connection sees them, and made on first use.
+static const char *bulk_setup_queries[] =
+	{"CREATE TEMP TABLE IF NOT EXISTS bulk_file ("
+	 "  id INTEGER PRIMARY KEY);",
+
+	 "CREATE TEMP TABLE IF NOT EXISTS bulk_tag ("
+	 "  name TEXT PRIMARY KEY,"
+	 "  id INTEGER)"
+	 " WITHOUT ROWID;",
+
+	 "DELETE FROM temp.bulk_file;",
+
+	 "DELETE FROM temp.bulk_tag;",
+
+	 0};
+
+// Insert each of `n` ids, or names if `ids` is NULL, with `query`.
+static int fill_bulk(const char *query, const int *ids, const char **names,
+                     int n)
+{
+	sqlite3_stmt *stmt = NULL;
+	int rc = PREPARE(stmt, query);
+	CHECK_STATUS(rc);
+
+	for (int i = 0; i < n; i++) {
+		if (ids)
+			BIND(int, stmt, 1, ids[i]);
+		else
+			BIND_TEXT(stmt, 1, names[i]);
+
+		rc = step(stmt);
+		sqlite3_reset(stmt);
+		if (rc != SQLITE_DONE) {
+			seterr();
+			sqlite3_finalize(stmt);
+			return -1;
+		}
+	}
+
+	sqlite3_finalize(stmt);
+	return 0;
+}
+
+// Fill the bulk tables with the files and tags of a change.
+static int start_bulk(const int *ids, int nids, const char **tags, int ntags)
+{
+	if (exec_queries(bulk_setup_queries) < 0)
+		return -1;
+
+	if (fill_bulk("INSERT OR IGNORE INTO temp.bulk_file (id) VALUES (?1)",
+	              ids, NULL, nids) < 0)
+		return -1;
+
+	return fill_bulk("INSERT OR IGNORE INTO temp.bulk_tag (name)"
+	                 " VALUES (?1)", NULL, tags, ntags);
+}
+
+int tmdb_tag_files(const int *ids, int nids, const char **tags, int ntags)
+{
+	// Each tag is created if need be and looked up once, rather than
+	// once per file.
+	static const char *queries[] =
+		{"INSERT OR IGNORE INTO tag (name)"
+		 " SELECT name FROM temp.bulk_tag;",
+
+		 "UPDATE temp.bulk_tag"
+		 " SET id=(SELECT id FROM tag WHERE name=bulk_tag.name);",
+
+		 // Only pairs that are actually inserted fire the triggers
+		 // that count and log them.
+		 "INSERT OR IGNORE INTO image_tag (image, tag)"
+		 " SELECT bulk_file.id, bulk_tag.id"
+		 " FROM temp.bulk_file CROSS JOIN temp.bulk_tag;",
+
+		 0};
+
+	if (nids == 0 || ntags == 0)
+		return 0;
+
+	if (start_bulk(ids, nids, tags, ntags) < 0)
+		return -1;
+
+	return exec_queries(queries);
+}
+
+int tmdb_untag_files(const int *ids, int nids, const char **tags, int ntags)
+{
+	// Tags that don't exist are left without an id, and match nothing.
+	// image_tag_orphan deletes the tags no file has anymore.
+	static const char *queries[] =
+		{"UPDATE temp.bulk_tag"
+		 " SET id=(SELECT id FROM tag WHERE name=bulk_tag.name);",
+
+		 "DELETE FROM image_tag"
+		 " WHERE image IN (SELECT id FROM temp.bulk_file)"
+		 " AND tag IN (SELECT id FROM temp.bulk_tag);",
+
+		 0};
+
+	if (nids == 0 || ntags == 0)
+		return 0;
+
+	if (start_bulk(ids, nids, tags, ntags) < 0)
+		return -1;
+
+	return exec_queries(queries);
+}
+
+int tmdb_delete_file(int file_id)
+{
+	sqlite3_stmt *stmt = stmts[STMT_DELETE_FILE];
+
+	BIND(int, stmt, 1, file_id);
+
+	return exec_stmt(stmt);
+}
+
+int tmdb_count_hash(const char *hash)
+{
+	sqlite3_stmt *stmt = stmts[STMT_COUNT_HASH];
+	int count = -1;
+
+	BIND_TEXT(stmt, 1, hash);
+
+	if (step(stmt) == SQLITE_ROW)
+		count = sqlite3_column_int(stmt, 0);
+	else
+		seterr();
+
+	release(stmt);
+	return count;
+}
+
+int tmdb_get_layout()
+{
+	sqlite3_stmt *stmt = stmts[STMT_GET_META];
+	int layout = 0;
+
+	BIND_TEXT(stmt, 1, "layout");
+
+	switch (step(stmt)) {
+	case SQLITE_ROW:
+		layout = sqlite3_column_int(stmt, 0);
+		break;
 	case SQLITE_DONE:
+		break;
+	default:
+		seterr();
+		layout = -1;
+		break;
+	}
+
+	release(stmt);
+	return layout;
+}
+
+int tmdb_set_layout(int layout)
+{
+	sqlite3_stmt *stmt = stmts[STMT_SET_META];
+
+	BIND_TEXT(stmt, 1, "layout");
+	BIND(int, stmt, 2, layout);
+
+	return exec_stmt(stmt);
+}
+
+// Read a value from the meta table, which is 0 if it's not set.
+static int get_meta(const char *key, long long *value)
+{
+	sqlite3_stmt *stmt = stmts[STMT_GET_META];
+	int status = 0;
+
+	BIND_TEXT(stmt, 1, key);
+
+	*value = 0;
+	switch (step(stmt)) {
+	case SQLITE_ROW:
+		*value = sqlite3_column_int64(stmt, 0);
+		break;
+	case SQLITE_DONE:
+		break;
+	default:
+		seterr();
+		status = -1;
+		break;
+	}
+
+	release(stmt);
+	return status;
+}
+
+int tmdb_gc()
+{
+	sqlite3_stmt *stmt = stmts[STMT_SET_META];
+	long long seq;
+
+	if (exec_stmt(stmts[STMT_CLEANUP_TAGS]) < 0)
+		return -1;
+
+	// Merge the title index into as few segments as it can.
+	if (title_index
+	    && sqlite3_exec(db, "INSERT INTO image_search (image_search)"
+	                        " VALUES ('optimize')",
+	                    NULL, NULL, NULL) != SQLITE_OK) {
+		seterr();
+		return -1;
+	}
+
+	if (tmdb_get_change_seq(&seq) < 0)
+		return -1;
+	if (seq <= CHANGES_KEPT)
 		return 0;
+	seq -= CHANGES_KEPT;
+
+	// Record the pruned changes before they're gone, so a view never
+	// trusts a log with a hole in it.
+	BIND_TEXT(stmt, 1, "changes_pruned");
+	BIND(int64, stmt, 2, seq);
+	if (exec_stmt(stmt) < 0)
+		return -1;
+
+	stmt = stmts[STMT_PRUNE_CHANGES];
+	BIND(int64, stmt, 1, seq);
+	return exec_stmt(stmt);
+}
+
+int tmdb_get_change_seq(long long *seq)
+{
+	sqlite3_stmt *stmt = stmts[STMT_GET_CHANGE_SEQ];
+	int status = 0;
+
+	*seq = 0;
+	switch (step(stmt)) {
+	case SQLITE_ROW:
+		*seq = sqlite3_column_int64(stmt, 0);
+		break;
+	case SQLITE_DONE:
+		// Nothing has changed yet.
+		break;
+	default:
+		seterr();
+		status = -1;
+		break;
+	}
+
+	release(stmt);
+	return status;
+}
+
+int tmdb_get_pruned_seq(long long *seq)
+{
+	return get_meta("changes_pruned", seq);
+}
+
+int tmdb_get_changes(long long since, change_callback callback, void *arg)
+{
+	sqlite3_stmt *stmt = stmts[STMT_GET_CHANGES];
+	int rc;
+
+	BIND(int64, stmt, 1, since);
+
+	while ((rc = step(stmt)) == SQLITE_ROW) {
+		// Exit early if the callback returns a nonzero status.
+		if (callback(sqlite3_column_int(stmt, 0),
+                             (const char*) sqlite3_column_text(stmt, 1),
+                             (const char*) sqlite3_column_text(stmt, 2),
+                             arg))
+			break;
+	}
+
+	if (rc != SQLITE_DONE && rc != SQLITE_ROW) {
+		seterr();
+		release(stmt);
+		return -1;
+	}
+
+	release(stmt);
+	return 0;
+}
+
+
+int tmdb_get_file(int file_id, file_callback callback, void *arg)
+{
+	sqlite3_stmt *stmt = stmts[STMT_GET_FILE];
+	int rc, status = 0;
+
+	BIND(int, stmt, 1, file_id);
+
+	rc = step(stmt);
+
+	switch (rc) {
+	case SQLITE_DONE:
+		strncpy(err_buf, "File doesn't exist.", sizeof(err_buf));
+		status = -1;
+		break;
 	case SQLITE_ROW:
-		return 1;
+		if (callback) {
+			TMFile file = {.id = file_id};
+
+			read_file(&file, stmt, 0);
+			callback(&file, arg);
+		}
+		break;
 	default:
 		seterr();
+		status = -1;
+		break;
+	}
+
+	release(stmt);
+	return status;
+}
+
+int tmdb_get_files(file_callback callback, void *arg)
+{
+	return iter_files(stmts[STMT_GET_FILES], callback, arg);
+}
+
+int tmdb_query_files(const char *id_query, const char **params, int nparams,
+                     const TMPage *page, file_callback callback, void *arg)
+{
+	static const char fmt[] =
+		"SELECT id,title,hash FROM image WHERE %s%s%s AND %s"
+		" ORDER BY %s LIMIT ?";
+	// Pages pick up where the last one left off, seeking through the
+	// rowid or image_by_title.
+	static const char *after[] = {
+		[TM_SORT_ID] = "id>?",
+		[TM_SORT_TITLE] = "(title,id)>(?,?)"
+	};
+	static const char *order[] = {
+		[TM_SORT_ID] = "id",
+		[TM_SORT_TITLE] = "title,id"
+	};
+	const TMPage every = {TM_SORT_ID, 0, 0, NULL};
+	sqlite3_stmt *stmt = NULL;
+	char *query = NULL;
+	size_t len;
+	int rc, col = nparams;
+
+	if (page == NULL)
+		page = &every;
+
+	if (page->sort == TM_SORT_TITLE && page->after
+	    && page->after_title == NULL) {
+		strncpy(err_buf, "Missing the title to list files after.",
+		        sizeof(err_buf)-1);
+		return -1;
+	}
+
+	len = sizeof(fmt) + (id_query ? strlen(id_query) : 0) + 64;
+	query = malloc(len);
+	if (query == NULL) {
+		strncpy(err_buf, "Out of memory.", sizeof(err_buf)-1);
+		return -1;
+	}
+	snprintf(query, len, fmt, id_query ? "id IN (" : "",
+	         id_query ? id_query : "1", id_query ? ")" : "",
+	         page->after ? after[page->sort] : "1", order[page->sort]);
+
+	rc = prepare_once(STMT_QUERY_FILES, query, &stmt);
+	free(query);
+	CHECK_STATUS(rc);
+
+	for (int i = 0; i < nparams; i++)
+		sqlite3_bind_text(stmt, i + 1, params[i], -1, NULL);
+
+	if (page->after && page->sort == TM_SORT_TITLE)
+		BIND_TEXT(stmt, ++col, page->after_title);
+	if (page->after)
+		BIND(int, stmt, ++col, page->after);
+	BIND(int, stmt, ++col, page->limit > 0 ? page->limit : -1);
+
+	rc = iter_files(stmt, callback, arg);
+	finalize_once(STMT_QUERY_FILES, stmt);
+
+	return rc;
+}
+
+int tmdb_count_files(const char *id_query, const char **params, int nparams,
+                     int limit, long long *count)
+{
+	static const char fmt[] = "SELECT count(*) FROM (%s LIMIT %d)";
+	sqlite3_stmt *stmt = NULL;
+	char *query = NULL;
+	size_t len;
+	int rc;
+
+	len = sizeof(fmt) + strlen(id_query) + 16;
+	query = malloc(len);
+	if (query == NULL) {
+		strncpy(err_buf, "Out of memory.", sizeof(err_buf)-1);
+		return -1;
+	}
+	snprintf(query, len, fmt, id_query, limit);
+
+	rc = prepare_once(STMT_COUNT_FILES, query, &stmt);
+	free(query);
+	CHECK_STATUS(rc);
+
+	for (int i = 0; i < nparams; i++)
+		sqlite3_bind_text(stmt, i + 1, params[i], -1, NULL);
+
+	rc = step(stmt);
+	if (rc != SQLITE_ROW) {
+		seterr();
+		finalize_once(STMT_COUNT_FILES, stmt);
+		return -1;
+	}
+
+	*count = sqlite3_column_int64(stmt, 0);
+	finalize_once(STMT_COUNT_FILES, stmt);
+	return 0;
+}
+
+// Append each word of `terms` to `str`, formatted with `fmt`, which takes
+// the word, then `prefix` if the word ended in `*`, or "" otherwise. The
+// `*` itself is left out. Returns the number of words.
+static int append_words(sqlite3_str *str, const char *terms, const char *fmt,
+                        const char *prefix)
+{
+	int nwords = 0;
+
+	while (*terms) {
+		size_t len = strcspn(terms, " \t\n");
+		size_t end = len;
+		char *word = NULL;
+
+		while (end > 0 && terms[end - 1] == '*')
+			end--;
+
+		if (end > 0) {
+			word = sqlite3_mprintf("%.*s", (int) end, terms);
+			if (word == NULL)
+				return -1;
+			sqlite3_str_appendf(str, fmt, word,
+			                    end < len ? prefix : "");
+			sqlite3_free(word);
+			nwords++;
+		}
+
+		terms += len;
+		terms += strspn(terms, " \t\n");
+	}
+
+	return nwords;
+}
+
+int tmdb_search_files(const char *terms, const char *id_query,
+                      const char **params, int nparams, int limit,
+                      file_callback callback, void *arg)
+{
+	sqlite3_str *str = sqlite3_str_new(db);
+	sqlite3_str *match = sqlite3_str_new(db);
+	sqlite3_stmt *stmt = NULL;
+	char *query = NULL, *expr = NULL;
+	int rc, nwords, col = nparams;
+
+	// Ranked matches from the title index, with every word quoted so
+	// nothing in it is read as an operator. Without it, every title is
+	// scanned for the words instead, in order of id.
+	if (title_index) {
+		sqlite3_str_appendall(str,
+			"SELECT image.id, image.title, image.hash"
+			" FROM image_search"
+			" JOIN image ON image.id=image_search.rowid"
+			" WHERE ");
+	} else {
+		sqlite3_str_appendall(str,
+			"SELECT id, title, hash FROM image WHERE ");
+	}
+
+	if (id_query)
+		sqlite3_str_appendf(str, "image.id IN (%s) AND ", id_query);
+
+	if (title_index) {
+		nwords = append_words(match, terms, "\"%w\"%s ", "*");
+		sqlite3_str_appendall(str,
+			"image_search MATCH ?"
+			" ORDER BY image_search.rank, image.id LIMIT ?");
+	} else {
+		nwords = append_words(str, terms,
+		                      "instr(lower(title), lower(%Q))%s AND ",
+		                      "");
+		sqlite3_str_appendall(str, "1 ORDER BY id LIMIT ?");
+	}
+
+	query = sqlite3_str_finish(str);
+	expr = sqlite3_str_finish(match);
+	if (query == NULL || (expr == NULL && title_index) || nwords <= 0) {
+		if (nwords == 0)
+			strncpy(err_buf, "Nothing to search for.",
+			        sizeof(err_buf)-1);
+		else
+			strncpy(err_buf, "Out of memory.", sizeof(err_buf)-1);
+		sqlite3_free(query);
+		sqlite3_free(expr);
+		return -1;
+	}
+
+	rc = prepare_once(STMT_SEARCH_FILES, query, &stmt);
+	sqlite3_free(query);
+	if (rc != SQLITE_OK) {
+		seterr();
+		sqlite3_free(expr);
+		return -1;
+	}
+
+	for (int i = 0; i < nparams; i++)
+		sqlite3_bind_text(stmt, i + 1, params[i], -1, NULL);
+	if (title_index)
+		BIND_TEXT(stmt, ++col, expr);
+	BIND(int, stmt, ++col, limit > 0 ? limit : -1);
+
+	rc = iter_files(stmt, callback, arg);
+	finalize_once(STMT_SEARCH_FILES, stmt);
+	sqlite3_free(expr);
+
+	return rc;
+}
+
+int tmdb_has_tag(int file_id, const char *tag_name) {
+	sqlite3_stmt *stmt = stmts[STMT_HAS_TAG];
+	int tag_id = get_tag_id(tag_name);
+
+	if (tag_id <= 0)
+		return tag_id;
+
+	BIND(int, stmt, 1, file_id);
+	BIND(int, stmt, 2, tag_id);
+
+	return exists_stmt(stmt);
+}
+
+int tmdb_get_tags(tag_callback callback)
+{
+	return iter_tags(stmts[STMT_GET_TAGS], callback);
+}
+
+int tmdb_get_tags_by_file(int file_id, tag_callback callback)
+{
+	sqlite3_stmt *stmt = stmts[STMT_GET_TAGS_BY_FILE];
+
+	BIND(int, stmt, 1, file_id);
+
+	return iter_tags(stmt, callback);
+}
+
+int tmdb_get_tag_counts(int file_id, tag_count_callback callback, void *arg)
+{
+	sqlite3_stmt *stmt = stmts[STMT_GET_TAG_COUNTS];
+
+	if (file_id) {
+		stmt = stmts[STMT_GET_TAG_COUNTS_BY_FILE];
+		BIND(int, stmt, 1, file_id);
+	}
+
+	return iter_tag_counts(stmt, callback, arg);
+}
+
+int tmdb_get_cooccurring(const char *tag, tag_count_callback callback,
+                         void *arg)
+{
+	sqlite3_stmt *stmt = stmts[STMT_GET_COOCCURRING];
+
+	BIND_TEXT(stmt, 1, tag);
+
+	return iter_tag_counts(stmt, callback, arg);
+}
+
+int tmdb_get_memberships(membership_callback callback, void *arg)
+{
+	return iter_memberships(stmts[STMT_GET_MEMBERSHIPS], callback, arg);
+}
+
+int tmdb_get_changed_memberships(long long since,
+                                 membership_callback callback, void *arg)
+{
+	sqlite3_stmt *stmt = stmts[STMT_GET_CHANGED_MEMBERSHIPS];
+
+	BIND(int64, stmt, 1, since);
+
+	return iter_memberships(stmt, callback, arg);
+}
+
+int tmdb_has_tags(int file_id)
+{
+	sqlite3_stmt *stmt = stmts[STMT_HAS_TAGS];
+
+	BIND(int, stmt, 1, file_id);
+
+	return exists_stmt(stmt);
+}
+
+int tmdb_export(export_callback callback, void *arg)
+{
+	sqlite3_stmt *stmt = stmts[STMT_EXPORT];
+	TMFile file;
+	int rc;
+
+	while ((rc = step(stmt)) == SQLITE_ROW) {
+		const char *tags = (const char*) sqlite3_column_text(stmt, 3);
+
+		file.id = sqlite3_column_int(stmt, 0);
+		read_file(&file, stmt, 1);
+
+		// Exit early if the callback returns a nonzero status.
+		if (callback(&file, tags, sqlite3_column_bytes(stmt, 3), arg))
+			break;
+	}
+
+	if (rc != SQLITE_DONE && rc != SQLITE_ROW) {
+		seterr();
+		release(stmt);
+		return -1;
+	}
+
+	release(stmt);
+	return 0;
+}
+
+// Indexes and insert triggers an import drops, so each row is inserted
+// without them, then rebuilds in one pass. Indexes come first, so the
+// triggers are recreated on top of them.
+static const char *import_deferred[] = {
+	"image_by_title", "image_by_hash", "image_tag_by_tag",
+	"image_insert_change", "image_tag_insert_change",
+	"image_tag_insert_count", "image_search_insert",
+};
+
+// The SQL that created each of import_deferred while an import runs.
+static char *import_schema[LEN(import_deferred)] = {0};
+
+static void forget_import_schema()
+{
+	for (size_t i = 0; i < LEN(import_deferred); i++) {
+		sqlite3_free(import_schema[i]);
+		import_schema[i] = NULL;
+	}
+}
+
+// Undo everything since tmdb_import_begin(), the dropped schema included,
+// leaving any outer transaction as it was before.
+static void abort_import()
+{
+	sqlite3_exec(db, "ROLLBACK TO import; RELEASE import;", NULL, NULL,
+	             NULL);
+
+	// The rollback hook doesn't see savepoints, and tags created since
+	// are gone.
+	tag_ids_stale = 1;
+	forget_import_schema();
+}
+
+int tmdb_import_begin()
+{
+	sqlite3_stmt *stmt = NULL;
+	char *drop = NULL;
+	int rc;
+
+	forget_import_schema();
+
+	rc = sqlite3_exec(db, "SAVEPOINT import", NULL, NULL, NULL);
+	CHECK_STATUS(rc);
+
+	rc = PREPARE(stmt, "SELECT type, sql FROM sqlite_master WHERE name=?1");
+	if (rc != SQLITE_OK) {
+		seterr();
+		abort_import();
 		return -1;
 	}
+
+	for (size_t i = 0; i < LEN(import_deferred); i++) {
+		BIND_TEXT(stmt, 1, import_deferred[i]);
+		rc = step(stmt);
+
+		// Anything already missing has nothing to rebuild.
+		if (rc == SQLITE_ROW) {
+			import_schema[i] = sqlite3_mprintf(
+				"%s", sqlite3_column_text(stmt, 1));
+			drop = sqlite3_mprintf("DROP %s %s",
+			                       sqlite3_column_text(stmt, 0),
+			                       import_deferred[i]);
+		}
+		sqlite3_reset(stmt);
+
+		if (rc != SQLITE_ROW && rc != SQLITE_DONE) {
+			seterr();
+			sqlite3_finalize(stmt);
+			sqlite3_free(drop);
+			abort_import();
+			return -1;
+		}
+
+		if (drop) {
+			rc = sqlite3_exec(db, drop, NULL, NULL, NULL);
+			sqlite3_free(drop);
+			drop = NULL;
+			if (rc != SQLITE_OK) {
+				seterr();
+				sqlite3_finalize(stmt);
+				abort_import();
+				return -1;
+			}
+		}
+	}
+
+	sqlite3_finalize(stmt);
+	return 0;
+}
+
+int tmdb_import_file(int file_id, const char *title, const char *hash)
+{
+	sqlite3_stmt *stmt = stmts[STMT_IMPORT_FILE];
+
+	BIND(int, stmt, 1, file_id);
+	BIND_TEXT(stmt, 2, title);
+	if (hash)
+		BIND_TEXT(stmt, 3, hash);
+
+	return exec_stmt(stmt);
+}
+
+int tmdb_import_end(int rebuild)
+{
+	// Nothing the import inserted was logged, so every view older than
+	// it must be rebuilt: advance the change sequence past them all, and
+	// mark it as pruned.
+	static const char *queries[] =
+		{"UPDATE tag SET files=(SELECT count(*) FROM image_tag"
+		 "                      WHERE image_tag.tag=tag.id);",
+
+		 "UPDATE sqlite_sequence SET seq=seq+1 WHERE name='change';",
+
+		 "INSERT INTO sqlite_sequence (name, seq)"
+		 " SELECT 'change', 1 WHERE NOT EXISTS"
+		 "  (SELECT 1 FROM sqlite_sequence WHERE name='change');",
+
+		 "INSERT OR REPLACE INTO meta (key, value)"
+		 " SELECT 'changes_pruned', seq FROM sqlite_sequence"
+		 " WHERE name='change';",
+
+		 0};
+	int status = 0;
+
+	for (size_t i = 0; rebuild && i < LEN(import_deferred); i++) {
+		if (import_schema[i] && sqlite3_exec(db, import_schema[i], NULL,
+		                                     NULL, NULL) != SQLITE_OK) {
+			seterr();
+			status = -1;
+			break;
+		}
+	}
+
+	if (rebuild && status == 0)
+		status = exec_queries(queries);
+
+	// The title index missed every file imported.
+	if (rebuild && status == 0 && title_index
+	    && sqlite3_exec(db, "INSERT INTO image_search (image_search)"
+	                        " VALUES ('rebuild')",
+	                    NULL, NULL, NULL) != SQLITE_OK) {
+		seterr();
+		status = -1;
+	}
+
+	if (status == 0 && rebuild && sqlite3_exec(db, "RELEASE import", NULL,
+	                                           NULL, NULL) != SQLITE_OK) {
+		seterr();
+		status = -1;
+	}
+
+	if (status < 0 || !rebuild)
+		abort_import();
+	forget_import_schema();
+	return status;
 }
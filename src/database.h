@@ -5,7 +5,14 @@
 
 // Return any non-zero value to exit the callback loop.
 typedef int (*file_callback)(const TMFile*, void*);
-typedef int (*tag_callback)(const char*);
+typedef int (*tag_callback)(const char *tag, size_t len);
+typedef int (*tag_count_callback)(const char *tag, size_t len,
+                                  long long count, void*);
+typedef int (*membership_callback)(int file_id, const char *tag, void*);
+typedef int (*change_callback)(int file_id, const char *tag,
+                               const char *title, void*);
+typedef int (*export_callback)(const TMFile*, const char *tags, size_t len,
+                               void*);
 
 /*
  * database.h -- tagmage database commands. All methods act as the backend for
@@ -25,8 +32,9 @@ const char *tmdb_get_error();
  * tmdb_setup() - Set up and load the database.
  *
  * db_path - the path to the tagmage database directory.
+ * opts - Connection tuning, or NULL to keep SQLite's defaults.
  */
-int tmdb_setup(const char *db_path);
+int tmdb_setup(const char *db_path, const TMOptions *opts);
 
 /**
  * tmdb_cleanup() - Clean up any loose ends in the database and close the
@@ -35,9 +43,39 @@ int tmdb_setup(const char *db_path);
 int tmdb_cleanup();
 
 /**
- * tmdb_new_file() - Add a file record to the database.
+ * tmdb_reset() - Reset every statement, as after a call that was cut short
+ * by longjmp(3).
  */
-int tmdb_new_file(const char *title);
+int tmdb_reset();
+
+/**
+ * tmdb_data_version() - Get a number that changes whenever another
+ * connection commits a change to the database.
+ */
+int tmdb_data_version(int *version);
+
+/**
+ * tmdb_begin() - Start a transaction. Every change until tmdb_commit() or
+ * tmdb_rollback() is applied at once, or not at all.
+ */
+int tmdb_begin();
+
+/**
+ * tmdb_commit() - Apply every change since tmdb_begin().
+ */
+int tmdb_commit();
+
+/**
+ * tmdb_rollback() - Discard every change since tmdb_begin().
+ */
+int tmdb_rollback();
+
+/**
+ * tmdb_new_file() - Add a file record to the database, and return its id.
+ *
+ * hash - The file's content hash if it's deduplicated, or NULL.
+ */
+int tmdb_new_file(const char *title, const char *hash);
 
 /**
  * tmdb_edit_title() - Change the title of a file record.
@@ -45,26 +83,87 @@ int tmdb_new_file(const char *title);
 int tmdb_edit_title(int file_id, const char *title);
 
 /**
- * tmdb_add_tag() - Add a tag to a file record.
+ * tmdb_add_tag() - Add a tag to a file record, unless it already has it.
  */
 int tmdb_add_tag(int file_id, const char *tag_name);
 
 /**
- * tmdb_remove_tag() - Remove tag from the file record.
+ * tmdb_remove_tag() - Remove tag from the file record. The tag itself is
+ * deleted once no file has it.
  */
 int tmdb_remove_tag(int file_id, const char *tag_name);
 
 /**
- * tmdb_delete_file() - Remove a file record.
+ * tmdb_tag_files() - Add every tag in `tags` to every file in `ids`,
+ * skipping files that already have it. The tags are looked up once, and
+ * the files tagged by a single statement.
+ */
+int tmdb_tag_files(const int *ids, int nids, const char **tags, int ntags);
+
+/**
+ * tmdb_untag_files() - Remove every tag in `tags` from every file in `ids`
+ * with a single statement. Tags no file has anymore are deleted.
+ */
+int tmdb_untag_files(const int *ids, int nids, const char **tags, int ntags);
+
+/**
+ * tmdb_delete_file() - Remove a file record, and any tag only it had.
  */
 int tmdb_delete_file(int file_id);
 
 /**
- * tmdb_get_file() - Retrieve file data from its id.
+ * tmdb_count_hash() - Return the number of file records that share the
+ * content hash, or -1 on error.
+ */
+int tmdb_count_hash(const char *hash);
+
+/**
+ * tmdb_get_layout() - Return the version of the store's directory layout,
+ * or -1 on error.
+ */
+int tmdb_get_layout();
+
+/**
+ * tmdb_set_layout() - Record a new version of the store's directory layout.
+ */
+int tmdb_set_layout(int layout);
+
+/**
+ * tmdb_gc() - Sweep the whole tag table for tags that no file has, and prune
+ * all but the latest changes from the change log.
+ */
+int tmdb_gc();
+
+/**
+ * tmdb_get_change_seq() - Get the sequence number of the latest change to
+ * any file, its title, or its tags. It only ever grows.
+ */
+int tmdb_get_change_seq(long long *seq);
+
+/**
+ * tmdb_get_pruned_seq() - Get the sequence number of the latest change
+ * pruned from the change log, or 0 if none were.
+ */
+int tmdb_get_pruned_seq(long long *seq);
+
+/**
+ * tmdb_get_changes() - Calls `callback` for every change after the sequence
+ * number `since`, grouped by file in order of id.
  *
- * file - Pointer where the information will be stored.
+ * `tag` is the tag added or removed, or NULL if the file itself changed.
+ * `title` is the file's title before the change, or NULL if unknown.
+ * arg - A void pointer that also gets passed to `callback`.
+ */
+int tmdb_get_changes(long long since, change_callback callback, void *arg);
+
+/**
+ * tmdb_get_file() - Look up a file from its id, and call `callback` with
+ * it. Fails if the file doesn't exist.
+ *
+ * callback - Called with the file, or NULL to only check that it exists.
+ * arg - A void pointer that also gets passed to `callback`.
  */
-int tmdb_get_file(int file_id, TMFile *file);
+int tmdb_get_file(int file_id, file_callback callback, void *arg);
 
 /**
  * tmdb_get_files() - Get every file, and call `callback` for each file.
@@ -73,6 +172,42 @@ int tmdb_get_file(int file_id, TMFile *file);
  */
 int tmdb_get_files(file_callback callback, void *arg);
 
+/**
+ * tmdb_query_files() - Run a query selecting file ids, and call `callback`
+ * for every matching file on the page, in its order.
+ *
+ * id_query - SQL select statement returning a single column of file ids,
+ * or NULL for every file.
+ * params - Text values bound, in order, to the query's parameters.
+ * page - The page to list, or NULL for every file in order of id.
+ * arg - A void pointer that also gets passed to `callback`.
+ */
+int tmdb_query_files(const char *id_query, const char **params, int nparams,
+                     const TMPage *page, file_callback callback, void *arg);
+
+/**
+ * tmdb_count_files() - Count the ids a query selects, stopping at `limit`.
+ *
+ * id_query - SQL select statement returning a single column of file ids.
+ * params - Text values bound, in order, to the query's parameters.
+ */
+int tmdb_count_files(const char *id_query, const char **params, int nparams,
+                     int limit, long long *count);
+
+/**
+ * tmdb_search_files() - Call `callback` for every file whose title has
+ * each word of `terms`, best matches first, among the ids `id_query`
+ * selects, if any. Words ending in `*` match any word they start. Titles
+ * are searched through a full-text index if SQLite has FTS5, or scanned
+ * for the words in order of id otherwise.
+ *
+ * params - Text values bound, in order, to `id_query`'s parameters.
+ * limit - Most files to list, or 0 for no limit.
+ */
+int tmdb_search_files(const char *terms, const char *id_query,
+                      const char **params, int nparams, int limit,
+                      file_callback callback, void *arg);
+
 /**
  * tmdb_has_tag() - Returns 1 if the specified file has the tag, -1 on error,
  * and 0 otherwise.
@@ -90,10 +225,75 @@ int tmdb_get_tags(tag_callback callback);
  */
 int tmdb_get_tags_by_file(int file_id, tag_callback callback);
 
+/**
+ * tmdb_get_tag_counts() - Calls `callback` for every real tag, with the
+ * number of files that have it.
+ *
+ * file_id - Only count the tags this file has, or 0 for every tag.
+ * arg - A void pointer that also gets passed to `callback`.
+ */
+int tmdb_get_tag_counts(int file_id, tag_count_callback callback, void *arg);
+
+/**
+ * tmdb_get_cooccurring() - Calls `callback` for every other tag that files
+ * with `tag` have, with the number of files that have both, from the most
+ * files down.
+ *
+ * arg - A void pointer that also gets passed to `callback`.
+ */
+int tmdb_get_cooccurring(const char *tag, tag_count_callback callback,
+                         void *arg);
+
+/**
+ * tmdb_get_memberships() - Calls `callback` for every tag of every file,
+ * grouped by tag.
+ *
+ * arg - A void pointer that also gets passed to `callback`.
+ */
+int tmdb_get_memberships(membership_callback callback, void *arg);
+
+/**
+ * tmdb_get_changed_memberships() - Calls `callback` for every tag of every
+ * file changed after the sequence number `since`, grouped by file in order
+ * of id.
+ *
+ * arg - A void pointer that also gets passed to `callback`.
+ */
+int tmdb_get_changed_memberships(long long since,
+                                 membership_callback callback, void *arg);
+
 /**
  * tmdb_has_tags() - Returns 1 if the specified file has any tags, -1 on error,
  * and 0 otherwise.
  */
 int tmdb_has_tags(int file_id);
 
+/**
+ * tmdb_export() - Calls `callback` for every file in order of id, with its
+ * tags separated by spaces, or NULL if it has none.
+ */
+int tmdb_export(export_callback callback, void *arg);
+
+/**
+ * tmdb_import_begin() - Drop the secondary indexes, and the triggers that
+ * count, log and index inserted rows, until tmdb_import_end(). Must be
+ * called within a transaction, and everything until tmdb_import_end() is
+ * undone unless it rebuilds them.
+ */
+int tmdb_import_begin();
+
+/**
+ * tmdb_import_file() - Add a file record with the given id. `hash` may be
+ * NULL. Tag it with tmdb_add_tag().
+ */
+int tmdb_import_file(int file_id, const char *title, const char *hash);
+
+/**
+ * tmdb_import_end() - If `rebuild` is truthy, rebuild what
+ * tmdb_import_begin() dropped, recount every tag's files, and make views
+ * older than the import rebuild from scratch. Otherwise, or if that fails,
+ * undo the import and restore them, leaving the rest of the transaction.
+ */
+int tmdb_import_end(int rebuild);
+
 #endif // BACKEND_H
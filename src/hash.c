@@ -0,0 +1,177 @@
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "hash.h"
+
+#define ROTR(X, N) (((X) >> (N)) | ((X) << (32 - (N))))
+
+static const uint32_t k[64] = {
+	0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5,
+	0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+	0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3,
+	0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+	0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc,
+	0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+	0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7,
+	0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+	0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13,
+	0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+	0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3,
+	0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+	0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5,
+	0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+	0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208,
+	0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+};
+
+// Mix one 64-byte block into the state.
+static void transform(HashState *hs, const unsigned char *block)
+{
+	uint32_t w[64];
+	uint32_t a, b, c, d, e, f, g, h;
+
+	for (int i = 0; i < 16; i++) {
+		w[i] = (uint32_t) block[i*4] << 24
+			| (uint32_t) block[i*4 + 1] << 16
+			| (uint32_t) block[i*4 + 2] << 8
+			| (uint32_t) block[i*4 + 3];
+	}
+
+	for (int i = 16; i < 64; i++) {
+		uint32_t s0 = ROTR(w[i-15], 7) ^ ROTR(w[i-15], 18)
+			^ (w[i-15] >> 3);
+		uint32_t s1 = ROTR(w[i-2], 17) ^ ROTR(w[i-2], 19)
+			^ (w[i-2] >> 10);
+		w[i] = w[i-16] + s0 + w[i-7] + s1;
+	}
+
+	a = hs->state[0]; b = hs->state[1];
+	c = hs->state[2]; d = hs->state[3];
+	e = hs->state[4]; f = hs->state[5];
+	g = hs->state[6]; h = hs->state[7];
+
+	for (int i = 0; i < 64; i++) {
+		uint32_t s1 = ROTR(e, 6) ^ ROTR(e, 11) ^ ROTR(e, 25);
+		uint32_t ch = (e & f) ^ (~e & g);
+		uint32_t t1 = h + s1 + ch + k[i] + w[i];
+		uint32_t s0 = ROTR(a, 2) ^ ROTR(a, 13) ^ ROTR(a, 22);
+		uint32_t maj = (a & b) ^ (a & c) ^ (b & c);
+		uint32_t t2 = s0 + maj;
+
+		h = g; g = f; f = e;
+		e = d + t1;
+		d = c; c = b; b = a;
+		a = t1 + t2;
+	}
+
+	hs->state[0] += a; hs->state[1] += b;
+	hs->state[2] += c; hs->state[3] += d;
+	hs->state[4] += e; hs->state[5] += f;
+	hs->state[6] += g; hs->state[7] += h;
+}
+
+void hash_init(HashState *hs)
+{
+	static const uint32_t initial[8] = {
+		0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a,
+		0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19
+	};
+
+	memcpy(hs->state, initial, sizeof(initial));
+	hs->length = 0;
+	hs->buf_len = 0;
+}
+
+void hash_update(HashState *hs, const void *data, size_t len)
+{
+	const unsigned char *bytes = data;
+
+	hs->length += len;
+
+	// Top up a partial block first.
+	if (hs->buf_len > 0) {
+		size_t n = sizeof(hs->buf) - hs->buf_len;
+		if (n > len)
+			n = len;
+
+		memcpy(hs->buf + hs->buf_len, bytes, n);
+		hs->buf_len += n;
+		bytes += n;
+		len -= n;
+
+		if (hs->buf_len < sizeof(hs->buf))
+			return;
+
+		transform(hs, hs->buf);
+		hs->buf_len = 0;
+	}
+
+	for (; len >= sizeof(hs->buf); bytes += 64, len -= 64)
+		transform(hs, bytes);
+
+	memcpy(hs->buf, bytes, len);
+	hs->buf_len = len;
+}
+
+void hash_final(HashState *hs, char *hex)
+{
+	static const char digits[] = "0123456789abcdef";
+	uint64_t bits = hs->length * 8;
+
+	// Pad with a single 1 bit, zeroes, and the message length in bits.
+	hs->buf[hs->buf_len++] = 0x80;
+	if (hs->buf_len > 56) {
+		memset(hs->buf + hs->buf_len, 0, 64 - hs->buf_len);
+		transform(hs, hs->buf);
+		hs->buf_len = 0;
+	}
+
+	memset(hs->buf + hs->buf_len, 0, 56 - hs->buf_len);
+	for (int i = 0; i < 8; i++)
+		hs->buf[63 - i] = bits >> (i * 8);
+	transform(hs, hs->buf);
+
+	for (int i = 0; i < HASH_SIZE; i++) {
+		unsigned char byte = hs->state[i / 4] >> (24 - (i % 4) * 8);
+		hex[i*2] = digits[byte >> 4];
+		hex[i*2 + 1] = digits[byte & 0xf];
+	}
+	hex[HASH_HEX_SIZE] = '\0';
+}
+
+int hash_file(const char *path, char *hex)
+{
+	const size_t buf_size = 1 << 20;
+	HashState hs;
+	FILE *fd = NULL;
+	char *buf = NULL;
+	size_t nread;
+	int status = 0;
+
+	fd = fopen(path, "rb");
+	if (fd == NULL)
+		return -1;
+
+	buf = malloc(buf_size);
+	if (buf == NULL) {
+		fclose(fd);
+		return -1;
+	}
+
+	hash_init(&hs);
+	while ((nread = fread(buf, 1, buf_size, fd)) > 0)
+		hash_update(&hs, buf, nread);
+
+	if (ferror(fd)) {
+		errno = EIO;
+		status = -1;
+	} else {
+		hash_final(&hs, hex);
+	}
+
+	free(buf);
+	fclose(fd);
+	return status;
+}
@@ -0,0 +1,46 @@
+#ifndef HASH_H
+#define HASH_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define HASH_SIZE 32
+#define HASH_HEX_SIZE (HASH_SIZE * 2)
+
+typedef struct HashState {
+	uint32_t state[8];
+	uint64_t length;
+	size_t buf_len;
+	unsigned char buf[64];
+} HashState;
+
+/*
+ * hash.h -- SHA-256 hashing of file contents, used to address files in a
+ * deduplicated store.
+ */
+
+/**
+ * hash_init() - Start a new hash.
+ */
+void hash_init(HashState *hs);
+
+/**
+ * hash_update() - Feed `len` bytes of `data` into the hash.
+ */
+void hash_update(HashState *hs, const void *data, size_t len);
+
+/**
+ * hash_final() - Finish the hash and write it to `hex` as a lowercase,
+ * null-terminated hexadecimal string.
+ *
+ * hex - Buffer of at least HASH_HEX_SIZE + 1 bytes.
+ */
+void hash_final(HashState *hs, char *hex);
+
+/**
+ * hash_file() - Hash the contents of the file at `path` into `hex`.
+ * Returns 0 on success, or -1 and sets errno on error.
+ */
+int hash_file(const char *path, char *hex);
+
+#endif // HASH_H
@@ -0,0 +1,889 @@
+#define _POSIX_C_SOURCE 200809L // strdup
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "bitmap.h"
+#include "database.h"
+#include "index.h"
+#include "util.h"
+
+#define INDEX_MAGIC "TMINDEX1"
+
+// Most changes an index catches up with in memory. Past this, rebuilding
+// it is about as fast, and leaves it current for every later program.
+#define CATCH_UP_MAX 4096
+
+// Bytes of padding that align an offset to 8 bytes.
+#define PAD(N) ((8 - (N) % 8) % 8)
+
+// Entries for every file and every tagged file come before the tags,
+// which are sorted by name.
+enum { ENTRY_ALL, ENTRY_TAGGED, ENTRY_TAGS };
+
+typedef struct IndexHeader {
+	char magic[8];
+	int64_t seq; // Change sequence number the index was built at.
+	uint32_t nentries;
+	uint32_t reserved;
+} IndexHeader;
+
+typedef struct IndexEntry {
+	uint64_t name;   // Offset of the null-terminated tag name.
+	uint64_t bitmap; // Offset of the bitmap.
+	uint64_t len;    // Length of the bitmap.
+} IndexEntry;
+
+// A bitmap being built, and the tag it's for.
+typedef struct BuildEntry {
+	char *name;
+	Bitmap bm;
+} BuildEntry;
+
+typedef struct Build {
+	BuildEntry *entries;
+	size_t n, cap;
+	int error;
+} Build;
+
+// What changed since the index was built.
+typedef struct CatchUp {
+	Build *b;
+	Bitmap changed; // Every file that changed.
+	int error;
+} CatchUp;
+
+typedef struct Query {
+	file_callback callback;
+	void *arg;
+	int status;
+	int stop; // Whether the callback asked to stop.
+	int left; // Files left on the page, or -1 for no limit.
+} Query;
+
+static char err_buf[BUFF_MAX] = {0};
+
+// The open index.
+static const char *map = NULL;
+static size_t map_len = 0;
+static const IndexEntry *entries = NULL;
+static uint32_t nentries = 0;
+static long long map_seq = 0;
+
+// Once the open index caught up with later changes: every file, every
+// tagged file, then every tag whose files changed, sorted by name. They
+// take the place of the mapped entries of the same name.
+static Build patch = {0};
+static long long patch_seq = 0;
+static int patched = 0;
+
+static void seterr(const char *path)
+{
+	snprintf(err_buf, sizeof(err_buf), "%s: %s", path, strerror(errno));
+}
+
+static BuildEntry *new_entry(Build *b, const char *name)
+{
+	BuildEntry *entry = NULL;
+
+	if (b->n == b->cap) {
+		size_t cap = b->cap ? b->cap * 2 : 64;
+		BuildEntry *grown = realloc(b->entries, cap * sizeof(*grown));
+
+		if (grown == NULL)
+			return NULL;
+
+		b->entries = grown;
+		b->cap = cap;
+	}
+
+	entry = &b->entries[b->n];
+	entry->name = strdup(name);
+	if (entry->name == NULL)
+		return NULL;
+
+	bitmap_init(&entry->bm);
+	b->n++;
+	return entry;
+}
+
+static int add_file(const TMFile *file, void *arg)
+{
+	Build *b = arg;
+
+	if (bitmap_add(&b->entries[ENTRY_ALL].bm, file->id) < 0) {
+		b->error = errno;
+		return 1;
+	}
+
+	return 0;
+}
+
+static int add_membership(int file_id, const char *tag, void *arg)
+{
+	Build *b = arg;
+	BuildEntry *entry = &b->entries[b->n - 1];
+
+	// Memberships come grouped by tag, so a new tag starts a new
+	// bitmap.
+	if (b->n == ENTRY_TAGS || !STREQ(entry->name, tag)) {
+		entry = new_entry(b, tag);
+		if (entry == NULL) {
+			b->error = ENOMEM;
+			return 1;
+		}
+	}
+
+	if (bitmap_add(&entry->bm, file_id) < 0
+	    || bitmap_add(&b->entries[ENTRY_TAGGED].bm, file_id) < 0) {
+		b->error = errno;
+		return 1;
+	}
+
+	return 0;
+}
+
+static int compare_entries(const void *a, const void *b)
+{
+	return strcmp(((const BuildEntry*) a)->name,
+                      ((const BuildEntry*) b)->name);
+}
+
+static void free_build(Build *b)
+{
+	for (size_t i = 0; i < b->n; i++) {
+		free(b->entries[i].name);
+		bitmap_free(&b->entries[i].bm);
+	}
+	free(b->entries);
+	memset(b, 0, sizeof(*b));
+}
+
+// Find the first tag entry built whose name isn't less than `tag`.
+static size_t lower_built(const Build *b, const char *tag)
+{
+	size_t lo = ENTRY_TAGS, hi = b->n;
+
+	while (lo < hi) {
+		size_t mid = lo + (hi - lo) / 2;
+
+		if (strcmp(b->entries[mid].name, tag) < 0)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	return lo;
+}
+
+// Find a tag's entry among those built, or return NULL.
+static BuildEntry *find_built(const Build *b, const char *tag)
+{
+	size_t i = lower_built(b, tag);
+
+	return i < b->n && STREQ(b->entries[i].name, tag) ? &b->entries[i]
+	                                                  : NULL;
+}
+
+// Write the index in the layout tmidx_open() maps.
+static int write_index(FILE *f, Build *b, long long seq)
+{
+	static const char zeros[8] = {0};
+	IndexHeader header = {.seq = seq, .nentries = b->n};
+	IndexEntry *table = calloc(b->n, sizeof(*table));
+	long offset = sizeof(header) + b->n * sizeof(*table);
+	int status = -1;
+
+	if (table == NULL)
+		return -1;
+	memcpy(header.magic, INDEX_MAGIC, sizeof(header.magic));
+
+	// Leave room for the header and table until the offsets are known.
+	if (fseek(f, offset, SEEK_SET) != 0)
+		goto cleanup;
+
+	for (size_t i = 0; i < b->n; i++) {
+		size_t len = strlen(b->entries[i].name) + 1;
+
+		table[i].name = offset;
+		if (fwrite(b->entries[i].name, 1, len, f) != len)
+			goto cleanup;
+		offset += len;
+	}
+
+	// Bitmaps are read in place, so they must be aligned.
+	if (fwrite(zeros, 1, PAD(offset), f) != (size_t) PAD(offset))
+		goto cleanup;
+	offset += PAD(offset);
+
+	for (size_t i = 0; i < b->n; i++) {
+		table[i].bitmap = offset;
+		if (bitmap_write(&b->entries[i].bm, f) < 0)
+			goto cleanup;
+
+		table[i].len = ftell(f) - offset;
+		offset += table[i].len;
+	}
+
+	if (fseek(f, 0, SEEK_SET) != 0
+	    || fwrite(&header, sizeof(header), 1, f) != 1
+	    || fwrite(table, sizeof(*table), b->n, f) != b->n)
+		goto cleanup;
+
+	status = 0;
+
+cleanup:
+	free(table);
+	return status;
+}
+
+const char *tmidx_get_err()
+{
+	return err_buf;
+}
+
+int tmidx_build(const char *path)
+{
+	char tmp_path[PATH_MAX + 1];
+	Build b = {0};
+	long long seq = 0;
+	FILE *f = NULL;
+	int status = -1, rc;
+
+	// Take the sequence number first, so changes made while building
+	// leave the index out of date rather than wrong.
+	if (tmdb_get_change_seq(&seq) < 0) {
+		strncpy(err_buf, tmdb_get_error(), sizeof(err_buf)-1);
+		return -1;
+	}
+
+	if (new_entry(&b, "") == NULL || new_entry(&b, "") == NULL) {
+		strncpy(err_buf, "Out of memory.", sizeof(err_buf)-1);
+		goto cleanup;
+	}
+
+	if (tmdb_get_files(&add_file, &b) < 0
+	    || tmdb_get_memberships(&add_membership, &b) < 0) {
+		strncpy(err_buf, tmdb_get_error(), sizeof(err_buf)-1);
+		goto cleanup;
+	}
+
+	if (b.error) {
+		errno = b.error;
+		seterr(path);
+		goto cleanup;
+	}
+
+	qsort(b.entries + ENTRY_TAGS, b.n - ENTRY_TAGS, sizeof(*b.entries),
+              &compare_entries);
+
+	// Write it elsewhere and move it into place, so nothing ever maps
+	// half an index.
+	if ((size_t) snprintf(tmp_path, sizeof(tmp_path), "%s.%ld", path,
+                              (long) getpid()) >= sizeof(tmp_path)) {
+		errno = ENAMETOOLONG;
+		seterr(path);
+		goto cleanup;
+	}
+
+	f = fopen(tmp_path, "wb");
+	if (f == NULL) {
+		seterr(tmp_path);
+		goto cleanup;
+	}
+
+	rc = write_index(f, &b, seq);
+	if (fclose(f) != 0 || rc < 0) {
+		seterr(tmp_path);
+		remove(tmp_path);
+		goto cleanup;
+	}
+
+	if (rename(tmp_path, path) != 0) {
+		seterr(path);
+		remove(tmp_path);
+		goto cleanup;
+	}
+
+	status = 0;
+
+cleanup:
+	free_build(&b);
+	return status;
+}
+
+int tmidx_open(const char *path)
+{
+	const IndexHeader *header = NULL;
+	struct stat st;
+	void *addr = NULL;
+	int fd;
+
+	tmidx_close();
+
+	fd = open(path, O_RDONLY);
+	if (fd < 0) {
+		if (errno == ENOENT)
+			return 1;
+		seterr(path);
+		return -1;
+	}
+
+	if (fstat(fd, &st) != 0) {
+		seterr(path);
+		close(fd);
+		return -1;
+	}
+
+	if ((size_t) st.st_size < sizeof(*header)) {
+		close(fd);
+		goto invalid;
+	}
+
+	addr = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (addr == MAP_FAILED) {
+		seterr(path);
+		return -1;
+	}
+
+	map = addr;
+	map_len = st.st_size;
+	header = addr;
+
+	if (memcmp(header->magic, INDEX_MAGIC, sizeof(header->magic)) != 0
+	    || header->nentries < ENTRY_TAGS
+	    || (map_len - sizeof(*header)) / sizeof(*entries)
+	       < header->nentries)
+		goto invalid;
+
+	entries = (const IndexEntry*) (header + 1);
+	nentries = header->nentries;
+	map_seq = header->seq;
+
+	// Tag names must be null-terminated inside the index.
+	for (uint32_t i = ENTRY_TAGS; i < nentries; i++) {
+		if (entries[i].name >= map_len
+		    || !memchr(map + entries[i].name, '\0',
+		               map_len - entries[i].name))
+			goto invalid;
+	}
+
+	return 0;
+
+invalid:
+	tmidx_close();
+	snprintf(err_buf, sizeof(err_buf), "%s: Invalid index.", path);
+	return -1;
+}
+
+void tmidx_close()
+{
+	if (map)
+		munmap((void*) map, map_len);
+
+	free_build(&patch);
+	patched = 0;
+	patch_seq = 0;
+
+	map = NULL;
+	map_len = 0;
+	entries = NULL;
+	nentries = 0;
+	map_seq = 0;
+}
+
+int tmidx_is_fresh()
+{
+	long long seq;
+
+	if (map == NULL)
+		return 0;
+
+	if (tmdb_get_change_seq(&seq) < 0) {
+		strncpy(err_buf, tmdb_get_error(), sizeof(err_buf)-1);
+		return -1;
+	}
+
+	return seq == (patched ? patch_seq : map_seq);
+}
+
+// Map an entry's bitmap.
+static int map_entry(uint32_t i, Bitmap *bm)
+{
+	const IndexEntry *entry = &entries[i];
+
+	if (entry->bitmap > map_len || entry->len > map_len - entry->bitmap
+	    || bitmap_map(bm, map + entry->bitmap, entry->len) < 0) {
+		strncpy(err_buf, "Invalid index.", sizeof(err_buf)-1);
+		return -1;
+	}
+
+	return 0;
+}
+
+// Find the first tag entry whose name isn't less than `tag`.
+static uint32_t lower_bound(const char *tag)
+{
+	uint32_t lo = ENTRY_TAGS, hi = nentries;
+
+	while (lo < hi) {
+		uint32_t mid = lo + (hi - lo) / 2;
+
+		if (strcmp(map + entries[mid].name, tag) < 0)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	return lo;
+}
+
+// Find a tag's entry, or return 0 if no file has it.
+static uint32_t find_tag(const char *tag)
+{
+	uint32_t i = lower_bound(tag);
+
+	return i < nentries && STREQ(map + entries[i].name, tag) ? i : 0;
+}
+
+static int note_change(int file_id, const char *tag, const char *title,
+                       void *arg)
+{
+	CatchUp *cu = arg;
+
+	UNUSED(title);
+	if (bitmap_add(&cu->changed, file_id) < 0
+	    || (tag && new_entry(cu->b, tag) == NULL)) {
+		cu->error = ENOMEM;
+		return 1;
+	}
+
+	return 0;
+}
+
+static int note_file(const TMFile *file, void *arg)
+{
+	CatchUp *cu = arg;
+
+	if (bitmap_add(&cu->b->entries[ENTRY_ALL].bm, file->id) < 0) {
+		cu->error = ENOMEM;
+		return 1;
+	}
+
+	return 0;
+}
+
+static int note_tag(int file_id, const char *tag, void *arg)
+{
+	CatchUp *cu = arg;
+
+	UNUSED(file_id);
+	if (new_entry(cu->b, tag) == NULL) {
+		cu->error = ENOMEM;
+		return 1;
+	}
+
+	return 0;
+}
+
+static int note_membership(int file_id, const char *tag, void *arg)
+{
+	CatchUp *cu = arg;
+	BuildEntry *entry = find_built(cu->b, tag);
+
+	// Tagged since the tags were gathered; catch up some other time.
+	if (entry == NULL) {
+		cu->error = EAGAIN;
+		return 1;
+	}
+
+	if (bitmap_add(&entry->bm, file_id) < 0
+	    || bitmap_add(&cu->b->entries[ENTRY_TAGGED].bm, file_id) < 0) {
+		cu->error = ENOMEM;
+		return 1;
+	}
+
+	return 0;
+}
+
+// Drop the duplicate names among sorted tag entries.
+static void unique_entries(Build *b)
+{
+	size_t n = ENTRY_TAGS;
+
+	for (size_t i = ENTRY_TAGS; i < b->n; i++) {
+		if (n > ENTRY_TAGS && STREQ(b->entries[n - 1].name,
+		                            b->entries[i].name)) {
+			free(b->entries[i].name);
+			bitmap_free(&b->entries[i].bm);
+		} else {
+			b->entries[n++] = b->entries[i];
+		}
+	}
+
+	b->n = n;
+}
+
+int tmidx_catch_up()
+{
+	TagVector none = {0};
+	CatchUp cu = {0};
+	Build b = {0};
+	Bitmap base;
+	long long seq, pruned;
+	int status = -1;
+
+	if (map == NULL) {
+		strncpy(err_buf, "No index is open.", sizeof(err_buf)-1);
+		return -1;
+	}
+
+	// Take the sequence number first, as tmidx_build() does.
+	if (tmdb_get_change_seq(&seq) < 0
+	    || tmdb_get_pruned_seq(&pruned) < 0) {
+		strncpy(err_buf, tmdb_get_error(), sizeof(err_buf)-1);
+		return -1;
+	}
+
+	// The changes must still be logged, and few enough.
+	if (seq < map_seq || map_seq < pruned || seq - map_seq > CATCH_UP_MAX)
+		return 1;
+
+	cu.b = &b;
+	bitmap_init(&cu.changed);
+	bitmap_init(&base);
+	if (new_entry(&b, "") == NULL || new_entry(&b, "") == NULL) {
+		cu.error = ENOMEM;
+		goto error;
+	}
+
+	// Which files changed, and every tag they had or have now...
+	if (tmdb_get_changes(map_seq, &note_change, &cu) < 0
+	    || tmdb_get_changed_memberships(map_seq, &note_tag, &cu) < 0) {
+		strncpy(err_buf, tmdb_get_error(), sizeof(err_buf)-1);
+		goto cleanup;
+	}
+	if (cu.error)
+		goto error;
+
+	qsort(b.entries + ENTRY_TAGS, b.n - ENTRY_TAGS, sizeof(*b.entries),
+              &compare_entries);
+	unique_entries(&b);
+
+	// ...then which of them are still there, and with which tags.
+	if (tmtag_get_changed_files(&none, map_seq, &note_file, &cu) < 0) {
+		strncpy(err_buf, tmtag_get_err(), sizeof(err_buf)-1);
+		goto cleanup;
+	}
+	if (cu.error == 0 && tmdb_get_changed_memberships(
+	                             map_seq, &note_membership, &cu) < 0) {
+		strncpy(err_buf, tmdb_get_error(), sizeof(err_buf)-1);
+		goto cleanup;
+	}
+	if (cu.error)
+		goto error;
+
+	// Every changed entry is what the index has for the files that
+	// didn't change, and what the database has for those that did.
+	for (size_t i = 0; i < b.n; i++) {
+		uint32_t mapped = i < ENTRY_TAGS ? i : find_tag(b.entries[i].name);
+
+		if ((i < ENTRY_TAGS || mapped) && map_entry(mapped, &base) < 0)
+			goto cleanup;
+
+		if (bitmap_andnot(&base, &base, &cu.changed) < 0
+		    || bitmap_or(&b.entries[i].bm, &b.entries[i].bm, &base) < 0) {
+			cu.error = errno;
+			goto error;
+		}
+		bitmap_free(&base);
+	}
+
+	free_build(&patch);
+	patch = b;
+	memset(&b, 0, sizeof(b));
+	patch_seq = seq;
+	patched = 1;
+	status = 0;
+	goto cleanup;
+
+error:
+	strncpy(err_buf, strerror(cu.error), sizeof(err_buf)-1);
+cleanup:
+	bitmap_free(&base);
+	bitmap_free(&cu.changed);
+	free_build(&b);
+	return status;
+}
+
+// Load one of the entries before the tags, as caught up if it has.
+static int load_entry(uint32_t i, Bitmap *bm)
+{
+	if (!patched)
+		return map_entry(i, bm);
+
+	if (bitmap_copy(bm, &patch.entries[i].bm) < 0) {
+		strncpy(err_buf, "Out of memory.", sizeof(err_buf)-1);
+		return -1;
+	}
+
+	return 0;
+}
+
+// Load a tag's files, as caught up if they changed.
+static int load_tag(const char *tag, Bitmap *bm)
+{
+	const BuildEntry *entry = patched ? find_built(&patch, tag) : NULL;
+	uint32_t i;
+
+	if (entry) {
+		if (bitmap_copy(bm, &entry->bm) < 0) {
+			strncpy(err_buf, "Out of memory.", sizeof(err_buf)-1);
+			return -1;
+		}
+		return 0;
+	}
+
+	i = find_tag(tag);
+	return i ? map_entry(i, bm) : 0;
+}
+
+static int pass_file(const TMFile *file, void *arg)
+{
+	Query *q = arg;
+
+	q->stop = q->callback(file, q->arg);
+	return q->stop;
+}
+
+static int emit_file(uint32_t id, void *arg)
+{
+	Query *q = arg;
+
+	if (q->left == 0)
+		return 1;
+
+	if (tmdb_get_file(id, &pass_file, q) < 0) {
+		strncpy(err_buf, tmdb_get_error(), sizeof(err_buf)-1);
+		q->status = -1;
+		return 1;
+	}
+
+	if (q->left > 0)
+		q->left--;
+	return q->stop;
+}
+
+static int eval(const TagQuery *query, Bitmap *out);
+
+// Unite every tag starting with `prefix`.
+static int eval_prefix(const char *prefix, Bitmap *out)
+{
+	size_t len = strlen(prefix);
+	Bitmap bm;
+
+	bitmap_init(&bm);
+	for (uint32_t i = lower_bound(prefix); i < nentries
+	     && strncmp(map + entries[i].name, prefix, len) == 0; i++) {
+		// Tags that changed are united from the patch below.
+		if (patched && find_built(&patch, map + entries[i].name))
+			continue;
+
+		if (map_entry(i, &bm) < 0)
+			return -1;
+		if (bitmap_or(out, out, &bm) < 0)
+			goto nomem;
+		bitmap_free(&bm);
+	}
+
+	for (size_t i = patched ? lower_built(&patch, prefix) : patch.n;
+	     i < patch.n && strncmp(patch.entries[i].name, prefix, len) == 0;
+	     i++) {
+		if (bitmap_or(out, out, &patch.entries[i].bm) < 0)
+			goto nomem;
+	}
+
+	return 0;
+
+nomem:
+	bitmap_free(&bm);
+	strncpy(err_buf, "Out of memory.", sizeof(err_buf)-1);
+	return -1;
+}
+
+// Intersect from the smallest set up, so every step is bounded by it, and
+// fall back to every file when there's nothing to intersect. Exclusions
+// come last.
+static int eval_and(const TagQuery *query, Bitmap *out)
+{
+	Bitmap *maps = calloc(query->nargs, sizeof(*maps));
+	Bitmap **pos = calloc(query->nargs + 1, sizeof(*pos));
+	uint64_t *counts = calloc(query->nargs + 1, sizeof(*counts));
+	Bitmap *cur = NULL;
+	Bitmap all;
+	int npos = 0, status = -1;
+
+	bitmap_init(&all);
+	if ((query->nargs && maps == NULL) || pos == NULL || counts == NULL) {
+		strncpy(err_buf, "Out of memory.", sizeof(err_buf)-1);
+		goto cleanup;
+	}
+
+	for (int i = 0; i < query->nargs; i++) {
+		const TagQuery *arg = query->args[i];
+		uint64_t count;
+		int j = npos;
+
+		bitmap_init(&maps[i]);
+		if (arg->op == QUERY_NOT)
+			continue;
+
+		if (eval(arg, &maps[i]) < 0)
+			goto cleanup;
+
+		count = bitmap_count(&maps[i]);
+		for (; j > 0 && counts[j - 1] > count; j--) {
+			pos[j] = pos[j - 1];
+			counts[j] = counts[j - 1];
+		}
+		pos[j] = &maps[i];
+		counts[j] = count;
+		npos++;
+
+		// Nothing left to intersect.
+		if (count == 0) {
+			bitmap_free(out);
+			status = 0;
+			goto cleanup;
+		}
+	}
+
+	if (npos == 0 && load_entry(ENTRY_ALL, &all) < 0)
+		goto cleanup;
+
+	cur = npos ? pos[0] : &all;
+	for (int i = 1; i < npos; i++) {
+		if (bitmap_and(out, cur, pos[i]) < 0)
+			goto nomem;
+		cur = out;
+	}
+
+	for (int i = 0; i < query->nargs; i++) {
+		if (query->args[i]->op != QUERY_NOT)
+			continue;
+
+		if (eval(query->args[i]->args[0], &maps[i]) < 0)
+			goto cleanup;
+		if (bitmap_andnot(out, cur, &maps[i]) < 0)
+			goto nomem;
+		cur = out;
+	}
+
+	// A single set is taken over as is.
+	if (cur != out) {
+		bitmap_free(out);
+		*out = *cur;
+		bitmap_init(cur);
+	}
+
+	status = 0;
+	goto cleanup;
+
+nomem:
+	strncpy(err_buf, "Out of memory.", sizeof(err_buf)-1);
+cleanup:
+	for (int i = 0; maps && i < query->nargs; i++)
+		bitmap_free(&maps[i]);
+	bitmap_free(&all);
+	free(maps);
+	free(pos);
+	free(counts);
+	return status;
+}
+
+// Evaluate a query into `out`, which may borrow the index's memory.
+static int eval(const TagQuery *query, Bitmap *out)
+{
+	Bitmap bm;
+	int rc = 0;
+
+	bitmap_init(&bm);
+	switch (query->op) {
+	case QUERY_TAG:
+		return load_tag(query->name, out);
+	case QUERY_PREFIX:
+		return eval_prefix(query->name, out);
+	case QUERY_TAGGED:
+		return load_entry(ENTRY_TAGGED, out);
+	case QUERY_NOT:
+		if (load_entry(ENTRY_ALL, out) < 0 || eval(query->args[0], &bm) < 0)
+			break;
+		rc = bitmap_andnot(out, out, &bm);
+		goto done;
+	case QUERY_AND:
+		return eval_and(query, out);
+	case QUERY_OR:
+		for (int i = 0; i < query->nargs; i++) {
+			bitmap_free(&bm);
+			if (eval(query->args[i], &bm) < 0)
+				goto fail;
+			rc = bitmap_or(out, out, &bm);
+			if (rc < 0)
+				break;
+		}
+		goto done;
+	}
+
+fail:
+	bitmap_free(&bm);
+	return -1;
+
+done:
+	bitmap_free(&bm);
+	if (rc < 0)
+		strncpy(err_buf, "Out of memory.", sizeof(err_buf)-1);
+	return rc;
+}
+
+int tmidx_get_files(const TagVector *filters, const TMPage *page,
+                    file_callback callback, void *arg)
+{
+	TagQuery *query = NULL;
+	Query q = {callback, arg, 0, 0, -1};
+	Bitmap result;
+
+	if (page && page->sort != TM_SORT_ID) {
+		strncpy(err_buf, "The index only lists files by id.",
+		        sizeof(err_buf)-1);
+		return -1;
+	}
+
+	query = tmtag_parse(filters);
+	if (query == NULL) {
+		strncpy(err_buf, tmtag_get_err(), sizeof(err_buf)-1);
+		return -1;
+	}
+
+	if (page && page->limit > 0)
+		q.left = page->limit;
+
+	bitmap_init(&result);
+	if (eval(query, &result) == 0) {
+		bitmap_each_from(&result, page ? (uint32_t) page->after + 1 : 0,
+		                 &emit_file, &q);
+	} else {
+		q.status = -1;
+	}
+
+	bitmap_free(&result);
+	tmtag_free_query(query);
+	return q.status;
+}
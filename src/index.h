@@ -0,0 +1,62 @@
+#ifndef INDEX_H
+#define INDEX_H
+
+#include "tags.h"
+
+/*
+ * index.h -- tagmage tag index. The index keeps the set of files with each
+ * tag as a compressed bitmap, so tag filters are answered with a few set
+ * operations instead of a query. It's saved to a file that later runs map
+ * into memory as is, stamped with the database's change sequence number.
+ * An index that's out of date catches up with the changes logged since in
+ * memory, or is never used.
+ *
+ * If documentation does not specify, the method returns 0 on success, or -1
+ * on error.
+ */
+
+/**
+ * tmidx_get_err() - Return a cstring containing the latest error.
+ */
+const char *tmidx_get_err();
+
+/**
+ * tmidx_build() - Build the index from the database, and save it to `path`.
+ * Programs using an older index at `path` keep using it until they reopen
+ * it.
+ */
+int tmidx_build(const char *path);
+
+/**
+ * tmidx_open() - Map the index saved at `path`, replacing any index that
+ * was already open. Returns 1 if there's no index there.
+ */
+int tmidx_open(const char *path);
+
+/**
+ * tmidx_close() - Unmap the open index, if any.
+ */
+void tmidx_close();
+
+/**
+ * tmidx_is_fresh() - Returns 1 if an index is open and the database hasn't
+ * changed since it was built, -1 on error, and 0 otherwise.
+ */
+int tmidx_is_fresh();
+
+/**
+ * tmidx_catch_up() - Bring the open index up to date with the changes
+ * since it was built, in memory, so it's fresh until the next change.
+ * Returns 1 if they were pruned or are too many, and the index must be
+ * rebuilt instead.
+ */
+int tmidx_catch_up();
+
+/**
+ * tmidx_get_files() - Like tmtag_get_page(), but answered from the open
+ * index. It must be fresh, and the page sorted by id, if any.
+ */
+int tmidx_get_files(const TagVector *filters, const TMPage *page,
+                    file_callback callback, void *arg);
+
+#endif // INDEX_H
@@ -1,18 +1,205 @@
+#define _POSIX_C_SOURCE 200809L // strdup
+
+#include <dirent.h>
 #include <errno.h> // errno, ENOBUFS
+#include <pthread.h>
+#include <signal.h> // kill
 #include <stdio.h> // snprintf
-#include <stdlib.h> // getenv
-#include <limits.h> // PATH_MAX
+#include <stdlib.h> // getenv, realloc
+#include <limits.h> // PATH_MAX, INT_MAX, LLONG_MAX
+#include <ctype.h> // isxdigit
 #include <string.h>
+#include <unistd.h> // link
+
+#include <sys/stat.h> // mkdir
 
 #include "database.h"
+#include "hash.h"
+#include "index.h"
+#include "stats.h"
 #include "util.h" // mkpath
 #include "libtagmage.h"
 
-static enum { ERR_OK, ERR_LIBC, ERR_DATABASE } err_status = ERR_OK;
+static enum {
+	ERR_OK, ERR_LIBC, ERR_DATABASE, ERR_TAGS, ERR_INDEX, ERR_FORMAT
+} err_status = ERR_OK;
+
+// Why an import couldn't be read.
+static char format_err[BUFF_MAX] = {0};
 
 static char tagmage_path[PATH_MAX + 1] = {0};
 
+// Directory layout of the store, as recorded in the database.
+static int store_layout = TM_LAYOUT_FLAT;
+
+// Changes whenever another process commits to the database, so cached
+// settings know when to be read again.
+static int data_version = 0;
+
+// Stored files touched during an open transaction. Files added are
+// removed again on rollback, and removed files are only deleted from the
+// store once the transaction commits.
+typedef struct PathList {
+	size_t size, cap;
+	char **paths;
+} PathList;
+
+static int in_transaction = 0;
+static PathList pending_adds = {0};
+static PathList pending_rms = {0};
+static PathList pending_moves = {0}; // Sources of files moved in.
+
+static int push_path(PathList *list, const char *path)
+{
+	char *copy = NULL;
+
+	if (list->size == list->cap) {
+		size_t cap = list->cap ? list->cap * 2 : 64;
+		char **paths = realloc(list->paths, cap * sizeof(*paths));
+		if (paths == NULL)
+			return -1;
+
+		list->paths = paths;
+		list->cap = cap;
+	}
+
+	copy = strdup(path);
+	if (copy == NULL)
+		return -1;
+
+	list->paths[list->size++] = copy;
+	return 0;
+}
+
+// Take a path back out of the list. Returns 1 if it was there, or 0.
+static int drop_path(PathList *list, const char *path)
+{
+	for (size_t i = 0; i < list->size; i++) {
+		if (STREQ(list->paths[i], path)) {
+			free(list->paths[i]);
+			list->paths[i] = list->paths[--list->size];
+			return 1;
+		}
+	}
+
+	return 0;
+}
+
+// Remove every file in the list if `unlink_files` is set, and empty the
+// list.
+static void flush_paths(PathList *list, int unlink_files)
+{
+	for (size_t i = 0; i < list->size; i++) {
+		if (unlink_files)
+			remove(list->paths[i]);
+		free(list->paths[i]);
+	}
+
+	list->size = 0;
+}
+
+// Create the directory a stored file goes in.
+static int make_parent(const char *path)
+{
+	char dir[PATH_MAX + 1];
+	char *slash = NULL;
+	struct stat st;
+
+	strncpy(dir, path, PATH_MAX);
+	dir[PATH_MAX] = '\0';
+
+	slash = strrchr(dir, '/');
+	if (slash == NULL || slash == dir)
+		return 0;
+
+	*slash = '\0';
+
+	// The directory usually exists already, or is a single level deep.
+	if (mkdir(dir, 0700) == 0)
+		return 0;
+	if (errno != EEXIST && mkpath(dir, 0700) < 0)
+		return -1;
+
+	// Something else may have its name.
+	if (stat(dir, &st) != 0)
+		return -1;
+	if (!S_ISDIR(st.st_mode)) {
+		errno = ENOTDIR;
+		return -1;
+	}
+
+	return 0;
+}
+
+// Returns 1 if both paths name the same file, or 0 if they don't or
+// either is missing.
+static int same_file(const char *a, const char *b)
+{
+	struct stat st_a, st_b;
+
+	return stat(a, &st_a) == 0 && stat(b, &st_b) == 0
+		&& st_a.st_dev == st_b.st_dev && st_a.st_ino == st_b.st_ino;
+}
+
+// Remove a file from the store. A file that doesn't exist is already
+// removed, so it's not an error.
+static int remove_stored(const char *path)
+{
+	double start = tmstat_now();
+
+	if (remove(path) != 0 && errno != ENOENT) {
+		err_status = ERR_LIBC;
+		return -1;
+	}
+
+	tmstat_record("fs.remove", tmstat_now() - start, NULL);
+	return 0;
+}
+
+// Read an integer option from the environment, or keep `value` if it's
+// unset, malformed or outside `min`..`max`.
+static long long env_int(const char *name, long long value, long long min,
+                         long long max)
+{
+	char *env = getenv(name), *end = NULL;
+	long long parsed;
+
+	if (env == NULL || *env == '\0')
+		return value;
+
+	errno = 0;
+	parsed = strtoll(env, &end, 0);
+	if (errno || *end != '\0' || parsed < min || parsed > max)
+		return value;
+
+	return parsed;
+}
+
+static const char *env_str(const char *name, const char *value)
+{
+	char *env = getenv(name);
+	return env && *env ? env : value;
+}
+
+void tm_default_options(TMOptions *opts)
+{
+	// WAL lets any number of readers run alongside one writer, and
+	// NORMAL only syncs at checkpoints, which is still safe in WAL mode.
+	opts->journal_mode = env_str("TAGMAGE_JOURNAL_MODE", "WAL");
+	opts->synchronous = env_str("TAGMAGE_SYNCHRONOUS", "NORMAL");
+	opts->mmap_size = env_int("TAGMAGE_MMAP_SIZE", 256LL << 20, 0,
+	                          LLONG_MAX);
+	opts->cache_size = env_int("TAGMAGE_CACHE_SIZE", -16384, LLONG_MIN,
+	                           LLONG_MAX);
+	opts->busy_timeout = env_int("TAGMAGE_BUSY_TIMEOUT", 5000, 0, INT_MAX);
+}
+
 int tm_init(const char *path)
+{
+	return tm_init_opts(path, NULL);
+}
+
+int tm_locate(const char *path)
 {
 	char *env = NULL;
 	size_t len = 0;
@@ -31,13 +218,27 @@ int tm_init(const char *path)
 
 	// Double-check to make sure the buffer size was all right.
 	if (len >= sizeof(tagmage_path)) {
+		err_status = ERR_LIBC;
 		errno = ENOBUFS;
 		return -1;
-    }
+	}
+
+	return 0;
+}
+
+int tm_init_opts(const char *path, const TMOptions *opts)
+{
+	TMOptions defaults;
+	size_t len = 0;
+
+	if (tm_locate(path) < 0)
+		return -1;
 
 	// Create path to database if it's not set up already
-	if (mkpath(tagmage_path, 0700) < 0)
+	if (mkpath(tagmage_path, 0700) < 0) {
+		err_status = ERR_LIBC;
 		return -1; // Errno is set correctly.
+	}
 
 	// Set up database.
 	char db_path[PATH_MAX + 1] = {0};
@@ -45,22 +246,65 @@ int tm_init(const char *path)
 
 	// Double-check to make sure the buffer size was all right.
 	if (len >= sizeof(tagmage_path)) {
+		err_status = ERR_LIBC;
 		errno = ENOBUFS;
 		return -1;
     }
 
-    if (tmdb_setup(db_path) < 0)
+    if (opts == NULL) {
+	    tm_default_options(&defaults);
+	    opts = &defaults;
+    }
+
+    if (tmdb_setup(db_path, opts) < 0) {
+	    err_status = ERR_DATABASE;
+	    return -1;
+    }
+
+    store_layout = tmdb_get_layout();
+    if (store_layout < 0 || tmdb_data_version(&data_version) < 0) {
+	    err_status = ERR_DATABASE;
 	    return -1;
+    }
 
     return 0;
 }
 
+int tm_refresh()
+{
+	int version;
+
+	if (tmdb_data_version(&version) < 0) {
+		err_status = ERR_DATABASE;
+		return -1;
+	}
+
+	if (version == data_version)
+		return 0;
+
+	// Another process may have moved the store to a new layout.
+	store_layout = tmdb_get_layout();
+	if (store_layout < 0) {
+		err_status = ERR_DATABASE;
+		return -1;
+	}
+
+	data_version = version;
+	return 0;
+}
+
 const char *tm_get_error() {
 	switch (err_status) {
 	case ERR_LIBC:
 		return strerror(errno);
 	case ERR_DATABASE:
 		return tmdb_get_error();
+	case ERR_TAGS:
+		return tmtag_get_err();
+	case ERR_INDEX:
+		return tmidx_get_err();
+	case ERR_FORMAT:
+		return format_err;
 	default:
 		return NULL;
 	}
@@ -71,78 +315,1261 @@ const char *tm_path()
 	return tagmage_path;
 }
 
+int tm_begin()
+{
+	if (tmdb_begin() < 0) {
+		err_status = ERR_DATABASE;
+		return -1;
+	}
+
+	// Other writers are held off from here on, so the layout can't
+	// change under the files this transaction stores.
+	if (tm_refresh() < 0) {
+		tmdb_rollback();
+		return -1;
+	}
+
+	in_transaction = 1;
+	return 0;
+}
+
+int tm_commit()
+{
+	if (tmdb_commit() < 0) {
+		err_status = ERR_DATABASE;
+		return -1;
+	}
+
+	in_transaction = 0;
+	flush_paths(&pending_adds, 0);
+	flush_paths(&pending_rms, 1);
+	flush_paths(&pending_moves, 1);
+	return 0;
+}
+
+int tm_rollback()
+{
+	// Files are cleaned up even if the database fails to roll back;
+	// SQLite discards the transaction once the connection closes.
+	in_transaction = 0;
+	flush_paths(&pending_adds, 1);
+	flush_paths(&pending_rms, 0);
+	flush_paths(&pending_moves, 0);
+
+	if (tmdb_rollback() < 0) {
+		err_status = ERR_DATABASE;
+		return -1;
+	}
+
+	return 0;
+}
+
+int tm_in_transaction()
+{
+	return in_transaction;
+}
+
+// Format where a file is stored in the given layout.
+static size_t layout_path(const TMFile *file, int layout, char *dst, size_t n)
+{
+	if (layout == TM_LAYOUT_FLAT) {
+		if (file->hash[0])
+			return snprintf(dst, n, "%s/blob/%s",
+                                        tagmage_path, file->hash);
+
+		return snprintf(dst, n, "%s/%i", tagmage_path, file->id);
+	}
+
+	// Fan out over two levels of 256 directories each. Blobs use the
+	// start of their hash, and ids their low bytes, since both spread
+	// evenly there. Shards of ids live under their own directory, since
+	// their names would clash with flat files named after ids.
+	if (file->hash[0])
+		return snprintf(dst, n, "%s/blob/%.2s/%.2s/%s", tagmage_path,
+                                file->hash, file->hash + 2, file->hash);
+
+	return snprintf(dst, n, "%s/shard/%02x/%02x/%i", tagmage_path,
+                        file->id & 0xff, (file->id >> 8) & 0xff, file->id);
+}
+
 size_t tm_file_path(const TMFile *file, char *dst, size_t n)
 {
-	return snprintf(dst, n, "%s/%i", tagmage_path, file->id);
+	return layout_path(file, store_layout, dst, n);
 }
 
-int tm_add_file(const char *path, TMFile *file)
+TMFile *tm_copy_file(const TMFile *file)
 {
-	const char *basename = NULL;
-	char path_buf[PATH_MAX + 1] = {0};
-	size_t len = 0;
+	// Keep the title right after the struct, so one free() does.
+	TMFile *copy = malloc(sizeof(*copy) + file->title_len + 1);
+	char *title = NULL;
 
-	// Search for the basename.
-	basename = strrchr(path, '/');
-	if (basename) {
-		basename++;
-	} else {
-		basename = path;
+	if (copy == NULL) {
+		err_status = ERR_LIBC;
+		return NULL;
 	}
 
-	// Copy the basename to the image struct.
-	len = strncpy((char*) file->title, basename, sizeof(file->title)-1)
-		- (char*)file->title;
-	if (len >= sizeof(file->title)) {
+	title = (char*) (copy + 1);
+	*copy = *file;
+	memcpy(title, file->title, file->title_len);
+	title[file->title_len] = '\0';
+	copy->title = title;
+	return copy;
+}
+
+static size_t index_path(char *dst, size_t n)
+{
+	return snprintf(dst, n, "%s/index", tagmage_path);
+}
+
+int tm_index()
+{
+	char path[PATH_MAX + 1];
+	double start = tmstat_now();
+
+	if (index_path(path, sizeof(path)) >= sizeof(path)) {
+		err_status = ERR_LIBC;
 		errno = ENOBUFS;
 		return -1;
 	}
 
-	// Get the file id.
-	file->id = tmdb_new_file(basename);
-	if (file->id < 0)
+	if (tmidx_build(path) < 0) {
+		err_status = ERR_INDEX;
 		return -1;
+	}
 
-	// Prepare the file path
-	if (tm_file_path(file, path_buf, sizeof(path_buf)) >= sizeof(path_buf)) {
-		errno = ENOBUFS;
-		return -1;
-    }
+	tmstat_record("tm_index", tmstat_now() - start, NULL);
+	return 0;
+}
 
-	// Copy the file and handle file errors.
-	if (cp(path_buf, path) < 0) {
-		tmdb_delete_file(file->id);
-		return -1;
-    }
+// Bring the store's tag index up to date, if it has one. Returns 1 if it
+// can answer a query, or 0 if the database must. An index too far behind
+// to catch up with in memory is rebuilt, once for every later program.
+static int use_index()
+{
+	char path[PATH_MAX + 1];
+	double start = tmstat_now();
+	int fresh = tmidx_is_fresh(), rc;
 
-	// Everything OK!
+	if (fresh != 0)
+		return fresh == 1;
+
+	// The index on disk may have been rebuilt since it was opened.
+	if (index_path(path, sizeof(path)) >= sizeof(path)
+	    || tmidx_open(path) != 0)
+		return 0;
+
+	fresh = tmidx_is_fresh();
+	if (fresh != 0)
+		return fresh == 1;
+
+	rc = tmidx_catch_up();
+	if (rc == 0)
+		tmstat_record("tm_index.catch_up", tmstat_now() - start, NULL);
+	else if (rc == 1 && tm_index() == 0 && tmidx_open(path) == 0)
+		rc = tmidx_is_fresh() == 1 ? 0 : -1;
+
+	return rc == 0;
+}
+
+int tm_get_files(const TagVector *filters, file_callback callback, void *arg)
+{
+	return tm_get_page(filters, NULL, callback, arg);
+}
+
+// Keep a copy of the file a page follows.
+static int copy_after(const TMFile *file, void *arg)
+{
+	TMFile **after = arg;
+
+	*after = tm_copy_file(file);
 	return 0;
 }
 
-int tm_rm_file(const TMFile *file)
+// Passes files on to another callback, counting them.
+typedef struct CountedCallback {
+	file_callback callback;
+	void *arg;
+	long long count;
+} CountedCallback;
+
+static int count_file(const TMFile *file, void *arg)
 {
-	char path_buf[PATH_MAX + 1];
-	size_t len;
+	CountedCallback *counted = arg;
 
-	// Copy file path to buffer.
-	len = tm_file_path(file, path_buf, sizeof(path_buf));
-	if (len >= sizeof(path_buf)) {
-		errno = ENOBUFS;
-		return -1;
+	counted->count++;
+	return counted->callback(file, counted->arg);
+}
+
+int tm_get_page(const TagVector *filters, const TMPage *page,
+                file_callback callback, void *arg)
+{
+	CountedCallback counted = {callback, arg, 0};
+	double start = tmstat_now();
+	TMPage by_title;
+	TMStat delta;
+	TMFile *after = NULL;
+	int fresh = 0, status = 0;
+
+	if (tmstat_on) {
+		callback = &count_file;
+		arg = &counted;
 	}
 
-	// Remove the file.
-	int status = remove(path_buf);
-	if (status != 0) {
-		// If the file never existed in the first place, we can
-		// recover. Otherwise, return an error code.
-		if (status != ENOENT)
+	// Pages sorted by title start after the title of their file.
+	if (page && page->sort == TM_SORT_TITLE && page->after
+	    && page->after_title == NULL) {
+		if (tmdb_get_file(page->after, &copy_after, &after) < 0) {
+			err_status = ERR_DATABASE;
+			return -1;
+		}
+		if (after == NULL)
 			return -1;
+
+		by_title = *page;
+		by_title.after_title = after->title;
+		page = &by_title;
 	}
 
-	// Delete the reference from the data base.
-	if (tmdb_delete_file(file->id) < 0)
-		return -1;
+	// The index only keeps files in order of id, and is only caught up
+	// with changes others can see.
+	if (!in_transaction && (page == NULL || page->sort == TM_SORT_ID))
+		fresh = use_index();
+
+	if (fresh == 1) {
+		if (tmidx_get_files(filters, page, callback, arg) < 0) {
+			err_status = ERR_INDEX;
+			status = -1;
+		}
+	} else if (tmtag_get_page(filters, page, callback, arg) < 0) {
+		// Without an up-to-date index, plan a query instead.
+		err_status = ERR_TAGS;
+		status = -1;
+	}
+
+	if (tmstat_on && status == 0) {
+		memset(&delta, 0, sizeof(delta));
+		delta.rows = counted.count;
+		tmstat_record(fresh == 1 ? "tm_get_page.index"
+		              : "tm_get_page.query", tmstat_now() - start, &delta);
+	}
+
+	free(after);
+	return status;
+}
+
+int tm_layout()
+{
+	return store_layout;
+}
+
+// Paths of a file in two layouts, handed to each file while migrating.
+typedef struct Relayout {
+	int from, to;
+	int error;
+} Relayout;
+
+static int link_relayout(const TMFile *file, void *arg)
+{
+	Relayout *rl = arg;
+	char src[PATH_MAX + 1], dst[PATH_MAX + 1];
+
+	if (layout_path(file, rl->from, src, sizeof(src)) >= sizeof(src)
+	    || layout_path(file, rl->to, dst, sizeof(dst)) >= sizeof(dst)) {
+		rl->error = ENOBUFS;
+		return 1;
+	}
+
+	if (make_parent(dst) < 0) {
+		rl->error = errno;
+		return 1;
+	}
+
+	// Files missing from the store stay missing. Anything already in
+	// the new place must be the same file, such as a blob shared by
+	// several files and linked by the first.
+	if (link(src, dst) != 0 && errno != ENOENT
+	    && (errno != EEXIST || !same_file(src, dst))) {
+		rl->error = errno;
+		return 1;
+	}
+
+	return 0;
+}
+
+// Check that a file is in its new place, if it was in its old one.
+static int check_relayout(const TMFile *file, void *arg)
+{
+	Relayout *rl = arg;
+	char src[PATH_MAX + 1], dst[PATH_MAX + 1];
+
+	layout_path(file, rl->from, src, sizeof(src));
+	layout_path(file, rl->to, dst, sizeof(dst));
+
+	if (access(src, F_OK) != 0)
+		return 0;
+
+	errno = 0;
+	if (!same_file(src, dst)) {
+		rl->error = errno ? errno : EEXIST;
+		return 1;
+	}
+
+	return 0;
+}
+
+// Remove the empty shard directories a path was in, up to the store.
+static void remove_shards(char *path)
+{
+	char *slash = NULL;
+
+	for (int i = 0; i < 3 && (slash = strrchr(path, '/')); i++) {
+		*slash = '\0';
+		if (rmdir(path) != 0)
+			break;
+	}
+}
+
+// Remove a file from the layout it's no longer in, as long as it's safe
+// in the other. Drops the directories it leaves empty.
+static void unlink_layout(const TMFile *file, int from, int to)
+{
+	char old[PATH_MAX + 1], new[PATH_MAX + 1];
+
+	if (layout_path(file, from, old, sizeof(old)) >= sizeof(old)
+	    || layout_path(file, to, new, sizeof(new)) >= sizeof(new))
+		return;
+
+	if (!same_file(old, new))
+		return;
+
+	remove(old);
+	if (from != TM_LAYOUT_FLAT)
+		remove_shards(old);
+}
 
+static int unlink_relayout(const TMFile *file, void *arg)
+{
+	Relayout *rl = arg;
+
+	unlink_layout(file, rl->from, rl->to);
+	return 0;
+}
+
+// Undo link_relayout(), keeping the old paths.
+static int unlink_partial(const TMFile *file, void *arg)
+{
+	Relayout *rl = arg;
+
+	unlink_layout(file, rl->to, rl->from);
 	return 0;
 }
+
+int tm_set_layout(int layout)
+{
+	Relayout rl = {.to = layout};
+
+	if (layout != TM_LAYOUT_FLAT && layout != TM_LAYOUT_SHARDED) {
+		err_status = ERR_LIBC;
+		errno = EINVAL;
+		return -1;
+	}
+
+	// Link every file into its new place while holding off writers, so
+	// no file is added in the old layout behind our back. Readers can
+	// keep using the old paths until the new layout commits.
+	if (tm_begin() < 0)
+		return -1;
+
+	// Only now is the current layout known for sure.
+	rl.from = store_layout;
+	if (layout == store_layout)
+		return tm_rollback();
+
+	if (tmdb_get_files(&link_relayout, &rl) < 0) {
+		err_status = ERR_DATABASE;
+		goto rollback;
+	}
+
+	// Make sure every file made it before the old paths are let go.
+	if (rl.error == 0 && tmdb_get_files(&check_relayout, &rl) < 0) {
+		err_status = ERR_DATABASE;
+		goto rollback;
+	}
+
+	if (rl.error) {
+		err_status = ERR_LIBC;
+		errno = rl.error;
+		goto rollback;
+	}
+
+	if (tmdb_set_layout(layout) < 0) {
+		err_status = ERR_DATABASE;
+		goto rollback;
+	}
+
+	if (tm_commit() < 0)
+		goto rollback;
+
+	// Only then let go of the old paths.
+	store_layout = layout;
+	if (tmdb_get_files(&unlink_relayout, &rl) < 0) {
+		err_status = ERR_DATABASE;
+		return -1;
+	}
+
+	return 0;
+
+rollback:
+	{
+		int saved_errno = errno;
+		tmdb_get_files(&unlink_partial, &rl);
+		tm_rollback();
+		errno = saved_errno;
+	}
+	return -1;
+}
+
+// cp(), counting the bytes copied while stats are on.
+static int copy_counted(const char *dst, const char *src)
+{
+	double start = tmstat_now();
+	struct stat st;
+	TMStat delta;
+
+	if (cp(dst, src) != 0)
+		return -1;
+
+	if (tmstat_on) {
+		memset(&delta, 0, sizeof(delta));
+		if (stat(dst, &st) == 0)
+			delta.bytes = st.st_size;
+		tmstat_record("fs.copy", tmstat_now() - start, &delta);
+	}
+
+	return 0;
+}
+
+// Put the file at `src` into the store at `dst`. Links fall back to a
+// copy when the source is on another filesystem, or on one without hard
+// links.
+static int store_file(const char *dst, const char *src, TMAddMode method)
+{
+	double start;
+
+	if (method == TM_ADD_COPY)
+		return copy_counted(dst, src);
+
+	// Clear out anything left over from an interrupted add.
+	if (remove(dst) != 0 && errno != ENOENT)
+		return -1;
+
+	start = tmstat_now();
+	if (link(src, dst) == 0) {
+		tmstat_record("fs.link", tmstat_now() - start, NULL);
+		return 0;
+	}
+
+	switch (errno) {
+	case EXDEV:
+	case EPERM:
+	case EMLINK:
+	case ENOTSUP:
+		return copy_counted(dst, src);
+	default:
+		return -1;
+	}
+}
+
+// Files are added in two steps. Staging hashes a file and copies it into
+// the store's tmp directory, which only touches the filesystem and can run
+// on any thread. Placing gives the file an id and renames it into place,
+// and runs on the thread that owns the database.
+typedef enum { ITEM_PENDING, ITEM_STAGED, ITEM_FAILED } ItemState;
+
+typedef struct ImportItem {
+	const char *src;
+	char hash[HASH_MAX + 1];
+	ItemState state;
+	int is_staged; // Whether a copy is waiting in the tmp directory.
+	int error;
+} ImportItem;
+
+typedef struct Import {
+	ImportItem *items;
+	int size;
+	TMAddMode mode;
+
+	// Shared between the workers and the placing thread.
+	pthread_mutex_t lock;
+	pthread_cond_t staged, placed;
+	int next;    // Next item to stage.
+	int done;    // Number of items placed.
+	int window;  // How far staging may run ahead of placing.
+	int stop;
+} Import;
+
+static size_t tmp_path(char *dst, size_t n, int index)
+{
+	return snprintf(dst, n, "%s/tmp/%ld.%i", tagmage_path,
+                        (long) getpid(), index);
+}
+
+// Remove staged copies left behind by imports that died partway.
+static void clean_tmp_dir()
+{
+	char path[PATH_MAX + 1];
+	struct dirent *entry;
+	DIR *dir;
+
+	if ((size_t) snprintf(path, sizeof(path), "%s/tmp", tagmage_path)
+	    >= sizeof(path))
+		return;
+
+	dir = opendir(path);
+	if (dir == NULL)
+		return;
+
+	while ((entry = readdir(dir)) != NULL) {
+		long pid = strtol(entry->d_name, NULL, 10);
+
+		if (pid <= 0 || kill(pid, 0) == 0 || errno != ESRCH)
+			continue;
+
+		if ((size_t) snprintf(path, sizeof(path), "%s/tmp/%s",
+                                      tagmage_path, entry->d_name)
+		    < sizeof(path))
+			remove(path);
+	}
+
+	closedir(dir);
+}
+
+static void stage_item(Import *im, int index)
+{
+	ImportItem *item = &im->items[index];
+	char path[PATH_MAX + 1];
+
+	item->hash[0] = '\0';
+	if (im->mode & TM_ADD_DEDUP) {
+		TMFile blob;
+
+		if (hash_file(item->src, item->hash) < 0)
+			goto fail;
+
+		// Skip the copy if the contents are already stored.
+		memcpy(blob.hash, item->hash, sizeof(blob.hash));
+		tm_file_path(&blob, path, sizeof(path));
+		if (access(path, F_OK) == 0)
+			return;
+	}
+
+	if (tmp_path(path, sizeof(path), index) >= sizeof(path)) {
+		errno = ENOBUFS;
+		goto fail;
+	}
+
+	if (store_file(path, item->src, im->mode & ~TM_ADD_DEDUP) != 0) {
+		int saved_errno = errno;
+		remove(path);
+		errno = saved_errno;
+		goto fail;
+	}
+
+	item->is_staged = 1;
+	return;
+
+fail:
+	item->error = errno;
+	item->state = ITEM_FAILED;
+}
+
+static void *stage_worker(void *arg)
+{
+	Import *im = arg;
+
+	pthread_mutex_lock(&im->lock);
+	for (;;) {
+		int index;
+
+		while (!im->stop && im->next < im->size
+                       && im->next >= im->done + im->window)
+			pthread_cond_wait(&im->placed, &im->lock);
+
+		if (im->stop || im->next >= im->size)
+			break;
+
+		index = im->next++;
+		pthread_mutex_unlock(&im->lock);
+
+		stage_item(im, index);
+
+		pthread_mutex_lock(&im->lock);
+		if (im->items[index].state == ITEM_PENDING)
+			im->items[index].state = ITEM_STAGED;
+		pthread_cond_broadcast(&im->staged);
+	}
+	pthread_mutex_unlock(&im->lock);
+
+	return NULL;
+}
+
+// Give a staged item an id and move it into place.
+static int place_item(Import *im, int index, TMFile *file)
+{
+	ImportItem *item = &im->items[index];
+	TMAddMode method = im->mode & ~TM_ADD_DEDUP;
+	const char *basename = NULL;
+	char path_buf[PATH_MAX + 1] = {0};
+	char staged[PATH_MAX + 1] = {0};
+	int is_stored = 0;
+
+	if (item->state == ITEM_FAILED) {
+		err_status = ERR_LIBC;
+		errno = item->error;
+		return -1;
+	}
+
+	// Search for the basename.
+	basename = strrchr(item->src, '/');
+	if (basename) {
+		basename++;
+	} else {
+		basename = item->src;
+	}
+
+	// The title is the basename, which lasts as long as the import.
+	file->title = basename;
+	file->title_len = strlen(basename);
+	memcpy(file->hash, item->hash, sizeof(file->hash));
+
+	// Deduplicated files are addressed by their contents, and only
+	// stored if no other file has the same contents.
+	if (file->hash[0]) {
+		int count = tmdb_count_hash(file->hash);
+		if (count < 0) {
+			err_status = ERR_DATABASE;
+			return -1;
+		}
+
+		is_stored = count > 0;
+	}
+
+	// Get the file id.
+	file->id = tmdb_new_file(basename, file->hash[0] ? file->hash : NULL);
+	if (file->id < 0) {
+		err_status = ERR_DATABASE;
+		return -1;
+	}
+
+	// Prepare the file path
+	if (tm_file_path(file, path_buf, sizeof(path_buf)) >= sizeof(path_buf)) {
+		err_status = ERR_LIBC;
+		errno = ENOBUFS;
+		return -1;
+	}
+	tmp_path(staged, sizeof(staged), index);
+
+	if (is_stored) {
+		// Someone else already has the contents.
+		if (item->is_staged)
+			remove(staged);
+	} else {
+		int status = make_parent(path_buf);
+		int created = 0;
+
+		// The path may be waiting to be removed by this transaction;
+		// it's needed again now, and by the file a rollback restores,
+		// so a rollback must leave it too.
+		int kept = drop_path(&pending_rms, path_buf);
+
+		if (status < 0) {
+			// Handled below.
+		} else if (file->hash[0] && access(path_buf, F_OK) == 0) {
+			// The blob is there already, with the same contents.
+			if (item->is_staged)
+				remove(staged);
+		} else if (item->is_staged) {
+			status = rename(staged, path_buf);
+			created = 1;
+		} else {
+			// The blob seen while staging is gone again.
+			status = store_file(path_buf, item->src, method);
+			created = 1;
+		}
+
+		// Handle file errors.
+		if (status != 0) {
+			int saved_errno = errno;
+
+			err_status = ERR_LIBC;
+			if (item->is_staged)
+				remove(staged);
+			if (!file->hash[0])
+				remove(path_buf);
+			tmdb_delete_file(file->id);
+			errno = saved_errno;
+			return -1;
+		}
+
+		// Remember the copy in case the transaction rolls back.
+		if (in_transaction && created && !kept
+		    && push_path(&pending_adds, path_buf) < 0) {
+			err_status = ERR_LIBC;
+			return -1;
+		}
+	}
+	item->is_staged = 0;
+
+	// A moved file is a link whose source goes away once it's safe to.
+	if (method == TM_ADD_MOVE) {
+		if (in_transaction) {
+			if (push_path(&pending_moves, item->src) < 0) {
+				err_status = ERR_LIBC;
+				return -1;
+			}
+		} else if (remove(item->src) != 0) {
+			err_status = ERR_LIBC;
+			return -1;
+		}
+	}
+
+	// Everything OK!
+	return 0;
+}
+
+int tm_add_file(const char *path, TMFile *file)
+{
+	return tm_add_file_mode(path, file, TM_ADD_COPY);
+}
+
+// Keep the file that tm_add_files() added.
+static int copy_file(const TMFile *file, void *arg)
+{
+	memcpy(arg, file, sizeof(*file));
+	return 0;
+}
+
+int tm_add_file_mode(const char *path, TMFile *file, TMAddMode mode)
+{
+	return tm_add_files(&path, 1, mode, 1, &copy_file, file);
+}
+
+int tm_add_files(const char **paths, int n, TMAddMode mode, int jobs,
+                 file_callback callback, void *arg)
+{
+	char tmp_dir[PATH_MAX + 1];
+	pthread_t *workers = NULL;
+	double start = tmstat_now();
+	TMStat delta;
+	int nworkers = 0, placed = 0;
+	int own_transaction = !in_transaction;
+	int status = 0;
+	Import im = {
+		.size = n,
+		.mode = mode,
+		.lock = PTHREAD_MUTEX_INITIALIZER,
+		.staged = PTHREAD_COND_INITIALIZER,
+		.placed = PTHREAD_COND_INITIALIZER,
+		.window = jobs * 4,
+	};
+
+	if (n <= 0)
+		return 0;
+
+	if ((size_t) snprintf(tmp_dir, sizeof(tmp_dir), "%s/tmp", tagmage_path)
+	    >= sizeof(tmp_dir)) {
+		err_status = ERR_LIBC;
+		errno = ENOBUFS;
+		return -1;
+	}
+
+	if (mkpath(tmp_dir, 0700) < 0) {
+		err_status = ERR_LIBC;
+		return -1;
+	}
+	clean_tmp_dir();
+
+	im.items = calloc(n, sizeof(*im.items));
+	if (im.items == NULL) {
+		err_status = ERR_LIBC;
+		return -1;
+	}
+
+	for (int i = 0; i < n; i++)
+		im.items[i].src = paths[i];
+
+	// Without a transaction of our own, the whole import is one.
+	if (own_transaction && tm_begin() < 0) {
+		free(im.items);
+		return -1;
+	}
+
+	// One file has nothing to overlap with, so stage it in place.
+	if (jobs > 1 && n > 1) {
+		workers = calloc(MIN(jobs, n), sizeof(*workers));
+		if (workers == NULL) {
+			err_status = ERR_LIBC;
+			status = -1;
+			goto cleanup;
+		}
+
+		for (; nworkers < MIN(jobs, n); nworkers++) {
+			if (pthread_create(&workers[nworkers], NULL,
+                                           &stage_worker, &im) != 0)
+				break;
+		}
+	}
+
+	for (int i = 0; i < n && status == 0; i++) {
+		TMFile file;
+
+		if (nworkers > 0) {
+			pthread_mutex_lock(&im.lock);
+			while (im.items[i].state == ITEM_PENDING)
+				pthread_cond_wait(&im.staged, &im.lock);
+			pthread_mutex_unlock(&im.lock);
+		} else {
+			stage_item(&im, i);
+		}
+
+		if (place_item(&im, i, &file) < 0) {
+			status = -1;
+			break;
+		}
+
+		pthread_mutex_lock(&im.lock);
+		im.done++;
+		pthread_cond_broadcast(&im.placed);
+		pthread_mutex_unlock(&im.lock);
+		placed++;
+
+		if (callback(&file, arg))
+			break;
+	}
+
+cleanup:
+	pthread_mutex_lock(&im.lock);
+	im.stop = 1;
+	pthread_cond_broadcast(&im.placed);
+	pthread_mutex_unlock(&im.lock);
+
+	for (int i = 0; i < nworkers; i++)
+		pthread_join(workers[i], NULL);
+
+	// Throw away whatever was staged but never placed.
+	for (int i = 0; i < n; i++) {
+		if (im.items[i].is_staged) {
+			tmp_path(tmp_dir, sizeof(tmp_dir), i);
+			remove(tmp_dir);
+		}
+	}
+
+	if (own_transaction) {
+		if (status == 0) {
+			status = tm_commit();
+		} else {
+			int saved_errno = errno;
+			tm_rollback();
+			errno = saved_errno;
+		}
+	}
+
+	if (tmstat_on && status == 0) {
+		memset(&delta, 0, sizeof(delta));
+		delta.rows = placed;
+		tmstat_record("tm_add_files", tmstat_now() - start, &delta);
+	}
+
+	free(workers);
+	free(im.items);
+	return status;
+}
+
+// Copy the hash of a file into the TMFile `arg`.
+static int get_hash(const TMFile *file, void *arg)
+{
+	TMFile *dst = arg;
+
+	memcpy(dst->hash, file->hash, sizeof(dst->hash));
+	return 0;
+}
+
+void tm_stats_enable(int on)
+{
+	tmstat_enable(on);
+}
+
+void tm_stats_reset()
+{
+	tmstat_reset();
+}
+
+int tm_get_stats(stat_callback callback, void *arg)
+{
+	return tmstat_each(callback, arg);
+}
+
+int tm_print_stats(FILE *fp, int json)
+{
+	return tmstat_print(fp, json);
+}
+
+int tm_rm_file(const TMFile *file)
+{
+	char path_buf[PATH_MAX + 1];
+	TMFile stored = *file;
+	size_t len;
+
+	// Look up where the file is stored. A file that doesn't exist has
+	// nothing to look up, and nothing to remove but its id's path.
+	stored.hash[0] = '\0';
+	tmdb_get_file(file->id, &get_hash, &stored);
+
+	// Copy file path to buffer.
+	len = tm_file_path(&stored, path_buf, sizeof(path_buf));
+	if (len >= sizeof(path_buf)) {
+		err_status = ERR_LIBC;
+		errno = ENOBUFS;
+		return -1;
+	}
+
+	// Delete the reference from the data base.
+	if (tmdb_delete_file(file->id) < 0) {
+		err_status = ERR_DATABASE;
+		return -1;
+	}
+
+	// Keep a deduplicated file while any other file shares it.
+	if (stored.hash[0]) {
+		int count = tmdb_count_hash(stored.hash);
+		if (count < 0) {
+			err_status = ERR_DATABASE;
+			return -1;
+		} else if (count > 0) {
+			return 0;
+		}
+	}
+
+	// Keep the file until the transaction commits.
+	if (in_transaction) {
+		if (push_path(&pending_rms, path_buf) < 0) {
+			err_status = ERR_LIBC;
+			return -1;
+		}
+		return 0;
+	}
+
+	// Remove the file.
+	return remove_stored(path_buf);
+}
+
+// Write `len` bytes of `str` with backslashes, tabs and line breaks
+// escaped, so they can't end a field or a line.
+static void put_escaped(FILE *fp, const char *str, size_t len)
+{
+	for (size_t i = 0; i < len; i++) {
+		switch (str[i]) {
+		case '\\': fputs("\\\\", fp); break;
+		case '\t': fputs("\\t", fp); break;
+		case '\n': fputs("\\n", fp); break;
+		case '\r': fputs("\\r", fp); break;
+		default: putc(str[i], fp); break;
+		}
+	}
+}
+
+// Undo put_escaped() in place. Returns -1 on an unknown escape.
+static int unescape(char *str)
+{
+	char *dst = str;
+
+	for (; *str; str++) {
+		if (*str != '\\') {
+			*dst++ = *str;
+			continue;
+		}
+
+		switch (*++str) {
+		case '\\': *dst++ = '\\'; break;
+		case 't': *dst++ = '\t'; break;
+		case 'n': *dst++ = '\n'; break;
+		case 'r': *dst++ = '\r'; break;
+		default: return -1;
+		}
+	}
+
+	*dst = '\0';
+	return 0;
+}
+
+typedef struct Export {
+	FILE *fp;
+	int blobs;
+	int error; // Errno of the first failure, if any.
+} Export;
+
+// Write a stored file's contents as base64, in chunks that encode without
+// padding until the last.
+static int put_blob(FILE *fp, const TMFile *file)
+{
+	unsigned char buf[3 * 16384];
+	char encoded[BASE64_LEN(sizeof(buf))];
+	char path[PATH_MAX + 1];
+	FILE *blob = NULL;
+	size_t n;
+
+	if (tm_file_path(file, path, sizeof(path)) >= sizeof(path)) {
+		errno = ENOBUFS;
+		return -1;
+	}
+
+	blob = fopen(path, "rb");
+	if (blob == NULL)
+		return -1;
+
+	while ((n = fread(buf, 1, sizeof(buf), blob)) > 0)
+		fwrite(encoded, 1, base64_encode(encoded, buf, n), fp);
+
+	if (ferror(blob)) {
+		int saved_errno = errno;
+		fclose(blob);
+		errno = saved_errno;
+		return -1;
+	}
+
+	fclose(blob);
+	return 0;
+}
+
+static int export_file(const TMFile *file, const char *tags, size_t len,
+                       void *arg)
+{
+	Export *ex = arg;
+
+	fprintf(ex->fp, "%d\t", file->id);
+	put_escaped(ex->fp, file->title, file->title_len);
+	fprintf(ex->fp, "\t%s\t", file->hash);
+	if (tags)
+		put_escaped(ex->fp, tags, len);
+
+	if (ex->blobs) {
+		putc('\t', ex->fp);
+		if (put_blob(ex->fp, file) < 0) {
+			ex->error = errno;
+			return 1;
+		}
+	}
+
+	putc('\n', ex->fp);
+	if (ferror(ex->fp)) {
+		ex->error = errno;
+		return 1;
+	}
+
+	return 0;
+}
+
+int tm_export(FILE *fp, int blobs)
+{
+	Export ex = {fp, blobs, 0};
+
+	fprintf(fp, "# tagmage export: id, title, hash, tags%s\n",
+	        blobs ? ", contents" : "");
+
+	if (tmdb_export(&export_file, &ex) < 0) {
+		err_status = ERR_DATABASE;
+		return -1;
+	}
+
+	if (ex.error || fflush(fp) != 0) {
+		err_status = ERR_LIBC;
+		if (ex.error)
+			errno = ex.error;
+		return -1;
+	}
+
+	return 0;
+}
+
+static int format_error(long line, const char *msg)
+{
+	snprintf(format_err, sizeof(format_err), "Line %ld: %s", line, msg);
+	err_status = ERR_FORMAT;
+	return -1;
+}
+
+// Write an imported file's contents into the store, unless a
+// deduplicated copy is already there.
+static int import_blob(const TMFile *file, char *blob, long line)
+{
+	char path[PATH_MAX + 1], hash[HASH_HEX_SIZE + 1];
+	ssize_t n = base64_decode((unsigned char*) blob, blob, strlen(blob));
+	FILE *fp = NULL;
+	HashState hs;
+	int kept;
+
+	if (n < 0)
+		return format_error(line, "Invalid contents.");
+
+	// Other files with the same hash will share these contents, so they
+	// must be what the hash says.
+	if (file->hash[0]) {
+		hash_init(&hs);
+		hash_update(&hs, blob, n);
+		hash_final(&hs, hash);
+		if (!STREQ(hash, file->hash))
+			return format_error(line, "Contents don't match hash.");
+	}
+
+	if (tm_file_path(file, path, sizeof(path)) >= sizeof(path)) {
+		err_status = ERR_LIBC;
+		errno = ENOBUFS;
+		return -1;
+	}
+
+	if (file->hash[0] && access(path, F_OK) == 0)
+		return 0;
+
+	// A path this transaction removed goes back to the file a rollback
+	// restores, as in place_item().
+	kept = drop_path(&pending_rms, path);
+	if (make_parent(path) < 0)
+		goto libc_error;
+
+	fp = fopen(path, "wb");
+	if (fp == NULL)
+		goto libc_error;
+
+	// Remember the copy in case the transaction rolls back.
+	if ((!kept && push_path(&pending_adds, path) < 0)
+	    || fwrite(blob, 1, n, fp) != (size_t) n) {
+		fclose(fp);
+		goto libc_error;
+	}
+
+	if (fclose(fp) != 0)
+		goto libc_error;
+
+	return 0;
+
+libc_error:
+	err_status = ERR_LIBC;
+	return -1;
+}
+
+// Add the file on one line of an export.
+static int import_line(char *line, long lineno)
+{
+	char *fields[5] = {0}, *tag = NULL, *end = NULL;
+	TMFile file = {0};
+	int nfields = 0;
+	long id;
+
+	for (char *p = line; p && nfields < 5; nfields++) {
+		fields[nfields] = p;
+		p = strchr(p, '\t');
+		if (p)
+			*p++ = '\0';
+	}
+
+	if (nfields < 4 || strchr(fields[nfields - 1], '\t'))
+		return format_error(lineno, "Expected 4 or 5 fields.");
+
+	errno = 0;
+	id = strtol(fields[0], &end, 10);
+	if (errno || *end || end == fields[0] || id < 1 || id > INT_MAX)
+		return format_error(lineno, "Invalid file id.");
+
+	// Hashes name stored files, so they're checked to be nothing else.
+	if (strlen(fields[2]) > HASH_MAX)
+		return format_error(lineno, "Invalid hash.");
+	for (char *p = fields[2]; *p; p++) {
+		if (!isxdigit((unsigned char) *p))
+			return format_error(lineno, "Invalid hash.");
+	}
+
+	if (unescape(fields[1]) < 0 || unescape(fields[3]) < 0)
+		return format_error(lineno, "Invalid escape.");
+
+	file.id = id;
+	file.title = fields[1];
+	file.title_len = strlen(fields[1]);
+	strcpy(file.hash, fields[2]);
+
+	if (tmdb_import_file(id, file.title, file.hash[0] ? file.hash : NULL)
+	    < 0) {
+		err_status = ERR_DATABASE;
+		return -1;
+	}
+
+	for (tag = strtok(fields[3], " "); tag; tag = strtok(NULL, " ")) {
+		if (!tmtag_is_valid(tag, 1))
+			return format_error(lineno, "Invalid tag.");
+
+		if (tmdb_add_tag(id, tag) < 0) {
+			err_status = ERR_DATABASE;
+			return -1;
+		}
+	}
+
+	if (nfields == 5 && fields[4][0])
+		return import_blob(&file, fields[4], lineno);
+
+	return 0;
+}
+
+int tm_import(FILE *fp)
+{
+	int own_transaction = !in_transaction;
+	char *line = NULL;
+	size_t cap = 0;
+	ssize_t len;
+	long lineno = 0;
+	int count = 0, status = 0;
+
+	if (own_transaction && tm_begin() < 0)
+		return -1;
+
+	if (tmdb_import_begin() < 0) {
+		err_status = ERR_DATABASE;
+		status = -1;
+	}
+
+	while (status == 0 && (len = getline(&line, &cap, fp)) > 0) {
+		lineno++;
+		if (line[len - 1] == '\n')
+			line[--len] = '\0';
+
+		// Skip blank lines and comments.
+		if (len == 0 || line[0] == '#')
+			continue;
+
+		if (import_line(line, lineno) < 0)
+			status = -1;
+		else
+			count++;
+	}
+
+	if (status == 0 && ferror(fp)) {
+		err_status = ERR_LIBC;
+		status = -1;
+	}
+
+	if (tmdb_import_end(status == 0) < 0 && status == 0) {
+		err_status = ERR_DATABASE;
+		status = -1;
+	}
+
+	if (own_transaction) {
+		if (status == 0) {
+			status = tm_commit();
+		} else {
+			int saved_errno = errno;
+			tm_rollback();
+			errno = saved_errno;
+		}
+	}
+
+	free(line);
+	return status < 0 ? -1 : count;
+}
@@ -2,16 +2,128 @@
 #define LIBTAGMAGE_H
 
 #include "core.h"
+#include "database.h" // file_callback
+#include "stats.h" // TMStat
+#include "tags.h" // TagVector
+#include <stdio.h> // FILE
 #include <unistd.h> // size_t
 
+// Fill `opts` with the default connection tuning, overridden by the
+// TAGMAGE_JOURNAL_MODE, TAGMAGE_SYNCHRONOUS, TAGMAGE_MMAP_SIZE,
+// TAGMAGE_CACHE_SIZE and TAGMAGE_BUSY_TIMEOUT environment variables.
+void tm_default_options(TMOptions *opts);
+
+// tm_init() is tm_init_opts() with the default options.
 int tm_init(const char *path);
+int tm_init_opts(const char *path, const TMOptions *opts);
 const char *tm_get_error();
 
+// Find the store as tm_init() would, without opening it, so tm_path() can
+// be used beforehand.
+int tm_locate(const char *path);
+
+// Read the store's settings again if another process changed them since.
+// Programs that keep the store open call this before each request.
+int tm_refresh();
+
 const char *tm_path();
 size_t tm_file_path(const TMFile *file, char *dst, size_t n);
 
+// Copy a file passed to a callback, title and all, so it outlives the
+// callback. Free the copy with free(). Returns NULL if out of memory.
+TMFile *tm_copy_file(const TMFile *file);
+
+// Directory layouts of the store. Flat stores keep every file directly in
+// tm_path(). Sharded stores fan them out over two levels of directories,
+// as shard/<id & 0xff>/<(id >> 8) & 0xff>/<id> in hex, and
+// blob/<hash[0:2]>/<hash[2:4]>/<hash> for deduplicated files.
+enum { TM_LAYOUT_FLAT, TM_LAYOUT_SHARDED };
+
+int tm_layout();
+
+// Build the tag index in the store, which answers tm_get_files(). Later
+// changes to files and tags are caught up with in memory, or the index is
+// rebuilt once it falls too far behind them.
+int tm_index();
+
+// List every file passing `filters` like tmtag_get_files(), from the tag
+// index if it's up to date, or from the database otherwise.
+int tm_get_files(const TagVector *filters, file_callback callback, void *arg);
+
+// List one page of the files passing `filters`, like tmtag_get_page(). If
+// the page is sorted by title and its `after_title` is NULL, the title of
+// the file it follows is looked up.
+int tm_get_page(const TagVector *filters, const TMPage *page,
+                file_callback callback, void *arg);
+
+// Move every stored file into a new layout. Readers may keep using the
+// store meanwhile; writers wait until the files are in place.
+int tm_set_layout(int layout);
+
+// Group every following change into one transaction. Files added to the
+// store are removed again if it rolls back, and removed files are only
+// deleted once it commits.
+int tm_begin();
+int tm_commit();
+int tm_rollback();
+int tm_in_transaction();
+
+// How tm_add_file_mode() puts a file into the store. Links and moves are
+// O(1) when the file is on the same filesystem as the store, and fall
+// back to a copy otherwise. A linked file shares its contents with the
+// original, so editing one edits both. A moved file's original is removed
+// once the add commits.
+//
+// TM_ADD_DEDUP may be or'ed into any of them to store the file by its
+// content hash, and skip storing it entirely if another file has the same
+// contents. Removing a file only removes its contents with the last file
+// that shares them.
+typedef enum {
+	TM_ADD_COPY = 0,
+	TM_ADD_LINK = 1,
+	TM_ADD_MOVE = 2,
+	TM_ADD_DEDUP = 1 << 2
+} TMAddMode;
+
 int tm_add_file(const char *path, TMFile *file);
+int tm_add_file_mode(const char *path, TMFile *file, TMAddMode mode);
+
+// Add `n` files, copying up to `jobs` of them at once while this thread
+// records each finished file in the database. `callback` is called with
+// every added file in the order of `paths`. The import runs in one
+// transaction unless the caller already opened one.
+int tm_add_files(const char **paths, int n, TMAddMode mode, int jobs,
+                 file_callback callback, void *arg);
 int tm_rm_file(const TMFile *file);
 
+// Write every file in the store to `fp`, one per line, as its id, title,
+// hash and space-separated tags, each separated by a tab, with
+// backslashes, tabs and line breaks in them escaped. If `blobs` is
+// truthy, each line also ends with the file's contents in base64.
+int tm_export(FILE *fp, int blobs);
+
+// Add every file in an export read from `fp`, keeping its id, and store
+// the contents of any line that has them. The secondary indexes and the
+// triggers that count and log new rows are dropped meanwhile, and rebuilt
+// once at the end, so the import runs in one transaction, or a savepoint
+// in the caller's. A failed import is undone as a whole, and leaves the
+// caller's transaction as it was. Returns the number of files added.
+int tm_import(FILE *fp);
+
+// Instrumentation, off by default. While on, every SQL statement, file
+// copy, link and removal, and the listings, imports and index builds above
+// record their calls, latencies, rows and bytes; see stats.h. Statements
+// are named "sql.*", filesystem work "fs.*", and the rest after their
+// function.
+void tm_stats_enable(int on);
+void tm_stats_reset();
+
+// Call `callback` with every stat recorded since the last reset, most time
+// spent first.
+int tm_get_stats(stat_callback callback, void *arg);
+
+// Write every stat to `fp` as a table, or as JSON if `json` is truthy.
+int tm_print_stats(FILE *fp, int json);
+
 
 #endif // LIBTAGMAGE_H
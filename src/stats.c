@@ -0,0 +1,245 @@
+#define _POSIX_C_SOURCE 200809L // clock_gettime
+
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "stats.h"
+#include "util.h"
+
+int tmstat_on = 0;
+
+static TMStat stats[TMSTAT_MAX];
+static int nstats = 0;
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+
+// Bucket of a latency in nanoseconds. Below 4ns each bucket is one
+// nanosecond; past that, a power of two's four buckets split it by the
+// two bits below its highest.
+static int bucket_of(uint64_t ns)
+{
+	int exp = 0;
+
+	if (ns < 4)
+		return ns;
+
+	for (uint64_t v = ns; v > 1; v >>= 1)
+		exp++;
+
+	if (exp > TMSTAT_BUCKETS / 4)
+		return TMSTAT_BUCKETS - 1;
+	return 4 * (exp - 1) + ((ns >> (exp - 2)) & 3);
+}
+
+// Smallest latency in nanoseconds that falls in the bucket.
+static uint64_t bucket_floor(int bucket)
+{
+	if (bucket < 4)
+		return bucket;
+	return (uint64_t) (4 + bucket % 4) << (bucket / 4 - 1);
+}
+
+// Largest latency in nanoseconds that falls in the bucket.
+static uint64_t bucket_ceil(int bucket)
+{
+	if (bucket < 4)
+		return bucket;
+	return bucket_floor(bucket + 1) - 1;
+}
+
+// Find the named stat, or add it. Returns NULL once the table is full.
+static TMStat *find_stat(const char *name)
+{
+	for (int i = 0; i < nstats; i++) {
+		if (STREQ(stats[i].name, name))
+			return &stats[i];
+	}
+
+	if (nstats == TMSTAT_MAX)
+		return NULL;
+
+	memset(&stats[nstats], 0, sizeof(stats[nstats]));
+	strncpy(stats[nstats].name, name, TMSTAT_NAME_MAX - 1);
+	return &stats[nstats++];
+}
+
+void tmstat_enable(int on)
+{
+	tmstat_on = on;
+}
+
+void tmstat_reset()
+{
+	pthread_mutex_lock(&lock);
+	nstats = 0;
+	pthread_mutex_unlock(&lock);
+}
+
+double tmstat_now()
+{
+	struct timespec ts;
+
+	if (!tmstat_on)
+		return 0;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+void tmstat_record(const char *name, double seconds, const TMStat *delta)
+{
+	TMStat *stat = NULL;
+
+	if (!tmstat_on)
+		return;
+
+	if (seconds < 0)
+		seconds = 0;
+
+	pthread_mutex_lock(&lock);
+
+	stat = find_stat(name);
+	if (stat) {
+		if (stat->calls == 0 || seconds < stat->min)
+			stat->min = seconds;
+		if (seconds > stat->max)
+			stat->max = seconds;
+		stat->calls++;
+		stat->seconds += seconds;
+		stat->buckets[bucket_of(seconds * 1e9)]++;
+
+		if (delta) {
+			stat->rows += delta->rows;
+			stat->scanned += delta->scanned;
+			stat->sorts += delta->sorts;
+			stat->vm_steps += delta->vm_steps;
+			stat->bytes += delta->bytes;
+		}
+	}
+
+	pthread_mutex_unlock(&lock);
+}
+
+double tmstat_percentile(const TMStat *stat, double p)
+{
+	long long rank = (long long) (p / 100 * stat->calls + 0.5);
+	long long seen = 0;
+	double ns = 0;
+
+	if (rank < 1)
+		rank = 1;
+
+	// Place the call of that rank within its bucket, as if the calls in
+	// it were spread evenly across it.
+	for (int i = 0; i < TMSTAT_BUCKETS; i++) {
+		long long n = stat->buckets[i];
+
+		if (n == 0 || seen + n < rank) {
+			seen += n;
+			continue;
+		}
+
+		ns = bucket_floor(i) + (bucket_ceil(i) - bucket_floor(i))
+		                       * (double) (rank - seen) / n;
+		break;
+	}
+
+	// The bucket may reach past every call that landed in it.
+	if (ns / 1e9 > stat->max)
+		return stat->max;
+	if (ns / 1e9 < stat->min)
+		return stat->min;
+	return ns / 1e9;
+}
+
+static int by_time(const void *a, const void *b)
+{
+	const TMStat *x = a, *y = b;
+
+	return (x->seconds < y->seconds) - (x->seconds > y->seconds);
+}
+
+int tmstat_each(stat_callback callback, void *arg)
+{
+	TMStat *copy = NULL;
+	int n;
+
+	// Hand out a sorted snapshot, so callbacks may record stats of
+	// their own.
+	pthread_mutex_lock(&lock);
+	n = nstats;
+	copy = malloc((n ? n : 1) * sizeof(*copy));
+	if (copy)
+		memcpy(copy, stats, n * sizeof(*copy));
+	pthread_mutex_unlock(&lock);
+
+	if (copy == NULL)
+		return -1;
+
+	qsort(copy, n, sizeof(*copy), &by_time);
+	for (int i = 0; i < n; i++) {
+		if (callback(&copy[i], arg))
+			break;
+	}
+
+	free(copy);
+	return 0;
+}
+
+typedef struct PrintState {
+	FILE *fp;
+	int json;
+	int count;
+} PrintState;
+
+static int print_stat(const TMStat *stat, void *arg)
+{
+	PrintState *state = arg;
+
+	if (state->json) {
+		fprintf(state->fp,
+		        "%s\n    {\"name\": \"%s\", \"calls\": %lld,"
+		        " \"seconds\": %.6f, \"p50_us\": %.1f,"
+		        " \"p90_us\": %.1f, \"p99_us\": %.1f,"
+		        " \"rows\": %lld, \"scanned\": %lld, \"sorts\": %lld,"
+		        " \"vm_steps\": %lld, \"bytes\": %lld}",
+		        state->count ? "," : "", stat->name, stat->calls,
+		        stat->seconds, tmstat_percentile(stat, 50) * 1e6,
+		        tmstat_percentile(stat, 90) * 1e6,
+		        tmstat_percentile(stat, 99) * 1e6, stat->rows,
+		        stat->scanned, stat->sorts, stat->vm_steps, stat->bytes);
+	} else {
+		fprintf(state->fp,
+		        "%-28s %7lld %10.3f %9.1f %9.1f %9.1f %9lld %9lld %11lld\n",
+		        stat->name, stat->calls, stat->seconds * 1e3,
+		        tmstat_percentile(stat, 50) * 1e6,
+		        tmstat_percentile(stat, 90) * 1e6,
+		        tmstat_percentile(stat, 99) * 1e6, stat->rows,
+		        stat->scanned, stat->bytes);
+	}
+
+	state->count++;
+	return 0;
+}
+
+int tmstat_print(FILE *fp, int json)
+{
+	PrintState state = {fp, json, 0};
+
+	if (json)
+		fprintf(fp, "{\"stats\": [");
+	else
+		fprintf(fp, "%-28s %7s %10s %9s %9s %9s %9s %9s %11s\n",
+		        "stat", "calls", "total_ms", "p50_us", "p90_us",
+		        "p99_us", "rows", "scanned", "bytes");
+
+	if (tmstat_each(&print_stat, &state) < 0)
+		return -1;
+
+	if (json)
+		fprintf(fp, "%s]}\n", state.count ? "\n" : "");
+	return 0;
+}
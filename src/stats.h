@@ -0,0 +1,81 @@
+#ifndef STATS_H
+#define STATS_H
+
+#include <stdio.h>
+
+/*
+ * stats.h -- tagmage instrumentation. Timed operations, such as each
+ * cached SQL statement or each file copy, add up their calls, latencies,
+ * rows and bytes under a name. Nothing is recorded until stats are turned
+ * on, and while they're off each hook costs a single test of tmstat_on.
+ *
+ * Recording is safe from any thread.
+ */
+
+#define TMSTAT_NAME_MAX 48
+#define TMSTAT_MAX 64
+
+// Latencies are kept in a histogram of nanoseconds with four buckets per
+// power of two, so percentiles are accurate to within 25%, up to about
+// half an hour. They never fall outside the shortest and longest call.
+#define TMSTAT_BUCKETS (4 * 40)
+
+typedef struct TMStat {
+	char name[TMSTAT_NAME_MAX];
+	long long calls;
+	double seconds; // Total time spent in all calls.
+	double min, max; // Shortest and longest call, in seconds.
+	long long rows; // Rows returned, or items handled.
+	long long scanned; // Rows stepped through in full table scans.
+	long long sorts; // Sorts SQLite ran, including for automatic indexes.
+	long long vm_steps; // SQLite virtual machine instructions run.
+	long long bytes; // Bytes copied.
+	long long buckets[TMSTAT_BUCKETS];
+} TMStat;
+
+typedef int (*stat_callback)(const TMStat *stat, void *arg);
+
+// Whether stats are being recorded. Hooks test this before anything else.
+extern int tmstat_on;
+
+/**
+ * tmstat_enable() - Start recording stats if `on` is truthy, or stop.
+ */
+void tmstat_enable(int on);
+
+/**
+ * tmstat_reset() - Forget every stat recorded so far.
+ */
+void tmstat_reset();
+
+/**
+ * tmstat_now() - Return a monotonic time in seconds to time calls with,
+ * or 0 while stats are off.
+ */
+double tmstat_now();
+
+/**
+ * tmstat_record() - Count one call to `name` that took `seconds`, adding
+ * up the counters in `delta`, if any. Does nothing while stats are off.
+ */
+void tmstat_record(const char *name, double seconds, const TMStat *delta);
+
+/**
+ * tmstat_percentile() - Return the latency in seconds that `p` percent of
+ * the stat's calls took at most.
+ */
+double tmstat_percentile(const TMStat *stat, double p);
+
+/**
+ * tmstat_each() - Call `callback` with a copy of every stat, in order of
+ * total time, most first. Stops early if `callback` returns nonzero.
+ */
+int tmstat_each(stat_callback callback, void *arg);
+
+/**
+ * tmstat_print() - Write every stat to `fp` as a table, or as JSON if
+ * `json` is truthy.
+ */
+int tmstat_print(FILE *fp, int json);
+
+#endif // STATS_H
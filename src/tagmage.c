@@ -1,23 +1,59 @@
 #include <err.h>
 #include <errno.h>
+#include <setjmp.h>
+#include <stdarg.h>
 #include <stdio.h>
 #include <limits.h>
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h> // sysconf
 
 #include "core.h"
 #include "database.h"
 #include "util.h"
 #include "tags.h"
+#include "daemon.h"
 #include "libtagmage.h"
+#include "view.h"
 
 #define TAGMAGE_ASSERT(EXPR)				\
 	if ((EXPR) < 0)					\
-		errx(1, "%s", tmdb_get_error());
+		die("%s", tmdb_get_error());
 
 #define INCOPT()							\
 	if (++optind >= argc)						\
-		errx(1, "Missing operand after '%s'.", argv[optind-1])
+		die("Missing operand after '%s'.", argv[optind-1])
+
+// Number of items per transaction in multi-item commands, or 0 to apply
+// the whole command in one transaction.
+static long batch_size = 0;
+static long batch_count = 0;
+
+// Whether to report stats once the command is done, and how.
+static enum { STATS_OFF, STATS_TEXT, STATS_JSON } show_stats = STATS_OFF;
+
+// While serving a daemon request, errors end the request instead of the
+// whole daemon.
+static jmp_buf *request_jmp = NULL;
+
+// Exit with `status`, or end the daemon request with it.
+static void finish(int status)
+{
+	if (request_jmp)
+		longjmp(*request_jmp, status | 0x100);
+	exit(status);
+}
+
+// Like errx(1, ...), but daemon-safe.
+static void die(const char *fmt, ...)
+{
+	va_list ap;
+
+	va_start(ap, fmt);
+	vwarnx(fmt, ap);
+	va_end(ap);
+	finish(1);
+}
 
 static int estrtoid(const char *str)
 {
@@ -26,74 +62,247 @@ static int estrtoid(const char *str)
 	errno = 0;
 	id = (int) strtol(str, NULL, 0);
 	if (errno) {
-		err(1, "Failed to convert to id: '%s'", str);
+		die("Failed to convert to id: '%s': %s", str, strerror(errno));
 	} else if (id < 1 || id > INT_MAX) {
 		errno = ERANGE;
-		err(1, "Failed to convert to id: '%s'", str);
+		die("Failed to convert to id: '%s': %s", str, strerror(errno));
 	}
 
 	return (int) id;
 }
 
+static void batch_begin()
+{
+	if (tm_begin() < 0)
+		die("tm_begin: %s", tm_get_error());
+	batch_count = 0;
+}
+
+// Count one finished item, and commit the batch once it's full. Returns -1
+// after warning on error.
+static int try_batch_step()
+{
+	if (batch_size <= 0 || ++batch_count < batch_size)
+		return 0;
+
+	if (tm_commit() < 0 || tm_begin() < 0) {
+		warnx("%s", tm_get_error());
+		return -1;
+	}
+
+	batch_count = 0;
+	return 0;
+}
+
+static void batch_step()
+{
+	if (try_batch_step() < 0)
+		finish(1);
+}
+
+static void batch_end()
+{
+	if (tm_commit() < 0)
+		die("tm_commit: %s", tm_get_error());
+}
+
+// Discard the current batch if the program exits halfway through it.
+static void batch_abort()
+{
+	if (tm_in_transaction())
+		tm_rollback();
+}
+
 static void print_usage(int status)
 {
 	fprintf(status ? stderr : stdout,
-                "Usage: tagmage [ -f PATH ] COMMAND [ ... ]\n"
+                "Usage: tagmage [ -f PATH ] [ --stats ] COMMAND [ ... ]\n"
                 "\n"
                 "  -f SAVE  - Set custom save directory.\n"
+                "  -b SIZE  - Commit multi-item commands every SIZE items.\n"
+                "  --stats[=json]\n"
+                "           - Report where the command spent its time.\n"
                 "\n"
-                "  add [-t TAG1 TAG2 ... +] FILES..\n"
+                "  add [-d] [-l | -m] [-j JOBS] [-t TAG1 TAG2 ... +] FILES..\n"
                 "  edit FILE TITLE\n"
-                "  list [TAGS..]\n"
+                "  list [-p] [--limit N] [--after FILE] [--sort id | title]\n"
+                "       [TAGS..]\n"
+                "  search [-p] [--limit N] TERMS [TAGS..]\n"
                 "  tag FILE [TAGS..]\n"
+                "  tag --ids - | --query EXPR [TAGS..]\n"
                 "  untag FILE [TAGS..]\n"
-                "  tags FILE\n"
-                "  path [FILES..]\n"
+                "  untag --ids - | --query EXPR [TAGS..]\n"
+                "  tags [--count] [FILE]\n"
+                "  tags --cooccur TAG\n"
+                "  path [FILES.. | -]\n"
                 "  rm FILES..\n"
+                "  gc\n"
+                "  layout [flat | sharded]\n"
+                "  index\n"
+                "  daemon\n"
+                "  view [-t] [-r] [-j JOBS] DIR [TAGS..]\n"
+                "  export [--blobs]\n"
+                "  import [FILE | -]\n"
                 "\n"
                 "Visit `man 1 tagmage` for more details.\n");
 
-	exit(status);
+	finish(status);
 }
 
-static int print_tag(const char *tag)
+static int print_tag(const char *tag, size_t len)
 {
-	printf("%s\n", tag);
+	fwrite(tag, 1, len, stdout);
+	putchar('\n');
 	return 0;
 }
 
-static int print_file_filtered(const TMFile *file, void *vecptr)
+static int print_file(const TMFile *file, void *arg)
 {
-	TagVector *tagvec = vecptr;
-	int has_tags = tmtag_file_has_tags(file, tagvec);
+	UNUSED(arg);
+	printf("%i %s\n", file->id, file->title);
+	return 0;
+}
 
-	if (has_tags < 0)
-		errx(1, "%s", tmtag_get_err());
-	else if (has_tags)
-		printf("%i %s\n", file->id, file->title);
+static void print_stored_path(const TMFile *file)
+{
+	char path_buf[PATH_MAX + 1] = {0};
 
+	if (tm_file_path(file, path_buf, sizeof(path_buf)) >= sizeof(path_buf)) {
+		errno = ENOBUFS;
+		die("tm_file_path: %s", strerror(errno));
+	}
+	fputs(path_buf, stdout);
+}
+
+// Print a file with its path, tab-separated, since paths may have spaces.
+static int print_file_path(const TMFile *file, void *arg)
+{
+	UNUSED(arg);
+	printf("%i\t", file->id);
+	print_stored_path(file);
+	printf("\t%s\n", file->title);
 	return 0;
 }
 
+// Sanity check on the query before starting.
+static void check_query(const TagVector *args)
+{
+	TagQuery *query = tmtag_parse(args);
+
+	if (query == NULL)
+		die("%s", tmtag_get_err());
+	tmtag_free_query(query);
+}
+
 static void list_files(int argc, char **argv)
 {
-	// All remaining arguments should be tags.
-	TagVector args = {.size = argc - 1, .tags = argv + 1};
+	file_callback print = &print_file;
+	TMPage page = {TM_SORT_ID, 0, 0, NULL};
+	int optind;
 
-	// Sanity check on all the tags before starting.
-	for (int i = 1; i < argc; i++) {
-		if (!tmtag_is_valid(argv[i], 0))
-			errx(1, "Invalid tag '%s'.", argv[i]);
+	for (optind = 1; optind < argc; optind++) {
+		const char *opt = argv[optind];
+
+		// Non-option reached
+		if (opt[0] != '-')
+			break;
+
+		if (STREQ(opt, "--")) {
+			// --  option breaker
+			optind++;
+			break;
+		} else if (STREQ(opt, "-p")) {
+			// -p  print each file's path as well
+			print = &print_file_path;
+		} else if (STREQ(opt, "--limit")) {
+			// --limit N  list at most N files
+			INCOPT();
+			page.limit = estrtoid(argv[optind]);
+		} else if (STREQ(opt, "--after")) {
+			// --after FILE  start after FILE in the sort order
+			INCOPT();
+			page.after = estrtoid(argv[optind]);
+		} else if (STREQ(opt, "--sort")) {
+			// --sort id|title  order to list files in
+			INCOPT();
+			if (STREQ(argv[optind], "id"))
+				page.sort = TM_SORT_ID;
+			else if (STREQ(argv[optind], "title"))
+				page.sort = TM_SORT_TITLE;
+			else
+				die("Unknown sort order '%s'.", argv[optind]);
+		} else {
+			die("Unexpected argument '%s'.", opt);
+		}
+	}
+
+	// All remaining arguments make up the query.
+	TagVector args = {.size = argc - optind, .tags = argv + optind};
+
+	check_query(&args);
+
+	if (tm_get_page(&args, &page, print, NULL) < 0)
+		die("%s", tm_get_error());
+}
+
+static void search_files(int argc, char **argv)
+{
+	file_callback print = &print_file;
+	int limit = 0;
+	int optind;
+
+	for (optind = 1; optind < argc; optind++) {
+		const char *opt = argv[optind];
+
+		// Non-option reached
+		if (opt[0] != '-')
+			break;
+
+		if (STREQ(opt, "--")) {
+			// --  option breaker
+			optind++;
+			break;
+		} else if (STREQ(opt, "-p")) {
+			// -p  print each file's path as well
+			print = &print_file_path;
+		} else if (STREQ(opt, "--limit")) {
+			// --limit N  list at most N files
+			INCOPT();
+			limit = estrtoid(argv[optind]);
+		} else {
+			die("Unexpected argument '%s'.", opt);
+		}
 	}
 
-	TAGMAGE_ASSERT(tmdb_get_files(&print_file_filtered, &args));
+	if (optind == argc)
+		die("Missing the terms to search for.");
+
+	// The terms are one argument, and the rest make up the query.
+	TagVector args = {.size = argc - optind - 1,
+	                  .tags = argv + optind + 1};
+
+	check_query(&args);
+
+	if (tmtag_search(argv[optind], &args, limit, print, NULL) < 0)
+		die("%s", tmtag_get_err());
+}
+
+static int print_path_line(const TMFile *file, void *arg)
+{
+	UNUSED(arg);
+	print_stored_path(file);
+	putchar('\n');
+	return 0;
+}
+
+static void print_id_path(const char *id)
+{
+	TAGMAGE_ASSERT(tmdb_get_file(estrtoid(id), &print_path_line, NULL));
 }
 
 static void print_path(int argc, char **argv)
 {
-	TMFile img;
-	int item_id = 0;
-	char path_buf[PATH_MAX + 1] = {0};
+	char id_buf[32];
 
 	if (argc == 1) {
 		// print Database path if no file id provided
@@ -101,24 +310,100 @@ static void print_path(int argc, char **argv)
 		return;
 	}
 
-	// Each subsequent argument is an file id
+	// Each subsequent argument is an file id, or '-' to read ids from
+	// standard input.
 	for (int i = 1; i < argc; i++) {
-		size_t size;
+		if (!STREQ(argv[i], "-")) {
+			print_id_path(argv[i]);
+			continue;
+		}
+
+		while (scanf("%31s", id_buf) == 1)
+			print_id_path(id_buf);
+	}
+}
+
+// Ids of the files a bulk change applies to, or of added files.
+typedef struct IdList {
+	int *ids;
+	int size, cap;
+} IdList;
+
+static int push_id(IdList *list, int id)
+{
+	if (list->size == list->cap) {
+		int cap = list->cap ? list->cap * 2 : 256;
+		int *ids = realloc(list->ids, cap * sizeof(*ids));
+
+		if (ids == NULL)
+			return -1;
+		list->ids = ids;
+		list->cap = cap;
+	}
 
-		item_id = estrtoid(argv[i]);
-		TAGMAGE_ASSERT(tmdb_get_file(item_id, &img));
+	list->ids[list->size++] = id;
+	return 0;
+}
 
-		size = tm_file_path(&img, path_buf, sizeof(path_buf));
-		if (size >= sizeof(path_buf)) {
-			errno = ENOBUFS;
-			err(1, "tm_file_path: %s", tm_get_error());
+// Print and forget every id in the list.
+static void print_ids(IdList *list)
+{
+	for (int i = 0; i < list->size; i++)
+		printf("%i\n", list->ids[i]);
+
+	list->size = 0;
+}
+
+// Tags for every added file, and whether giving them failed. Errors stop
+// the import rather than exit, so tm_add_files() can clean up after itself.
+// Ids are only printed once the files they belong to are committed.
+typedef struct AddedTags {
+	char **tags;
+	const char **paths;
+	int count; // Files added so far, in order of paths.
+	IdList ids; // Files added since the last commit.
+	int failed;
+} AddedTags;
+
+// Remember the id of a newly added file and give it its tags.
+static int tag_added_file(const TMFile *file, void *arg)
+{
+	AddedTags *added = arg;
+	const char *path = added->paths[added->count++];
+
+	if (push_id(&added->ids, file->id) < 0) {
+		warn("%s", path);
+		added->failed = 1;
+		return 1;
+	}
+
+	// Add each tag to the new file.
+	if (added->tags) {
+		for(size_t ti = 0; !STREQ(added->tags[ti], "+"); ti++) {
+			if (tmdb_add_tag(file->id, added->tags[ti]) < 0) {
+				warnx("%s: %s", path, tmdb_get_error());
+				added->failed = 1;
+				return 1;
+			}
 		}
-		puts(path_buf);
 	}
+
+	if (try_batch_step() < 0) {
+		added->failed = 1;
+		return 1;
+	}
+
+	// The batch just committed, so its files are there to stay.
+	if (batch_size > 0 && batch_count == 0)
+		print_ids(&added->ids);
+
+	return 0;
 }
 
 static void add_file(int argc, char **argv)
 {
+	TMAddMode mode = TM_ADD_COPY, dedup = 0;
+	long jobs = sysconf(_SC_NPROCESSORS_ONLN);
 	char **tags = NULL;
 	int optind;
 
@@ -128,7 +413,7 @@ static void add_file(int argc, char **argv)
 			goto optbreak;
 
 		if (argv[optind][0] == '\0')
-			errx(1, "Unexpected empty argument after '%s'.",
+			die("Unexpected empty argument after '%s'.",
                                 argv[optind-1]);
 
 		switch (argv[optind][1]) {
@@ -142,7 +427,7 @@ static void add_file(int argc, char **argv)
 
 			// The '-t' flag can only be used once:
 			if (tags != NULL)
-				errx(1, "The -t flag can only be used once.");
+				die("The -t flag can only be used once.");
 
 			// Point to first tag in list.
 			tags = argv + optind;
@@ -151,38 +436,57 @@ static void add_file(int argc, char **argv)
 			while (!STREQ(argv[optind], "+")) {
 				if (!tmtag_is_valid(argv[optind], 1)) {
 					// The tag is invalid.
-					errx(1, "Invalid tag '%s'.",
+					die("Invalid tag '%s'.",
                                                 argv[optind]);
 				}
 				INCOPT();
 			}
 			break;
+		case 'l':
+			// -l  hard-link instead of copying
+			mode = TM_ADD_LINK;
+			break;
+		case 'm':
+			// -m  move instead of copying
+			mode = TM_ADD_MOVE;
+			break;
+		case 'd':
+			// -d  deduplicate by contents
+			dedup = TM_ADD_DEDUP;
+			break;
+		case 'j':
+			// -j JOBS  number of files to copy at once
+			INCOPT();
+			jobs = estrtoid(argv[optind]);
+			break;
 		default:
-			errx(1, "Unexpected argument '%s'.", argv[optind]);
+			die("Unexpected argument '%s'.", argv[optind]);
 		}
 	}
 optbreak:
 
 	// Expect at least one file.
 	if (optind == argc)
-		errx(1, "Missing file operand.");
-
-	for (int i = optind; i < argc; i++) {
-		// Add file to database.
-		TMFile file;
-		if (tm_add_file(argv[i], &file) < 0)
-			err(1, "tm_add_file: %s", tm_get_error());
+		die("Missing file operand.");
 
-		// Print ID of new file.
-		printf("%i\n", file.id);
+	const char **paths = (const char **) argv + optind;
+	AddedTags added = {.tags = tags, .paths = paths};
 
-		// Add each tag to the new file.
-		if (tags) {
-			for(size_t ti = 0; !STREQ(tags[ti], "+"); ti++) {
-				TAGMAGE_ASSERT(tmdb_add_tag(file.id, tags[ti]));
-			}
-		}
+	batch_begin();
+	if (tm_add_files(paths, argc - optind, mode | dedup, jobs,
+                         &tag_added_file, &added) < 0) {
+		// Files are added in order, so the next one is the culprit.
+		free(added.ids.ids);
+		die("%s: %s", paths[added.count], tm_get_error());
 	}
+	if (added.failed) {
+		free(added.ids.ids);
+		finish(1);
+	}
+	batch_end();
+
+	print_ids(&added.ids);
+	free(added.ids.ids);
 }
 
 static void rm_file(int argc, char **argv)
@@ -192,13 +496,16 @@ static void rm_file(int argc, char **argv)
 		print_usage(1);
 	}
 
+	batch_begin();
 	for (int i = 1; i < argc; i++) {
 		TMFile file;
 		file.id = estrtoid(argv[i]);
 
 		if (tm_rm_file(&file) < 0)
-			err(1, "tm_rm_file: %s", tm_get_error());
+			die("tm_rm_file: %s", tm_get_error());
+		batch_step();
 	}
+	batch_end();
 }
 
 static void edit_file(int argc, char **argv)
@@ -215,22 +522,108 @@ static void edit_file(int argc, char **argv)
 	TAGMAGE_ASSERT(tmdb_edit_title(id, argv[2]));
 }
 
+static int collect_id(const TMFile *file, void *arg)
+{
+	return push_id(arg, file->id) < 0;
+}
+
+// Change the tags of every file given by `--ids -` or `--query EXPR`
+// at once, after reading all of them. Each batch of files is one
+// statement.
+static void tag_many(int argc, char **argv, int untag)
+{
+	IdList files = {0};
+	char id_buf[32];
+	long chunk;
+
+	if (argc < 3)
+		die("Missing operand after '%s'.", argv[1]);
+
+	if (STREQ(argv[1], "--ids")) {
+		if (!STREQ(argv[2], "-"))
+			die("Expected '-' after '--ids'.");
+
+		while (scanf("%31s", id_buf) == 1) {
+			char *end = NULL;
+			long id;
+
+			errno = 0;
+			id = strtol(id_buf, &end, 0);
+			if (errno || *end || id < 1 || id > INT_MAX) {
+				free(files.ids);
+				die("Invalid file id '%s'.", id_buf);
+			}
+
+			if (push_id(&files, id) < 0) {
+				free(files.ids);
+				die("Out of memory.");
+			}
+		}
+	} else {
+		TagVector filters = {.size = 1, .tags = &argv[2]};
+
+		check_query(&filters);
+		if (tm_get_files(&filters, &collect_id, &files) < 0) {
+			free(files.ids);
+			die("tm_get_files: %s", tm_get_error());
+		}
+	}
+
+	for (int i = 3; !untag && i < argc; i++) {
+		if (!tmtag_is_valid(argv[i], 1)) {
+			free(files.ids);
+			die("Invalid tag '%s'.", argv[i]);
+		}
+	}
+
+	chunk = batch_size > 0 ? batch_size : files.size;
+	batch_begin();
+	for (int i = 0; i < files.size; i += chunk) {
+		int n = MIN(chunk, files.size - i);
+		const char **tags = (const char**) argv + 3;
+		int status = untag
+			? tmdb_untag_files(files.ids + i, n, tags, argc - 3)
+			: tmdb_tag_files(files.ids + i, n, tags, argc - 3);
+
+		if (status < 0) {
+			free(files.ids);
+			die("%s", tmdb_get_error());
+		}
+
+		if (i + chunk < files.size) {
+			batch_end();
+			batch_begin();
+		}
+	}
+	batch_end();
+
+	free(files.ids);
+}
+
 static void tag_file(int argc, char **argv)
 {
 	int file_id = 0;
 
 	if (argc == 1)
-		errx(1, "Missing file after '%s'.", argv[0]);
+		die("Missing file after '%s'.", argv[0]);
+
+	if (STREQ(argv[1], "--ids") || STREQ(argv[1], "--query")) {
+		tag_many(argc, argv, 0);
+		return;
+	}
 
 	file_id = estrtoid(argv[1]);
 
+	batch_begin();
 	for (int i = 2; i < argc; i++) {
 		if (tmtag_is_valid(argv[i], 1)) {
 			TAGMAGE_ASSERT(tmdb_add_tag(file_id, argv[i]));
 		} else {
-			errx(1, "Invalid tag '%s'.", argv[i]);
+			die("Invalid tag '%s'.", argv[i]);
 		}
+		batch_step();
 	}
+	batch_end();
 }
 
 static void untag_file(int argc, char **argv)
@@ -238,33 +631,188 @@ static void untag_file(int argc, char **argv)
 	int file_id = 0;
 
 	if (argc == 1)
-		errx(1, "Missing file after '%s'.", argv[0]);
+		die("Missing file after '%s'.", argv[0]);
+
+	if (STREQ(argv[1], "--ids") || STREQ(argv[1], "--query")) {
+		tag_many(argc, argv, 1);
+		return;
+	}
 
 	file_id = estrtoid(argv[1]);
 
+	batch_begin();
 	for (int i = 2; i < argc; i++) {
 		TAGMAGE_ASSERT(tmdb_remove_tag(file_id, argv[i]));
+		batch_step();
 	}
+	batch_end();
 }
 
-static void list_tags(int argc, char **argv)
+static void set_layout(int argc, char **argv)
 {
-	int file_id = 0;
+	static const char *layouts[] = {
+		[TM_LAYOUT_FLAT] = "flat",
+		[TM_LAYOUT_SHARDED] = "sharded"
+	};
 
 	if (argc == 1) {
-		TAGMAGE_ASSERT(tmdb_get_tags(&print_tag));
+		printf("%s\n", layouts[tm_layout()]);
 		return;
 	}
 
-	file_id = estrtoid(argv[1]);
+	for (size_t i = 0; i < LEN(layouts); i++) {
+		if (STREQ(argv[1], layouts[i])) {
+			if (tm_set_layout(i) < 0)
+				die("tm_set_layout: %s", tm_get_error());
+			return;
+		}
+	}
 
-	TAGMAGE_ASSERT(tmdb_get_tags_by_file(file_id, &print_tag));
+	die("Unknown layout '%s'.", argv[1]);
 }
 
-int main(int argc, char **argv)
+static void build_view(int argc, char **argv)
+{
+	long jobs = sysconf(_SC_NPROCESSORS_ONLN);
+	int by_tag = 0, rebuild = 0;
+	int optind;
+
+	for (optind = 1; optind < argc; optind++) {
+		// Non-option reached
+		if (argv[optind][0] != '-')
+			goto optbreak;
+
+		switch (argv[optind][1]) {
+		case '-':
+			// --  option breaker
+			optind++;
+			goto optbreak;
+		case 't':
+			// -t  one directory per tag
+			by_tag = 1;
+			break;
+		case 'r':
+			// -r  rebuild from scratch
+			rebuild = 1;
+			break;
+		case 'j':
+			// -j JOBS  number of links to create at once
+			INCOPT();
+			jobs = estrtoid(argv[optind]);
+			break;
+		default:
+			die("Unexpected argument '%s'.", argv[optind]);
+		}
+	}
+optbreak:
+
+	if (optind == argc)
+		die("Missing directory operand.");
+
+	// All remaining arguments make up the query.
+	TagVector args = {.size = argc - optind - 1, .tags = argv + optind + 1};
+
+	check_query(&args);
+
+	if (tmview_build(argv[optind], &args, by_tag, jobs, rebuild) < 0)
+		die("tmview_build: %s", tmview_get_err());
+}
+
+static void export_files(int argc, char **argv)
+{
+	int blobs = 0;
+
+	for (int optind = 1; optind < argc; optind++) {
+		if (STREQ(argv[optind], "--blobs"))
+			// --blobs  include the files' contents
+			blobs = 1;
+		else
+			die("Unexpected argument '%s'.", argv[optind]);
+	}
+
+	if (tm_export(stdout, blobs) < 0)
+		die("tm_export: %s", tm_get_error());
+}
+
+static void import_files(int argc, char **argv)
+{
+	FILE *fp = stdin;
+	int count;
+
+	if (argc > 2)
+		die("Unexpected argument '%s'.", argv[2]);
+
+	if (argc == 2 && !STREQ(argv[1], "-")) {
+		fp = fopen(argv[1], "r");
+		if (fp == NULL)
+			die("%s: %s", argv[1], strerror(errno));
+	}
+
+	count = tm_import(fp);
+	if (fp != stdin)
+		fclose(fp);
+
+	if (count < 0)
+		die("tm_import: %s", tm_get_error());
+	printf("Imported %d files.\n", count);
+}
+
+static int print_tag_count(const char *tag, size_t len, long long count,
+                           void *arg)
+{
+	UNUSED(arg);
+	printf("%lld ", count);
+	return print_tag(tag, len);
+}
+
+static void list_tags(int argc, char **argv)
+{
+	const char *cooccur = NULL;
+	int count = 0, file_id = 0;
+	int optind;
+
+	for (optind = 1; optind < argc; optind++) {
+		const char *opt = argv[optind];
+
+		// Non-option reached
+		if (opt[0] != '-')
+			break;
+
+		if (STREQ(opt, "--count")) {
+			// --count  print how many files have each tag
+			count = 1;
+		} else if (STREQ(opt, "--cooccur")) {
+			// --cooccur TAG  count the tags of files with TAG
+			INCOPT();
+			cooccur = argv[optind];
+		} else {
+			die("Unexpected argument '%s'.", opt);
+		}
+	}
+
+	if (optind < argc)
+		file_id = estrtoid(argv[optind]);
+
+	if (cooccur) {
+		if (file_id)
+			die("--cooccur doesn't take a file.");
+		TAGMAGE_ASSERT(tmdb_get_cooccurring(cooccur, &print_tag_count,
+		                                    NULL));
+	} else if (count) {
+		TAGMAGE_ASSERT(tmdb_get_tag_counts(file_id, &print_tag_count,
+		                                   NULL));
+	} else if (file_id) {
+		TAGMAGE_ASSERT(tmdb_get_tags_by_file(file_id, &print_tag));
+	} else {
+		TAGMAGE_ASSERT(tmdb_get_tags(&print_tag));
+	}
+}
+
+// Parse the options before the command, and return the index of the
+// command.
+static int parse_options(int argc, char **argv, char **db_path)
 {
 	int optind = 0;
-	char *db_path = NULL;
 
 	for (optind = 1; optind < argc; optind++) {
 		// Non-option reached
@@ -273,43 +821,61 @@ int main(int argc, char **argv)
 			goto optbreak;
 
 		if (argv[optind][0] == '\0')
-			errx(1, "Unexpected empty argument after '%s'.", argv[optind-1]);
+			die("Unexpected empty argument after '%s'.", argv[optind-1]);
 
 		switch (argv[optind][1]) {
 		case '-':
+			// --stats[=FORMAT]  report stats
+			if (STREQ(argv[optind], "--stats")
+			    || STREQ(argv[optind], "--stats=text")) {
+				show_stats = STATS_TEXT;
+				break;
+			} else if (STREQ(argv[optind], "--stats=json")) {
+				show_stats = STATS_JSON;
+				break;
+			} else if (argv[optind][2] != '\0') {
+				die("Unexpected argument '%s'.", argv[optind]);
+			}
+
 			// --  option breaker
 			optind++;
 			goto optbreak;
 		case 'h':
 			// -h  help
 			print_usage(0);
-			return 0;
+			break;
 		case 'f':
 		// Set custom database directory
 		INCOPT(); // increase optind
-		db_path = argv[optind];
+		*db_path = argv[optind];
 		break;
+		case 'b':
+			// -b SIZE  transaction batch size
+			INCOPT();
+			batch_size = estrtoid(argv[optind]);
+			break;
 		default:
-			errx(1, "Unexpected argument '%s'.", argv[optind]);
+			die("Unexpected argument '%s'.", argv[optind]);
 			break;
 		}
 
 	}
  optbreak:
 
-	if (tm_init(db_path) < 0)
-		err(1, "tm_init: %s", tm_get_error());
-
-	// Shift argc, argv to subcommands
-	argc -= optind;
-	argv += optind;
+	return optind;
+}
 
+static void run_command(int argc, char **argv)
+{
 	// Sub-Commands
 	if (argc == 0 || STREQ(argv[0], "help")) {
 		print_usage(0);
 	} else if (STREQ(argv[0], "list")) {
 		list_files(argc, argv);
 
+	} else if (STREQ(argv[0], "search")) {
+		search_files(argc, argv);
+
 	} else if (STREQ(argv[0], "path")) {
 		print_path(argc, argv);
 
@@ -331,11 +897,133 @@ int main(int argc, char **argv)
 	} else if (STREQ(argv[0], "edit")) {
 		edit_file(argc, argv);
 
+	} else if (STREQ(argv[0], "gc")) {
+		TAGMAGE_ASSERT(tmdb_gc());
+
+	} else if (STREQ(argv[0], "layout")) {
+		set_layout(argc, argv);
+
+	} else if (STREQ(argv[0], "index")) {
+		if (tm_index() < 0)
+			die("tm_index: %s", tm_get_error());
+
+	} else if (STREQ(argv[0], "view")) {
+		build_view(argc, argv);
+
+	} else if (STREQ(argv[0], "export")) {
+		export_files(argc, argv);
+
+	} else if (STREQ(argv[0], "import")) {
+		import_files(argc, argv);
+
 	} else {
 		// Unknown command
 		warnx("Unknown command '%s'\n", argv[0]);
 		print_usage(1);
 	}
+}
+
+// Print the stats the command recorded to standard error, if asked to.
+static void report_stats(void)
+{
+	if (show_stats != STATS_OFF)
+		tm_print_stats(stderr, show_stats == STATS_JSON);
+}
+
+// Run a command sent to the daemon, with the same arguments as main().
+static int serve_request(int argc, char **argv)
+{
+	char *db_path = NULL;
+	jmp_buf jmp;
+	int status, optind;
+
+	batch_size = 0;
+	batch_count = 0;
+	show_stats = STATS_OFF;
+
+	status = setjmp(jmp);
+	if (status) {
+		// The request failed or exited early; drop whatever it left
+		// half done.
+		request_jmp = NULL;
+		batch_abort();
+		tmdb_reset();
+		report_stats();
+		tm_stats_enable(0);
+		return status & 0xff;
+	}
+	request_jmp = &jmp;
+
+	if (tm_refresh() < 0)
+		die("tm_refresh: %s", tm_get_error());
+
+	optind = parse_options(argc, argv, &db_path);
+	tm_stats_reset();
+	tm_stats_enable(show_stats != STATS_OFF);
+	run_command(argc - optind, argv + optind);
+
+	request_jmp = NULL;
+	report_stats();
+	tm_stats_enable(0);
+	return 0;
+}
+
+static void serve(void)
+{
+	char sock_path[PATH_MAX + 1];
+
+	if ((size_t) snprintf(sock_path, sizeof(sock_path), "%s/%s", tm_path(),
+                              TMD_SOCKET) >= sizeof(sock_path))
+		die("Store path is too long.");
+
+	if (tmd_serve(sock_path, &serve_request) < 0)
+		die("tmd_serve: %s", tmd_get_err());
+}
+
+// Hand the command to a running daemon if there is one, and exit with its
+// status. Returns if there's none.
+static void call_daemon(int argc, char **argv, const char *db_path)
+{
+	char sock_path[PATH_MAX + 1];
+	int status;
+
+	if (getenv("TAGMAGE_NO_DAEMON") || tm_locate(db_path) < 0)
+		return;
+
+	if ((size_t) snprintf(sock_path, sizeof(sock_path), "%s/%s", tm_path(),
+                              TMD_SOCKET) >= sizeof(sock_path))
+		return;
+
+	status = tmd_call(sock_path, argc, argv);
+	if (status >= 0)
+		exit(status);
+}
+
+int main(int argc, char **argv)
+{
+	char *db_path = NULL;
+	int optind = parse_options(argc, argv, &db_path);
+	int is_daemon = optind < argc && STREQ(argv[optind], "daemon");
+
+	if (!is_daemon)
+		call_daemon(argc, argv, db_path);
+
+	// Stats are reported last, after any rollback on the way out.
+	tm_stats_enable(show_stats != STATS_OFF && !is_daemon);
+	atexit(&report_stats);
+
+	if (tm_init(db_path) < 0)
+		die("tm_init: %s", tm_get_error());
+	atexit(&batch_abort);
+
+	// Shift argc, argv to subcommands
+	argc -= optind;
+	argv += optind;
+
+	if (is_daemon)
+		serve();
+	else
+		run_command(argc, argv);
 
 	// Close and clean up database before exiting.
 	TAGMAGE_ASSERT(tmdb_cleanup());
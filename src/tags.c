@@ -1,143 +1,785 @@
 #include <ctype.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 
 #include "database.h"
 #include "tags.h"
 #include "util.h"
 
-#define ERRCHECK(EXPR) ((EXPR) > 0 ? 1 : 0)
+// Selects yielding a set of file ids, combined by the query planner.
+#define SELECT_ALL "SELECT id FROM image"
+#define SELECT_TAGGED "SELECT image FROM image_tag"
+#define SELECT_BY_TAG							\
+	"SELECT image FROM image_tag"					\
+	" WHERE tag=(SELECT id FROM tag WHERE name=?)"
+#define SELECT_BY_PREFIX						\
+	"SELECT image FROM image_tag"					\
+	" WHERE tag IN (SELECT id FROM tag WHERE name>=? AND name<?)"
+#define SELECT_CHANGED							\
+	"SELECT image FROM change WHERE seq>CAST(? AS INTEGER)"
 
-typedef int (*file_filter)(const TMFile *, const char *);
+// Characters that end a word in a query.
+#define QUERY_OPERATORS "()|"
 
-typedef struct PseudoTag {
-	char prefix;
-	file_filter filter;
-} PseudoTag;
+// Parentheses and negations nested deeper than this are refused, so a
+// query can't run the parser out of stack.
+#define QUERY_DEPTH_MAX 100
 
-static int bool_flag(const TMFile *, const char *);
-static int invert_tag(const TMFile *, const char *);
+// Terms are ordered by how many files they match, counted up to this
+// many; past it, the order doesn't matter much.
+#define ESTIMATE_MAX 10000
 
-static const PseudoTag pseudotags[] = {
-	{':', &bool_flag},
-	{'!', &invert_tag}
-};
+typedef enum {
+	TOKEN_END,
+	TOKEN_WORD,
+	TOKEN_NOT,
+	TOKEN_OR,
+	TOKEN_OPEN,
+	TOKEN_CLOSE
+} TokenType;
+
+typedef struct Parser {
+	const TagVector *words;
+	int word;         // Index of the word being read.
+	const char *pos;  // Position in that word.
+	TokenType token;  // The current token.
+	const char *text; // Text of the current word, if it's a word.
+	size_t len;
+	int depth;
+} Parser;
+
+// A query being planned into SQL.
+typedef struct Plan {
+	char *sql;
+	size_t len, cap;
+	const char **params;
+	int nparams, pcap;
+	char **bounds; // Upper bounds of prefixes, owned by the plan.
+	int nbounds;
+} Plan;
 
 static char err_buf[BUFF_MAX] = {0};
 
-static int check_tmdb(int status)
+static void nomem()
 {
-	if (status < 0)
-		strncpy(err_buf, tmdb_get_error(), sizeof(err_buf)-1);
-	return status;
+	strncpy(err_buf, "Out of memory.", sizeof(err_buf)-1);
 }
 
-// Generic flag with no other arguments.
-static int bool_flag(const TMFile *file, const char *flag)
+const char *tmtag_get_err()
 {
-	if (STREQ(flag, "tagged")) {
-		return check_tmdb(tmdb_has_tags(file->id));
-	} else if (STREQ(flag, "untagged")) {
-		int status = check_tmdb(tmdb_has_tags(file->id));
-		if (status < 0)
-			return status;
-		else
-			return !status;
-	} else {
-		snprintf(err_buf, sizeof(err_buf),
-                         "'%s' isn't a valid flag!", flag);
+	return err_buf;
+}
+
+// Returns 1 if the first `len` characters of `tag` make a real tag.
+static int is_real(const char *tag, size_t len)
+{
+	// Empty tags are invalid, and the starting character must be
+	// alphanumeric.
+	if (len == 0 || !isalnum((unsigned char) tag[0]))
+		return 0;
+
+	// Any remaining characters must *not* be whitespace, or mean
+	// something in a query.
+	for (size_t i = 1; i < len; i++) {
+		if (isspace((unsigned char) tag[i]) || tag[i] == '*'
+		    || strchr(QUERY_OPERATORS, tag[i]))
+			return 0;
+	}
+
+	return 1;
+}
+
+int tmtag_is_valid(const char *tag, int must_be_real)
+{
+	size_t len = strlen(tag);
+
+	if (is_real(tag, len))
+		return 1;
+	if (must_be_real)
+		return 0;
+
+	if (tag[0] == ':')
+		return STREQ(tag + 1, "tagged") || STREQ(tag + 1, "untagged");
+
+	// A tag or a tag prefix, optionally negated.
+	if (tag[0] == '!') {
+		tag++;
+		len--;
+	}
+
+	return is_real(tag, len)
+		|| (len > 1 && tag[len - 1] == '*' && is_real(tag, len - 1));
+}
+
+void tmtag_free_query(TagQuery *query)
+{
+	if (query == NULL)
+		return;
+
+	for (int i = 0; i < query->nargs; i++)
+		tmtag_free_query(query->args[i]);
+
+	free(query->args);
+	free(query->name);
+	free(query);
+}
+
+static TagQuery *new_query(QueryOp op)
+{
+	TagQuery *query = calloc(1, sizeof(*query));
+
+	if (query == NULL)
+		nomem();
+	else
+		query->op = op;
+
+	return query;
+}
+
+// Add `arg` to an AND or OR query, merging it in if it's the same kind of
+// query. Takes over `arg` either way.
+static int add_arg(TagQuery *query, TagQuery *arg)
+{
+	int n = arg->op == query->op ? arg->nargs : 1;
+	TagQuery **grown = realloc(query->args,
+	                           (query->nargs + n) * sizeof(*grown));
+
+	if (grown == NULL) {
+		nomem();
+		tmtag_free_query(arg);
 		return -1;
 	}
+	query->args = grown;
+
+	if (arg->op != query->op) {
+		query->args[query->nargs++] = arg;
+		return 0;
+	}
 
+	memcpy(query->args + query->nargs, arg->args, n * sizeof(*grown));
+	query->nargs += n;
+	arg->nargs = 0;
+	tmtag_free_query(arg);
 	return 0;
 }
 
-// Return true if the file does *not* have the tag.
-static int invert_tag(const TMFile *file, const char *flag)
+// Combine two queries with AND or OR, taking over both.
+static TagQuery *combine(QueryOp op, TagQuery *a, TagQuery *b)
 {
-	int status = check_tmdb(tmdb_has_tag(file->id, flag));
-	if (status < 0)
-		return status;
-	else
-		return !status;
+	TagQuery *query = a;
+
+	if (a->op != op) {
+		query = new_query(op);
+		if (query == NULL || add_arg(query, a) < 0) {
+			if (query == NULL)
+				tmtag_free_query(a);
+			tmtag_free_query(query);
+			tmtag_free_query(b);
+			return NULL;
+		}
+	}
+
+	if (add_arg(query, b) < 0) {
+		tmtag_free_query(query);
+		return NULL;
+	}
+
+	return query;
 }
 
-// Looks up the prefix and returns a file filter if found. Otherwise,
-// returns NULL.
-static file_filter find_filter(char c)
+// Negate a query, taking it over.
+static TagQuery *negate(TagQuery *arg)
 {
-	for (size_t i = 0; i < LEN(pseudotags); i++) {
-		if (pseudotags[i].prefix == c)
-			return pseudotags[i].filter;
+	TagQuery *query = NULL;
+
+	if (arg->op == QUERY_NOT) {
+		query = arg->args[0];
+		arg->nargs = 0;
+		tmtag_free_query(arg);
+		return query;
+	}
+
+	query = new_query(QUERY_NOT);
+	if (query)
+		query->args = malloc(sizeof(*query->args));
+
+	if (query == NULL || query->args == NULL) {
+		if (query)
+			nomem();
+		free(query);
+		tmtag_free_query(arg);
+		return NULL;
 	}
 
-	return NULL;
+	query->args[0] = arg;
+	query->nargs = 1;
+	return query;
 }
 
-const char *tmtag_get_err()
+// Move to the next token.
+static void next(Parser *p)
 {
-	return err_buf;
+	while (p->word < p->words->size) {
+		const char *c = p->pos;
+
+		while (isspace((unsigned char) *c))
+			c++;
+
+		if (*c == '\0') {
+			if (++p->word < p->words->size)
+				p->pos = p->words->tags[p->word];
+			continue;
+		}
+
+		p->pos = c + 1;
+		switch (*c) {
+		case '(':
+			p->token = TOKEN_OPEN;
+			return;
+		case ')':
+			p->token = TOKEN_CLOSE;
+			return;
+		case '|':
+			p->token = TOKEN_OR;
+			return;
+		case '!':
+			p->token = TOKEN_NOT;
+			return;
+		}
+
+		p->text = c;
+		while (*c != '\0' && !isspace((unsigned char) *c)
+		       && !strchr(QUERY_OPERATORS, *c))
+			c++;
+
+		p->token = TOKEN_WORD;
+		p->len = c - p->text;
+		p->pos = c;
+		return;
+	}
+
+	p->token = TOKEN_END;
 }
 
-int tmtag_is_valid(const char *tag, int must_be_real)
+// Parse a tag, `prefix*` or flag.
+static TagQuery *parse_word(Parser *p)
 {
-	// Empty tags are invalid.
-	if (strlen(tag) == 0)
-		return 0;
+	TagQuery *query = NULL;
+	char *word = malloc(p->len + 1);
+	size_t len = p->len;
+	int prefix;
 
-	if (!isalnum(tag[0])) {
-		// The starting character must be alphanumeric.
-		if (must_be_real)
-			return 0;
+	if (word == NULL) {
+		nomem();
+		return NULL;
+	}
+	memcpy(word, p->text, len);
+	word[len] = '\0';
+	next(p);
 
-		// A pseudotag that does not start with an alphanumeric
-		// character must start with a pseudotag prefix character
-		// instead.
-		if (!find_filter(tag[0]))
-			return 0;
+	if (word[0] == ':') {
+		if (STREQ(word + 1, "tagged")) {
+			query = new_query(QUERY_TAGGED);
+		} else if (STREQ(word + 1, "untagged")) {
+			query = new_query(QUERY_TAGGED);
+			query = query ? negate(query) : NULL;
+		} else {
+			snprintf(err_buf, sizeof(err_buf),
+                                 "'%s' isn't a valid flag!", word + 1);
+		}
 
-		// A pseudotag must also be at least 2 characters, i.e. a
-		// pseudotag can't only be the prefix character.
-		if (strlen(tag) == 1)
-			return 0;
+		free(word);
+		return query;
 	}
 
-	// Any remaining characters must *not* be whitespace.
-	for (size_t i = 1; tag[i] != '\0'; i++) {
-		if (isspace(tag[i]))
-			return 0;
+	if (STREQ(word, "*")) {
+		// Any tag at all.
+		free(word);
+		return new_query(QUERY_TAGGED);
 	}
 
-	// The tag passed through all the checks; it's a valid tag.
-	return 1;
+	prefix = word[len - 1] == '*';
+	if (!is_real(word, len - prefix)) {
+		snprintf(err_buf, sizeof(err_buf), "Invalid tag '%s'.", word);
+		free(word);
+		return NULL;
+	}
+
+	word[len - prefix] = '\0';
+	query = new_query(prefix ? QUERY_PREFIX : QUERY_TAG);
+	if (query == NULL) {
+		free(word);
+		return NULL;
+	}
+
+	query->name = word;
+	return query;
 }
 
-int tmtag_file_has_tags(const TMFile *file, const TagVector *tags)
+static TagQuery *parse_or(Parser *p);
+
+// Parse a word, a negation or a parenthesized query.
+static TagQuery *parse_unary(Parser *p)
 {
-	file_filter filter = NULL;
-	int passes_filter = 0;
+	TagQuery *query = NULL;
 
-	for (int i = 0; i < tags->size; i++) {
-		// Check if the tag is a special filter.
-		filter = find_filter(tags->tags[i][0]);
+	if (p->token == TOKEN_WORD)
+		return parse_word(p);
 
+	if (p->token != TOKEN_NOT && p->token != TOKEN_OPEN) {
+		strncpy(err_buf, p->token == TOKEN_END
+		        ? "Query ends where a tag was expected."
+		        : "Expected a tag in query.", sizeof(err_buf)-1);
+		return NULL;
+	}
 
-		if (filter) {
-			// Go through the special filter to check if the image.
-			// Add +1 to the tag name so that it doesn't catch the
-			// prefix.
-			passes_filter = filter(file, tags->tags[i]+1);
-		} else {
-			// It's a real tag; check if the image has it in the
-			// database.
-			passes_filter = check_tmdb(tmdb_has_tag(file->id, tags->tags[i]));
+	if (++p->depth > QUERY_DEPTH_MAX) {
+		strncpy(err_buf, "Query is nested too deeply.",
+		        sizeof(err_buf)-1);
+		return NULL;
+	}
+
+	if (p->token == TOKEN_NOT) {
+		next(p);
+		query = parse_unary(p);
+		query = query ? negate(query) : NULL;
+	} else {
+		next(p);
+		query = parse_or(p);
+		if (query && p->token != TOKEN_CLOSE) {
+			strncpy(err_buf, "Missing ')' in query.",
+			        sizeof(err_buf)-1);
+			tmtag_free_query(query);
+			return NULL;
+		}
+		next(p);
+	}
+
+	p->depth--;
+	return query;
+}
+
+// Parse terms next to each other, which must all match.
+static TagQuery *parse_and(Parser *p)
+{
+	TagQuery *query = parse_unary(p);
+
+	while (query && (p->token == TOKEN_WORD || p->token == TOKEN_NOT
+	                 || p->token == TOKEN_OPEN)) {
+		TagQuery *arg = parse_unary(p);
+
+		if (arg == NULL) {
+			tmtag_free_query(query);
+			return NULL;
 		}
+		query = combine(QUERY_AND, query, arg);
+	}
 
-		// Exit early if the current filter doesnt pass or errs.
-		if (passes_filter <= 0)
-			return passes_filter;
+	return query;
+}
+
+static TagQuery *parse_or(Parser *p)
+{
+	TagQuery *query = parse_and(p);
+
+	while (query && p->token == TOKEN_OR) {
+		TagQuery *arg = NULL;
+
+		next(p);
+		arg = parse_and(p);
+		if (arg == NULL) {
+			tmtag_free_query(query);
+			return NULL;
+		}
+		query = combine(QUERY_OR, query, arg);
 	}
 
-	// File passed through every filter.
-	return 1;
+	return query;
+}
+
+TagQuery *tmtag_parse(const TagVector *filters)
+{
+	Parser p = {.words = filters};
+	TagQuery *query = NULL;
+
+	if (filters->size > 0)
+		p.pos = filters->tags[0];
+	next(&p);
+
+	// No terms at all matches every file.
+	if (p.token == TOKEN_END)
+		return new_query(QUERY_AND);
+
+	query = parse_or(&p);
+	if (query && p.token != TOKEN_END) {
+		strncpy(err_buf, "Unmatched ')' in query.", sizeof(err_buf)-1);
+		tmtag_free_query(query);
+		return NULL;
+	}
+
+	return query;
+}
+
+// Return the smallest string greater than every string starting with
+// `prefix`, or NULL if out of memory. Real tags start with an alphanumeric
+// character, so there always is one.
+static char *upper_bound(const char *prefix)
+{
+	size_t len = strlen(prefix);
+	char *bound = malloc(len + 1);
+
+	if (bound == NULL)
+		return NULL;
+
+	memcpy(bound, prefix, len + 1);
+	while (len > 0 && (unsigned char) bound[len - 1] == 0xff)
+		len--;
+	bound[len - 1]++;
+	bound[len] = '\0';
+
+	return bound;
+}
+
+static int plan_append(Plan *plan, const char *sql)
+{
+	size_t len = strlen(sql);
+
+	if (plan->len + len + 1 > plan->cap) {
+		size_t cap = plan->cap ? plan->cap * 2 : 256;
+		char *grown = NULL;
+
+		while (cap < plan->len + len + 1)
+			cap *= 2;
+
+		grown = realloc(plan->sql, cap);
+		if (grown == NULL) {
+			nomem();
+			return -1;
+		}
+		plan->sql = grown;
+		plan->cap = cap;
+	}
+
+	memcpy(plan->sql + plan->len, sql, len + 1);
+	plan->len += len;
+	return 0;
+}
+
+static int plan_param(Plan *plan, const char *param)
+{
+	if (plan->nparams == plan->pcap) {
+		int cap = plan->pcap ? plan->pcap * 2 : 8;
+		const char **grown = realloc(plan->params,
+		                             cap * sizeof(*grown));
+
+		if (grown == NULL) {
+			nomem();
+			return -1;
+		}
+		plan->params = grown;
+		plan->pcap = cap;
+	}
+
+	plan->params[plan->nparams++] = param;
+	return 0;
+}
+
+// Add the select and parameters matching a prefix.
+static int plan_prefix(Plan *plan, const char *prefix)
+{
+	char **grown = realloc(plan->bounds,
+	                       (plan->nbounds + 1) * sizeof(*grown));
+	char *bound = NULL;
+
+	if (grown == NULL) {
+		nomem();
+		return -1;
+	}
+	plan->bounds = grown;
+
+	bound = upper_bound(prefix);
+	if (bound == NULL) {
+		nomem();
+		return -1;
+	}
+	plan->bounds[plan->nbounds++] = bound;
+
+	if (plan_append(plan, SELECT_BY_PREFIX) < 0
+	    || plan_param(plan, prefix) < 0 || plan_param(plan, bound) < 0)
+		return -1;
+
+	return 0;
+}
+
+static void plan_free(Plan *plan)
+{
+	for (int i = 0; i < plan->nbounds; i++)
+		free(plan->bounds[i]);
+
+	free(plan->bounds);
+	free(plan->params);
+	free(plan->sql);
+}
+
+// Estimate how many files a query matches, up to ESTIMATE_MAX.
+static int estimate(const TagQuery *query, long long *count)
+{
+	const char *params[2] = {query->name, NULL};
+	long long sum = 0, n;
+	int rc = 0;
+
+	switch (query->op) {
+	case QUERY_TAG:
+		rc = tmdb_count_files(SELECT_BY_TAG, params, 1, ESTIMATE_MAX,
+		                      count);
+		break;
+	case QUERY_PREFIX:
+		params[1] = upper_bound(query->name);
+		if (params[1] == NULL) {
+			nomem();
+			return -1;
+		}
+		rc = tmdb_count_files(SELECT_BY_PREFIX, params, 2,
+		                      ESTIMATE_MAX, count);
+		free((char*) params[1]);
+		break;
+	case QUERY_TAGGED:
+		rc = tmdb_count_files(SELECT_TAGGED, NULL, 0, ESTIMATE_MAX,
+		                      count);
+		break;
+	case QUERY_NOT:
+		// Most files lack any given tag.
+		*count = ESTIMATE_MAX;
+		return 0;
+	case QUERY_AND:
+		// Bounded by the smallest term it intersects.
+		*count = ESTIMATE_MAX;
+		for (int i = 0; i < query->nargs; i++) {
+			if (query->args[i]->op == QUERY_NOT)
+				continue;
+			if (estimate(query->args[i], &n) < 0)
+				return -1;
+			*count = MIN(*count, n);
+		}
+		return 0;
+	case QUERY_OR:
+		for (int i = 0; i < query->nargs && sum < ESTIMATE_MAX; i++) {
+			if (estimate(query->args[i], &n) < 0)
+				return -1;
+			sum += n;
+		}
+		*count = MIN(sum, ESTIMATE_MAX);
+		return 0;
+	}
+
+	if (rc < 0)
+		strncpy(err_buf, tmdb_get_error(), sizeof(err_buf)-1);
+	return rc;
+}
+
+// Returns 1 if the query plans into a compound select.
+static int is_compound(const TagQuery *query)
+{
+	return query->op == QUERY_NOT || query->nargs > 1;
+}
+
+static int plan_query(Plan *plan, const TagQuery *query);
+
+// Plan a query to go on the right of a compound operator. SQLite runs
+// compound selects from left to right, so compound ones there need to be
+// wrapped in a subquery.
+static int plan_operand(Plan *plan, const char *op, const TagQuery *query)
+{
+	if (plan_append(plan, op) < 0)
+		return -1;
+
+	if (!is_compound(query))
+		return plan_query(plan, query);
+
+	if (plan_append(plan, "SELECT * FROM (") < 0
+	    || plan_query(plan, query) < 0)
+		return -1;
+
+	return plan_append(plan, ")");
+}
+
+// Plan an intersection, starting from the term with the fewest matches so
+// the result is bounded by the smallest set we know of, and only falling
+// back to every file when it's made purely of exclusions. Intersections
+// are chained before exclusions, and in order of size.
+static int plan_and(Plan *plan, const TagQuery *query)
+{
+	const TagQuery **pos = calloc(query->nargs + 1, sizeof(*pos));
+	long long *counts = calloc(query->nargs + 1, sizeof(*counts));
+	int npos = 0, status = -1;
+
+	if (pos == NULL || counts == NULL) {
+		nomem();
+		goto cleanup;
+	}
+
+	for (int i = 0; i < query->nargs; i++) {
+		if (query->args[i]->op != QUERY_NOT)
+			pos[npos++] = query->args[i];
+	}
+
+	// Only a choice of order needs estimates.
+	for (int i = 0; i < npos && npos > 1; i++) {
+		const TagQuery *arg = pos[i];
+		long long count;
+		int j = i;
+
+		if (estimate(arg, &count) < 0)
+			goto cleanup;
+
+		for (; j > 0 && counts[j - 1] > count; j--) {
+			pos[j] = pos[j - 1];
+			counts[j] = counts[j - 1];
+		}
+		pos[j] = arg;
+		counts[j] = count;
+	}
+
+	if ((npos ? plan_query(plan, pos[0])
+	     : plan_append(plan, SELECT_ALL)) < 0)
+		goto cleanup;
+
+	for (int i = 1; i < npos; i++) {
+		if (plan_operand(plan, " INTERSECT ", pos[i]) < 0)
+			goto cleanup;
+	}
+
+	for (int i = 0; i < query->nargs; i++) {
+		if (query->args[i]->op == QUERY_NOT
+		    && plan_operand(plan, " EXCEPT ",
+		                    query->args[i]->args[0]) < 0)
+			goto cleanup;
+	}
+
+	status = 0;
+
+cleanup:
+	free(counts);
+	free(pos);
+	return status;
+}
+
+// Plan a query into a select of the matching file ids.
+static int plan_query(Plan *plan, const TagQuery *query)
+{
+	switch (query->op) {
+	case QUERY_TAG:
+		if (plan_append(plan, SELECT_BY_TAG) < 0)
+			return -1;
+		return plan_param(plan, query->name);
+	case QUERY_PREFIX:
+		return plan_prefix(plan, query->name);
+	case QUERY_TAGGED:
+		return plan_append(plan, SELECT_TAGGED);
+	case QUERY_NOT:
+		if (plan_append(plan, SELECT_ALL) < 0)
+			return -1;
+		return plan_operand(plan, " EXCEPT ", query->args[0]);
+	case QUERY_AND:
+		return plan_and(plan, query);
+	case QUERY_OR:
+		for (int i = 0; i < query->nargs; i++) {
+			if ((i == 0 ? plan_query(plan, query->args[i])
+			     : plan_operand(plan, " UNION ", query->args[i])) < 0)
+				return -1;
+		}
+		return 0;
+	}
+
+	return -1;
+}
+
+// List the files a planned query selects, or every file if it's NULL. If
+// `terms` isn't NULL, only files whose titles match them are listed, best
+// matches first, up to the page's limit.
+static int run_query(const char *terms, const Plan *plan, const TMPage *page,
+                     file_callback callback, void *arg)
+{
+	int status;
+
+	if (terms)
+		status = tmdb_search_files(terms, plan->sql, plan->params,
+		                           plan->nparams, page ? page->limit : 0,
+		                           callback, arg);
+	else
+		status = tmdb_query_files(plan->sql, plan->params,
+		                          plan->nparams, page, callback, arg);
+
+	if (status < 0)
+		strncpy(err_buf, tmdb_get_error(), sizeof(err_buf)-1);
+	return status;
+}
+
+// Parse, plan and run a query for a page of files, optionally intersected
+// with the files changed after `since`, or searched for `terms`.
+static int query_files(const TagVector *filters, const char *since,
+                       const char *terms, const TMPage *page,
+                       file_callback callback, void *arg)
+{
+	TagQuery *query = tmtag_parse(filters);
+	Plan plan = {0};
+	int status = -1;
+
+	if (query == NULL)
+		return -1;
+
+	// Every file, with nothing to plan.
+	if (query->op == QUERY_AND && query->nargs == 0 && since == NULL) {
+		tmtag_free_query(query);
+		return run_query(terms, &plan, page, callback, arg);
+	}
+
+	if (since) {
+		// Changed files come first; there are usually few of them.
+		if (plan_append(&plan, SELECT_CHANGED) < 0
+		    || plan_param(&plan, since) < 0)
+			goto cleanup;
+		if ((query->op != QUERY_AND || query->nargs > 0)
+		    && plan_operand(&plan, " INTERSECT ", query) < 0)
+			goto cleanup;
+	} else if (plan_query(&plan, query) < 0) {
+		goto cleanup;
+	}
+
+	status = run_query(terms, &plan, page, callback, arg);
+
+cleanup:
+	plan_free(&plan);
+	tmtag_free_query(query);
+	return status;
+}
+
+int tmtag_get_files(const TagVector *filters, file_callback callback,
+                    void *arg)
+{
+	return query_files(filters, NULL, NULL, NULL, callback, arg);
+}
+
+int tmtag_get_page(const TagVector *filters, const TMPage *page,
+                   file_callback callback, void *arg)
+{
+	return query_files(filters, NULL, NULL, page, callback, arg);
+}
+
+int tmtag_get_changed_files(const TagVector *filters, long long since,
+                            file_callback callback, void *arg)
+{
+	char seq_buf[32];
+
+	snprintf(seq_buf, sizeof(seq_buf), "%lld", since);
+	return query_files(filters, seq_buf, NULL, NULL, callback, arg);
+}
+
+int tmtag_search(const char *terms, const TagVector *filters, int limit,
+                 file_callback callback, void *arg)
+{
+	const TMPage page = {TM_SORT_ID, limit, 0, NULL};
+
+	return query_files(filters, NULL, terms, &page, callback, arg);
 }
@@ -2,29 +2,94 @@
 #define TAGS_H
 
 #include "core.h"
+#include "database.h" // file_callback
 
 typedef struct TagVector {
 	int size;
 	char **tags;
 } TagVector;
 
+typedef enum {
+	QUERY_TAG,    // Files with the tag `name`.
+	QUERY_PREFIX, // Files with any tag starting with `name`.
+	QUERY_TAGGED, // Files with any tag.
+	QUERY_NOT,    // Files not matching args[0].
+	QUERY_AND,    // Files matching every one of args; every file if none.
+	QUERY_OR      // Files matching any of args.
+} QueryOp;
+
+// A parsed tag query. See tmtag_parse().
+typedef struct TagQuery {
+	QueryOp op;
+	char *name;
+	int nargs;
+	struct TagQuery **args;
+} TagQuery;
+
 /**
  * tmtag_get_err() - Return a cstring containing the latest error.
  */
 const char *tmtag_get_err();
 
 /**
- * tmtag_is_valid_tag() - Returns 1 if the tag is valid, 0 otherwise.
+ * tmtag_is_valid_tag() - Returns 1 if the tag is valid, 0 otherwise. Real
+ * tags can't contain whitespace or any of `()|*`, which queries use.
  *
  * must_be_real - truthy if the tag must be valid, or falsy if it can also
- * be a pseudotag.
+ * be a pseudotag: `:flag`, `!tag` or `prefix*`.
  */
 int tmtag_is_valid(const char *tag, int must_be_real);
 
 /**
- * tmtag_file_has_tags() - Returns 1 if the specified file has every
- * tag in the TagVector; returns 0 otherwise.
+ * tmtag_parse() - Parse the words of a query, and return it, or NULL on
+ * error. Free it with tmtag_free_query().
+ *
+ * Words are tags, `prefix*` for any tag starting with prefix, `:tagged` or
+ * `:untagged`. They're combined with `!` (not), `|` (or) and parentheses,
+ * and words next to each other must all match. `!` binds tightest and `|`
+ * loosest, so `a b | !c` is `(a b) | (!c)`. Operators don't need spaces
+ * around them, and the words of the TagVector are read as if joined with
+ * spaces.
+ */
+TagQuery *tmtag_parse(const TagVector *filters);
+
+/**
+ * tmtag_free_query() - Free a query returned by tmtag_parse().
+ */
+void tmtag_free_query(TagQuery *query);
+
+/**
+ * tmtag_get_files() - Call `callback` for every file matching the query in
+ * the TagVector, in order of id. See tmtag_parse(). The query is planned
+ * into a single SQL statement, with the terms of each intersection ordered
+ * from the fewest matches up, so the cost grows with the number of matches
+ * rather than the number of files times the number of terms.
+ *
+ * arg - A void pointer that also gets passed to `callback`.
+ */
+int tmtag_get_files(const TagVector *filters, file_callback callback,
+                    void *arg);
+
+/**
+ * tmtag_get_page() - Like tmtag_get_files(), but only for one page of the
+ * files, in the page's order.
+ */
+int tmtag_get_page(const TagVector *filters, const TMPage *page,
+                   file_callback callback, void *arg);
+
+/**
+ * tmtag_get_changed_files() - Like tmtag_get_files(), but only for files
+ * changed after the sequence number `since`. See tmdb_get_changes().
+ */
+int tmtag_get_changed_files(const TagVector *filters, long long since,
+                            file_callback callback, void *arg);
+
+/**
+ * tmtag_search() - Call `callback` for up to `limit` files matching the
+ * query in the TagVector whose titles have every word of `terms`, best
+ * matches first. See tmdb_search_files().
  */
-int tmtag_file_has_tags(const TMFile *file, const TagVector *filters);
+int tmtag_search(const char *terms, const TagVector *filters, int limit,
+                 file_callback callback, void *arg);
 
 #endif // TAGS_H
@@ -1,10 +1,21 @@
+#define _GNU_SOURCE // copy_file_range
+
 #include <errno.h>
+#include <fcntl.h>
 #include <stdarg.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
 
 #include <sys/stat.h>
 
+#ifdef __linux__
+#include <linux/fs.h> // FICLONE
+#include <sys/ioctl.h>
+#include <sys/sendfile.h>
+#endif
+
 #include "limits.h"
 #include "util.h"
 
@@ -33,31 +44,63 @@ int mkpath(const char *path, mode_t mode)
 	return 0;
 }
 
-int cp(const char *dst, const char *src)
+// Copy everything between two file descriptors, trying the cheapest
+// method first: share the extents (reflink), copy inside the kernel, and
+// only then copy through a userspace buffer. Sizes aren't trusted, since
+// pipes and files in /proc and /sys report none.
+static int copy_fd(int fd_dst, int fd_src)
 {
-	char buf[4096];
-	FILE *fd_dst = NULL, *fd_src = NULL;
-	size_t nread = 0;
-	int errcode = 0;
+	const size_t buf_size = 1 << 20;
+	char *buf = NULL;
+	ssize_t nread;
+	int status = 0;
 
-	fd_dst = fopen(dst, "w");
-	if (fd_dst == NULL)
-		return -1;
+#ifdef __linux__
+	ssize_t n;
+
+	// Reflinks are O(1) on btrfs, XFS and other copy-on-write
+	// filesystems.
+	if (ioctl(fd_dst, FICLONE, fd_src) == 0)
+		return 0;
+
+	// copy_file_range() may still share extents, or at least skips
+	// the copy to userspace. Both stop at the end of the file, or fail
+	// if the filesystem can't do it.
+	do {
+		n = copy_file_range(fd_src, NULL, fd_dst, NULL, buf_size, 0);
+	} while (n > 0);
 
-	fd_src = fopen(src, "r");
-	if (fd_src == NULL) {
-		fclose(fd_dst);
-		return -2;
+	if (n < 0) {
+		do {
+			n = sendfile(fd_dst, fd_src, NULL, buf_size);
+		} while (n > 0);
 	}
+#endif
 
-	while (nread = fread(buf, 1, sizeof buf, fd_src), nread > 0) {
+	// Copy whatever's left until the end of the file, which is
+	// everything if neither of the above worked, or if they gave up
+	// early on a file that reports no size. The file offsets are where
+	// the kernel left off.
+	buf = malloc(buf_size);
+	if (buf == NULL)
+		return -1;
+
+	while ((nread = read(fd_src, buf, buf_size)) != 0) {
 		char *out_ptr = buf;
-		size_t nwritten;
+
+		if (nread < 0) {
+			if (errno == EINTR)
+				continue;
+			status = -1;
+			break;
+		}
 
 		while (nread > 0) {
-			nwritten = fwrite(buf, 1, MIN(sizeof buf, nread), fd_dst);
-			if (ferror(fd_dst)) {
-				errcode = ferror(fd_dst);
+			ssize_t nwritten = write(fd_dst, out_ptr, nread);
+			if (nwritten < 0) {
+				if (errno == EINTR)
+					continue;
+				status = -1;
 				goto cleanup;
 			}
 
@@ -67,7 +110,94 @@ int cp(const char *dst, const char *src)
 	}
 
 cleanup:
-	fclose(fd_dst);
-	fclose(fd_src);
-	return errcode;
+	free(buf);
+	return status;
+}
+
+int cp(const char *dst, const char *src)
+{
+	int fd_src = -1, fd_dst = -1;
+	int status = -1;
+
+	fd_src = open(src, O_RDONLY);
+	if (fd_src < 0)
+		return -1;
+
+	fd_dst = open(dst, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+	if (fd_dst < 0)
+		goto cleanup;
+
+	status = copy_fd(fd_dst, fd_src);
+
+cleanup:
+	if (fd_dst >= 0 && close(fd_dst) < 0)
+		status = -1;
+	if (fd_src >= 0)
+		close(fd_src);
+	return status;
+}
+
+static const char base64_chars[] =
+	"ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+
+size_t base64_encode(char *dst, const unsigned char *src, size_t n)
+{
+	char *p = dst;
+
+	for (size_t i = 0; i < n; i += 3) {
+		unsigned long v = (unsigned long) src[i] << 16;
+
+		if (i + 1 < n)
+			v |= src[i + 1] << 8;
+		if (i + 2 < n)
+			v |= src[i + 2];
+
+		*p++ = base64_chars[v >> 18 & 63];
+		*p++ = base64_chars[v >> 12 & 63];
+		*p++ = i + 1 < n ? base64_chars[v >> 6 & 63] : '=';
+		*p++ = i + 2 < n ? base64_chars[v & 63] : '=';
+	}
+
+	return p - dst;
+}
+
+static int base64_value(char c)
+{
+	const char *p = c ? strchr(base64_chars, c) : NULL;
+
+	return p ? p - base64_chars : -1;
+}
+
+ssize_t base64_decode(unsigned char *dst, const char *src, size_t n)
+{
+	unsigned char *p = dst;
+
+	if (n % 4)
+		return -1;
+
+	// Each group of four characters is read before its three bytes are
+	// written, so decoding in place never overtakes itself.
+	for (size_t i = 0; i < n; i += 4) {
+		int pad = (src[i + 3] == '=') + (src[i + 2] == '=');
+		int v[4];
+
+		if (pad && i + 4 < n)
+			return -1;
+
+		for (int j = 0; j < 4 - pad; j++) {
+			v[j] = base64_value(src[i + j]);
+			if (v[j] < 0)
+				return -1;
+		}
+		for (int j = 4 - pad; j < 4; j++)
+			v[j] = 0;
+
+		*p++ = v[0] << 2 | v[1] >> 4;
+		if (pad < 2)
+			*p++ = (v[1] & 15) << 4 | v[2] >> 2;
+		if (pad < 1)
+			*p++ = (v[2] & 3) << 6 | v[3];
+	}
+
+	return p - dst;
 }
@@ -23,8 +23,25 @@
 int mkpath(const char *path, mode_t mode);
 
 /**
- * cp() - Copy a file from one location to the other
+ * cp() - Copy a file from one location to the other. Returns 0 on success,
+ * or -1 and sets errno on error.
  */
 int cp(const char *dst, const char *src);
 
+// Characters base64_encode() makes of `n` bytes.
+#define BASE64_LEN(N) (((N) + 2) / 3 * 4)
+
+/**
+ * base64_encode() - Encode `n` bytes of `src` as padded base64 into `dst`,
+ * which must hold BASE64_LEN(n) characters. Returns how many it wrote.
+ */
+size_t base64_encode(char *dst, const unsigned char *src, size_t n);
+
+/**
+ * base64_decode() - Decode the `n` characters of padded base64 at `src`
+ * into `dst`, which may be `src` itself. Returns the number of bytes, or
+ * -1 if `src` isn't valid base64.
+ */
+ssize_t base64_decode(unsigned char *dst, const char *src, size_t n);
+
 #endif // UTIL_H
@@ -0,0 +1,859 @@
+#define _POSIX_C_SOURCE 200809L // fdopendir, mkdirat, symlinkat, strdup
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <sys/stat.h>
+
+#include "database.h"
+#include "libtagmage.h"
+#include "util.h"
+#include "view.h"
+
+#define UNTAGGED_DIR ":untagged"
+
+// Records which changes a view has caught up to, and what it shows.
+#define STATE_FILE ".tagmage-view"
+#define STATE_TMP ".tagmage-view.tmp"
+
+// Links are handed out to workers this many at a time.
+#define LINK_CHUNK 256
+
+typedef struct ViewFile {
+	int id;
+	int is_tagged;
+	char *name;   // Link name, <id>-<title>.
+	char *target; // Path in the store.
+} ViewFile;
+
+typedef struct ViewLink {
+	const char *dir; // Subdirectory, or NULL for the view itself.
+	const ViewFile *file;
+} ViewLink;
+
+// A file's link name or tag directory as it was before a change.
+typedef struct ViewChange {
+	int id;
+	char *name; // NULL if the title is unknown.
+	char *dir;  // NULL if the file itself changed.
+} ViewChange;
+
+// A tag directory a changed file belongs in now.
+typedef struct ViewMember {
+	int id;
+	char *dir;
+} ViewMember;
+
+typedef struct View {
+	int dirfd;
+	int by_tag;
+
+	ViewFile *files; // Sorted by id.
+	size_t nfiles, files_cap;
+
+	ViewLink *links;
+	size_t nlinks, links_cap;
+
+	char **dirs; // Tag subdirectories.
+	size_t ndirs, dirs_cap;
+
+	// Both sorted by id, when catching up.
+	ViewChange *changes;
+	size_t nchanges, changes_cap;
+	ViewMember *members;
+	size_t nmembers, members_cap;
+
+	// Shared between the workers.
+	pthread_mutex_t lock;
+	size_t next;
+	int error;
+} View;
+
+static char err_buf[BUFF_MAX] = {0};
+
+// Grow an array to hold at least one more item.
+static int reserve(void **items, size_t *cap, size_t size, size_t item_size)
+{
+	void *grown = NULL;
+	size_t new_cap;
+
+	if (size < *cap)
+		return 0;
+
+	new_cap = *cap ? *cap * 2 : 256;
+	grown = realloc(*items, new_cap * item_size);
+	if (grown == NULL)
+		return -1;
+
+	*items = grown;
+	*cap = new_cap;
+	return 0;
+}
+
+// Copy a name for use as a single path component, prefixed with the file id
+// if it's not negative.
+static char *component(int id, const char *name)
+{
+	size_t len = strlen(name);
+	char *dst = NULL;
+
+	if (id >= 0)
+		len = snprintf(NULL, 0, "%05d-%s", id, name);
+
+	dst = malloc(len + 1);
+	if (dst == NULL)
+		return NULL;
+
+	if (id < 0)
+		memcpy(dst, name, len + 1);
+	else
+		snprintf(dst, len + 1, "%05d-%s", id, name);
+	for (char *c = dst; *c; c++) {
+		if (*c == '/')
+			*c = '_';
+	}
+
+	return dst;
+}
+
+static int add_file(const TMFile *file, void *arg)
+{
+	View *view = arg;
+	ViewFile *vf = NULL;
+	char path_buf[PATH_MAX + 1];
+
+	if (reserve((void**) &view->files, &view->files_cap, view->nfiles,
+                    sizeof(*view->files)) < 0)
+		goto nomem;
+
+	if (tm_file_path(file, path_buf, sizeof(path_buf)) >= sizeof(path_buf)) {
+		view->error = ENOBUFS;
+		return 1;
+	}
+
+	vf = &view->files[view->nfiles];
+	vf->id = file->id;
+	vf->is_tagged = 0;
+	vf->name = component(file->id, file->title);
+	vf->target = strdup(path_buf);
+	if (vf->name == NULL || vf->target == NULL) {
+		free(vf->name);
+		free(vf->target);
+		goto nomem;
+	}
+
+	view->nfiles++;
+	return 0;
+
+nomem:
+	view->error = ENOMEM;
+	return 1;
+}
+
+static int add_link(View *view, const char *dir, const ViewFile *file)
+{
+	if (reserve((void**) &view->links, &view->links_cap, view->nlinks,
+                    sizeof(*view->links)) < 0) {
+		view->error = ENOMEM;
+		return -1;
+	}
+
+	view->links[view->nlinks].dir = dir;
+	view->links[view->nlinks].file = file;
+	view->nlinks++;
+	return 0;
+}
+
+static ViewFile *find_file(View *view, int id)
+{
+	size_t lo = 0, hi = view->nfiles;
+
+	while (lo < hi) {
+		size_t mid = lo + (hi - lo) / 2;
+
+		if (view->files[mid].id == id)
+			return &view->files[mid];
+		else if (view->files[mid].id < id)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	return NULL;
+}
+
+// Link a file into its tag's directory, if it's in the view at all.
+static int add_membership(int file_id, const char *tag, void *arg)
+{
+	View *view = arg;
+	ViewFile *file = find_file(view, file_id);
+
+	if (file == NULL)
+		return 0;
+	file->is_tagged = 1;
+
+	// Memberships come grouped by tag, so a new tag starts a new
+	// directory.
+	if (view->ndirs == 0 || strcmp(view->dirs[view->ndirs - 1],
+                                       tag) != 0) {
+		char *dir = NULL;
+
+		if (reserve((void**) &view->dirs, &view->dirs_cap, view->ndirs,
+                            sizeof(*view->dirs)) < 0
+		    || (dir = component(-1, tag)) == NULL) {
+			view->error = ENOMEM;
+			return 1;
+		}
+
+		if (mkdirat(view->dirfd, dir, 0755) != 0 && errno != EEXIST) {
+			view->error = errno;
+			free(dir);
+			return 1;
+		}
+
+		view->dirs[view->ndirs++] = dir;
+	}
+
+	return add_link(view, view->dirs[view->ndirs - 1], file) < 0;
+}
+
+static void *link_worker(void *arg)
+{
+	View *view = arg;
+	char name[PATH_MAX + 1];
+
+	for (;;) {
+		size_t start, end;
+
+		pthread_mutex_lock(&view->lock);
+		start = view->next;
+		end = MIN(start + LINK_CHUNK, view->nlinks);
+		view->next = end;
+		pthread_mutex_unlock(&view->lock);
+
+		if (start >= end || view->error)
+			break;
+
+		for (size_t i = start; i < end; i++) {
+			const ViewLink *link = &view->links[i];
+			const char *path = link->file->name;
+
+			if (link->dir) {
+				snprintf(name, sizeof(name), "%s/%s",
+                                         link->dir, link->file->name);
+				path = name;
+			}
+
+			if (symlinkat(link->file->target, view->dirfd, path) != 0
+			    && errno != EEXIST) {
+				pthread_mutex_lock(&view->lock);
+				view->error = errno;
+				pthread_mutex_unlock(&view->lock);
+				return NULL;
+			}
+		}
+	}
+
+	return NULL;
+}
+
+// Whether a directory entry is a symlink into the store, as the view links
+// every file.
+static int is_view_link(int dirfd, const char *name)
+{
+	char target[PATH_MAX + 1];
+	size_t len = strlen(tm_path());
+	ssize_t n = readlinkat(dirfd, name, target, sizeof(target) - 1);
+
+	if (n < 0)
+		return 0;
+	target[n] = '\0';
+
+	return strncmp(target, tm_path(), len) == 0 && target[len] == '/';
+}
+
+// Whether a view may be built in a directory from scratch: it's empty, or
+// holds a view already, even an unfinished one.
+static int may_clear(int dirfd)
+{
+	struct dirent *entry;
+	DIR *dir;
+	int fd, empty = 1;
+
+	if (faccessat(dirfd, STATE_FILE, F_OK, 0) == 0)
+		return 1;
+	if (errno != ENOENT)
+		return -1;
+
+	fd = dup(dirfd);
+	if (fd < 0)
+		return -1;
+
+	dir = fdopendir(fd);
+	if (dir == NULL) {
+		close(fd);
+		return -1;
+	}
+
+	while (empty && (entry = readdir(dir)) != NULL)
+		empty = STREQ(entry->d_name, ".") || STREQ(entry->d_name, "..");
+
+	closedir(dir);
+	return empty;
+}
+
+// Remove the links into the store inside a directory, and the directories
+// that leaves empty. Anything else is left alone.
+static int clear_dir(int dirfd)
+{
+	struct dirent *entry;
+	DIR *dir;
+	int fd = dup(dirfd);
+
+	if (fd < 0)
+		return -1;
+
+	dir = fdopendir(fd);
+	if (dir == NULL) {
+		close(fd);
+		return -1;
+	}
+
+	while ((entry = readdir(dir)) != NULL) {
+		struct stat st;
+		int subfd;
+
+		if (STREQ(entry->d_name, ".") || STREQ(entry->d_name, ".."))
+			continue;
+
+		if (fstatat(dirfd, entry->d_name, &st, AT_SYMLINK_NOFOLLOW) != 0)
+			continue;
+
+		if (S_ISLNK(st.st_mode)) {
+			if (is_view_link(dirfd, entry->d_name))
+				unlinkat(dirfd, entry->d_name, 0);
+		} else if (S_ISDIR(st.st_mode)) {
+			subfd = openat(dirfd, entry->d_name,
+                                       O_RDONLY | O_DIRECTORY | O_NOFOLLOW);
+			if (subfd < 0)
+				continue;
+
+			clear_dir(subfd);
+			close(subfd);
+			unlinkat(dirfd, entry->d_name, AT_REMOVEDIR);
+		}
+	}
+
+	closedir(dir);
+	return 0;
+}
+
+static int add_change(int file_id, const char *tag, const char *title,
+                      void *arg)
+{
+	View *view = arg;
+	ViewChange *change = NULL;
+
+	if (reserve((void**) &view->changes, &view->changes_cap,
+                    view->nchanges, sizeof(*view->changes)) < 0)
+		goto nomem;
+
+	change = &view->changes[view->nchanges];
+	change->id = file_id;
+	change->name = title ? component(file_id, title) : NULL;
+	change->dir = tag && view->by_tag ? component(-1, tag) : NULL;
+	if ((title && change->name == NULL) || (tag && view->by_tag
+                                                && change->dir == NULL)) {
+		free(change->name);
+		free(change->dir);
+		goto nomem;
+	}
+
+	view->nchanges++;
+	return 0;
+
+nomem:
+	view->error = ENOMEM;
+	return 1;
+}
+
+static int add_member(int file_id, const char *tag, void *arg)
+{
+	View *view = arg;
+	ViewMember *member = NULL;
+
+	if (reserve((void**) &view->members, &view->members_cap,
+                    view->nmembers, sizeof(*view->members)) < 0)
+		goto nomem;
+
+	member = &view->members[view->nmembers];
+	member->id = file_id;
+	member->dir = component(-1, tag);
+	if (member->dir == NULL)
+		goto nomem;
+
+	view->nmembers++;
+	return 0;
+
+nomem:
+	view->error = ENOMEM;
+	return 1;
+}
+
+// Return a tag directory that stays around as long as the view, creating it
+// if it doesn't exist yet.
+static const char *get_dir(View *view, const char *dir)
+{
+	char *copy = NULL;
+
+	for (size_t i = 0; i < view->ndirs; i++) {
+		if (STREQ(view->dirs[i], dir))
+			return view->dirs[i];
+	}
+
+	if (reserve((void**) &view->dirs, &view->dirs_cap, view->ndirs,
+                    sizeof(*view->dirs)) < 0
+	    || (copy = strdup(dir)) == NULL) {
+		view->error = ENOMEM;
+		return NULL;
+	}
+
+	if (mkdirat(view->dirfd, copy, 0755) != 0 && errno != EEXIST) {
+		view->error = errno;
+		free(copy);
+		return NULL;
+	}
+
+	view->dirs[view->ndirs++] = copy;
+	return copy;
+}
+
+// Remove a link from the view, if it's there.
+static int unlink_name(View *view, const char *dir, const char *name)
+{
+	char path[PATH_MAX + 1];
+
+	if (dir) {
+		snprintf(path, sizeof(path), "%s/%s", dir, name);
+		name = path;
+	}
+
+	if (unlinkat(view->dirfd, name, 0) != 0 && errno != ENOENT
+	    && errno != ENOTDIR) {
+		view->error = errno;
+		return -1;
+	}
+
+	return 0;
+}
+
+// Unlink every name a changed file may have had, from every directory it
+// may have been in.
+static int unlink_changed(View *view)
+{
+	size_t ci = 0, mi = 0;
+
+	while (ci < view->nchanges) {
+		int id = view->changes[ci].id;
+		size_t cend = ci, mend;
+
+		while (cend < view->nchanges && view->changes[cend].id == id)
+			cend++;
+		while (mi < view->nmembers && view->members[mi].id < id)
+			mi++;
+		for (mend = mi; mend < view->nmembers
+                     && view->members[mend].id == id; mend++);
+
+		for (size_t n = ci; n < cend; n++) {
+			const char *name = view->changes[n].name;
+
+			if (name == NULL)
+				continue;
+
+			if (!view->by_tag) {
+				if (unlink_name(view, NULL, name) < 0)
+					return -1;
+				continue;
+			}
+
+			if (unlink_name(view, UNTAGGED_DIR, name) < 0)
+				return -1;
+
+			for (size_t d = ci; d < cend; d++) {
+				if (view->changes[d].dir && unlink_name(
+                                            view, view->changes[d].dir, name) < 0)
+					return -1;
+			}
+
+			for (size_t d = mi; d < mend; d++) {
+				if (unlink_name(view, view->members[d].dir,
+                                                name) < 0)
+					return -1;
+			}
+		}
+
+		ci = cend;
+		mi = mend;
+	}
+
+	return 0;
+}
+
+// Link every changed file that's in the view into the directories it
+// belongs in now.
+static int link_changed(View *view, const TagVector *filters)
+{
+	size_t mi = 0;
+
+	for (size_t i = 0; i < view->nfiles; i++) {
+		const ViewFile *file = &view->files[i];
+		const char *dir = NULL;
+		int is_tagged = 0;
+
+		if (!view->by_tag) {
+			if (add_link(view, NULL, file) < 0)
+				return -1;
+			continue;
+		}
+
+		while (mi < view->nmembers && view->members[mi].id < file->id)
+			mi++;
+
+		for (; mi < view->nmembers && view->members[mi].id == file->id;
+                     mi++) {
+			is_tagged = 1;
+			if ((dir = get_dir(view, view->members[mi].dir)) == NULL
+			    || add_link(view, dir, file) < 0)
+				return -1;
+		}
+
+		// Untagged files only make sense when nothing's filtered.
+		if (!is_tagged && filters->size == 0) {
+			if ((dir = get_dir(view, UNTAGGED_DIR)) == NULL
+			    || add_link(view, dir, file) < 0)
+				return -1;
+		}
+	}
+
+	return 0;
+}
+
+// Remove the tag directories that changed files left empty.
+static void prune_dirs(View *view)
+{
+	if (!view->by_tag)
+		return;
+
+	unlinkat(view->dirfd, UNTAGGED_DIR, AT_REMOVEDIR);
+
+	for (size_t i = 0; i < view->nchanges; i++) {
+		if (view->changes[i].dir)
+			unlinkat(view->dirfd, view->changes[i].dir,
+                                 AT_REMOVEDIR);
+	}
+
+	for (size_t i = 0; i < view->nmembers; i++)
+		unlinkat(view->dirfd, view->members[i].dir, AT_REMOVEDIR);
+}
+
+// Describe what a view shows, so it's only caught up while it shows the
+// same thing from the same store.
+static char *state_key(const TagVector *filters, int by_tag)
+{
+	size_t len = snprintf(NULL, 0, "%d %d\n%s\n", by_tag, tm_layout(),
+                              tm_path());
+	char *key = NULL, *end = NULL;
+
+	for (int i = 0; i < filters->size; i++)
+		len += strlen(filters->tags[i]) + 1;
+
+	key = malloc(len + 1);
+	if (key == NULL)
+		return NULL;
+
+	end = key + sprintf(key, "%d %d\n%s\n", by_tag, tm_layout(), tm_path());
+	for (int i = 0; i < filters->size; i++)
+		end += sprintf(end, "%s\n", filters->tags[i]);
+
+	return key;
+}
+
+// Read the change a view has caught up to. Returns 1 if it has no state,
+// or it shows something other than `key`.
+static int read_state(int dirfd, const char *key, long long *seq)
+{
+	size_t cap = strlen(key) + 32, len = 0;
+	char *buf = malloc(cap + 1), *end = NULL;
+	ssize_t n = 0;
+	int fd, status = 1;
+
+	if (buf == NULL)
+		return -1;
+
+	fd = openat(dirfd, STATE_FILE, O_RDONLY);
+	if (fd < 0) {
+		free(buf);
+		return errno == ENOENT ? 1 : -1;
+	}
+
+	while (len < cap && (n = read(fd, buf + len, cap - len)) > 0)
+		len += n;
+	buf[len] = '\0';
+	close(fd);
+
+	*seq = strtoll(buf, &end, 10);
+	if (n >= 0 && end != buf && *end == '\n' && STREQ(end + 1, key))
+		status = 0;
+
+	free(buf);
+	return status;
+}
+
+static int write_state(int dirfd, const char *key, long long seq)
+{
+	int fd = openat(dirfd, STATE_TMP, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+
+	if (fd < 0)
+		return -1;
+
+	if (dprintf(fd, "%lld\n%s", seq, key) < 0) {
+		close(fd);
+		return -1;
+	}
+
+	if (close(fd) != 0)
+		return -1;
+
+	return renameat(dirfd, STATE_TMP, dirfd, STATE_FILE);
+}
+
+static void free_view(View *view)
+{
+	for (size_t i = 0; i < view->nfiles; i++) {
+		free(view->files[i].name);
+		free(view->files[i].target);
+	}
+
+	for (size_t i = 0; i < view->ndirs; i++)
+		free(view->dirs[i]);
+
+	for (size_t i = 0; i < view->nchanges; i++) {
+		free(view->changes[i].name);
+		free(view->changes[i].dir);
+	}
+
+	for (size_t i = 0; i < view->nmembers; i++)
+		free(view->members[i].dir);
+
+	free(view->files);
+	free(view->links);
+	free(view->dirs);
+	free(view->changes);
+	free(view->members);
+
+	if (view->dirfd >= 0)
+		close(view->dirfd);
+}
+
+const char *tmview_get_err()
+{
+	return err_buf;
+}
+
+// Fill an empty view from scratch.
+static int build(View *view, const TagVector *filters)
+{
+	// Every file in the view, in one query.
+	if (tm_get_files(filters, &add_file, view) < 0) {
+		strncpy(err_buf, tm_get_error(), sizeof(err_buf)-1);
+		return -1;
+	}
+	if (view->error)
+		return 0;
+
+	if (!view->by_tag) {
+		for (size_t i = 0; i < view->nfiles; i++) {
+			if (add_link(view, NULL, &view->files[i]) < 0)
+				return 0;
+		}
+
+		return 0;
+	}
+
+	// Every tag of every file, in a second one.
+	if (tmdb_get_memberships(&add_membership, view) < 0) {
+		strncpy(err_buf, tmdb_get_error(), sizeof(err_buf)-1);
+		return -1;
+	}
+	if (view->error)
+		return 0;
+
+	// Untagged files only make sense when nothing's filtered.
+	if (filters->size == 0) {
+		const char *dir = NULL;
+
+		for (size_t i = 0; i < view->nfiles; i++) {
+			if (view->files[i].is_tagged)
+				continue;
+
+			if (dir == NULL && (dir = get_dir(view,
+                                                          UNTAGGED_DIR)) == NULL)
+				return 0;
+			if (add_link(view, dir, &view->files[i]) < 0)
+				return 0;
+		}
+	}
+
+	return 0;
+}
+
+// Bring a view up to date with the changes since `since`, touching only
+// the files they affect.
+static int catch_up(View *view, const TagVector *filters, long long since)
+{
+	if (tmdb_get_changes(since, &add_change, view) < 0
+	    || (view->by_tag && tmdb_get_changed_memberships(
+                        since, &add_member, view) < 0)) {
+		strncpy(err_buf, tmdb_get_error(), sizeof(err_buf)-1);
+		return -1;
+	}
+	if (view->error || unlink_changed(view) < 0)
+		return 0;
+
+	if (tmtag_get_changed_files(filters, since, &add_file, view) < 0) {
+		strncpy(err_buf, tmtag_get_err(), sizeof(err_buf)-1);
+		return -1;
+	}
+	if (view->error)
+		return 0;
+
+	link_changed(view, filters);
+	return 0;
+}
+
+// Create every link in the view.
+static int make_links(View *view, int jobs)
+{
+	pthread_t *workers = NULL;
+	int nworkers = 0;
+
+	if (jobs > 1 && view->nlinks > LINK_CHUNK) {
+		workers = calloc(jobs, sizeof(*workers));
+		if (workers == NULL)
+			return -1;
+
+		for (; nworkers < jobs; nworkers++) {
+			if (pthread_create(&workers[nworkers], NULL,
+                                           &link_worker, view) != 0)
+				break;
+		}
+	}
+
+	// Lend a hand, or do it all if there are no workers.
+	link_worker(view);
+	for (int i = 0; i < nworkers; i++)
+		pthread_join(workers[i], NULL);
+
+	free(workers);
+	return 0;
+}
+
+int tmview_build(const char *dir, const TagVector *filters, int by_tag,
+                 int jobs, int rebuild)
+{
+	long long seq = 0, since = 0, pruned = 0;
+	char *key = NULL;
+	int status = -1, rc;
+	View view = {
+		.dirfd = -1,
+		.by_tag = by_tag,
+		.lock = PTHREAD_MUTEX_INITIALIZER,
+	};
+
+	// Take the sequence number first, so changes made while the view
+	// is filled are caught up with next time.
+	if (tmdb_get_change_seq(&seq) < 0
+	    || tmdb_get_pruned_seq(&pruned) < 0) {
+		strncpy(err_buf, tmdb_get_error(), sizeof(err_buf)-1);
+		return -1;
+	}
+
+	if (mkpath(dir, 0755) < 0)
+		goto libc_error;
+
+	view.dirfd = open(dir, O_RDONLY | O_DIRECTORY);
+	if (view.dirfd < 0)
+		goto libc_error;
+
+	key = state_key(filters, by_tag);
+	if (key == NULL)
+		goto libc_error;
+
+	rc = rebuild ? 1 : read_state(view.dirfd, key, &since);
+	if (rc < 0)
+		goto libc_error;
+
+	// Nothing changed since the view was last filled.
+	if (rc == 0 && since == seq) {
+		status = 0;
+		goto cleanup;
+	}
+
+	// Never empty out a directory that isn't a view.
+	if (rc != 0) {
+		rc = may_clear(view.dirfd);
+		if (rc < 0)
+			goto libc_error;
+		if (rc == 0) {
+			snprintf(err_buf, sizeof(err_buf),
+                                 "%s: Not empty, and not a view.", dir);
+			goto cleanup;
+		}
+	}
+
+	// Forget what the view caught up to until it's consistent again,
+	// but keep it marked as a view.
+	if (write_state(view.dirfd, key, -1) < 0)
+		goto libc_error;
+
+	if (rc == 0 && since >= pruned && since < seq) {
+		if (catch_up(&view, filters, since) < 0)
+			goto cleanup;
+	} else {
+		if (clear_dir(view.dirfd) < 0)
+			goto libc_error;
+		if (build(&view, filters) < 0)
+			goto cleanup;
+	}
+
+	if (view.error)
+		goto view_error;
+
+	if (make_links(&view, jobs) < 0)
+		goto libc_error;
+	if (view.error)
+		goto view_error;
+
+	prune_dirs(&view);
+
+	if (write_state(view.dirfd, key, seq) < 0)
+		goto libc_error;
+
+	status = 0;
+	goto cleanup;
+
+view_error:
+	errno = view.error;
+libc_error:
+	snprintf(err_buf, sizeof(err_buf), "%s: %s", dir, strerror(errno));
+cleanup:
+	free(key);
+	free_view(&view);
+	return status;
+}
@@ -0,0 +1,32 @@
+#ifndef VIEW_H
+#define VIEW_H
+
+#include "tags.h"
+
+/*
+ * view.h -- tagmage views. A view is a directory of symlinks into the store,
+ * named after each file's id and title, for browsing files with ordinary
+ * tools. Views are what tad(1) displays.
+ */
+
+/**
+ * tmview_get_err() - Return a cstring containing the latest error.
+ */
+const char *tmview_get_err();
+
+/**
+ * tmview_build() - Fill the directory `dir` with a link to every file that
+ * passes `filters`. A view that `dir` already holds with the same filters
+ * only catches up with the files changed since it was last built, unless
+ * its changes were pruned; any other view there is replaced. Fails if `dir`
+ * holds anything but a view.
+ *
+ * by_tag - If truthy, put each file's links in one subdirectory per tag
+ * instead, plus one named ':untagged' if there are no filters.
+ * jobs - Number of threads creating links at once.
+ * rebuild - If truthy, always replace the view from scratch.
+ */
+int tmview_build(const char *dir, const TagVector *filters, int by_tag,
+                 int jobs, int rebuild);
+
+#endif // VIEW_H
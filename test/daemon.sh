@@ -0,0 +1,52 @@
+#!/bin/sh
+# Run commands through a daemon, checking that one request's input doesn't
+# leak into the next, and that a request stuck on its input doesn't hold
+# up the others.
+#
+# Usage: test/daemon.sh [TAGMAGE]
+
+set -eu
+
+tagmage=$(cd "$(dirname "${1:-./tagmage}")" && pwd)/$(basename "${1:-./tagmage}")
+dir=$(mktemp -d "${TMPDIR:-/tmp}/tagmage-test.XXXXXX")
+daemon=
+trap '[ -z "$daemon" ] || kill "$daemon"; rm -rf "$dir"' EXIT
+
+unset TAGMAGE_NO_DAEMON
+
+tm() {
+	"$tagmage" -f "$dir/store" "$@"
+}
+
+fail() {
+	echo "daemon: $*" >&2
+	exit 1
+}
+
+echo a > "$dir/a.png"
+(cd "$dir" && TAGMAGE_NO_DAEMON=1 tm add -t foo + a.png) >/dev/null
+
+"$tagmage" -f "$dir/store" daemon >/dev/null 2>&1 &
+daemon=$!
+for i in $(seq 1 50); do
+	[ -S "$dir/store/tagmaged.sock" ] && break
+	sleep 0.1
+done
+[ -S "$dir/store/tagmaged.sock" ] || fail "daemon didn't start"
+
+# A failed import leaves the rest of its input unread.
+printf 'bad\n1\ta.png\t\tbar\n' | tm import >/dev/null 2>&1 \
+	&& fail "expected the import to fail"
+out=$(tm import </dev/null 2>&1) || true
+[ "$out" = "Imported 0 files." ] || fail "input leaked: $out"
+
+# Another client goes ahead while the daemon waits on this one's input.
+sleep 3 | tm import >/dev/null &
+sleep 0.5
+start=$(date +%s)
+out=$(tm tags)
+[ "$out" = foo ] || fail "unexpected tags: $out"
+[ $(($(date +%s) - start)) -lt 2 ] || fail "blocked behind a busy daemon"
+wait $!
+
+echo "daemon: ok"
@@ -0,0 +1,41 @@
+#!/bin/sh
+# Export a store with its contents and import it into a new one, then
+# check an export whose contents don't match their hash is refused.
+#
+# Usage: test/import.sh [TAGMAGE]
+
+set -eu
+
+tagmage=$(cd "$(dirname "${1:-./tagmage}")" && pwd)/$(basename "${1:-./tagmage}")
+dir=$(mktemp -d "${TMPDIR:-/tmp}/tagmage-test.XXXXXX")
+trap 'rm -rf "$dir"' EXIT
+
+# Don't hand the test over to a daemon serving some other store.
+TAGMAGE_NO_DAEMON=1
+export TAGMAGE_NO_DAEMON
+
+fail() {
+	echo "import: $*" >&2
+	exit 1
+}
+
+echo hello > "$dir/a.png"
+(cd "$dir" && "$tagmage" -f "$dir/from" add -d -t foo + a.png) >/dev/null
+"$tagmage" -f "$dir/from" export --blobs > "$dir/export"
+
+"$tagmage" -f "$dir/to" import < "$dir/export" >/dev/null \
+	|| fail "importing an export failed"
+cmp -s "$("$tagmage" -f "$dir/to" path 1)" "$dir/a.png" \
+	|| fail "contents lost in the import"
+[ "$("$tagmage" -f "$dir/to" list foo)" = "1 a.png" ] \
+	|| fail "tags lost in the import"
+
+# Swap in other contents under the same hash.
+other=$(printf 'goodbye\n' | base64)
+sed "s/	[^	]*\$/	$other/" "$dir/export" > "$dir/forged"
+"$tagmage" -f "$dir/forged-to" import < "$dir/forged" 2>/dev/null \
+	&& fail "imported contents that don't match their hash"
+[ -z "$(ls "$dir/forged-to/blob" 2>/dev/null)" ] \
+	|| fail "stored contents that don't match their hash"
+
+echo "import: ok"
@@ -0,0 +1,63 @@
+#!/bin/sh
+# Change an indexed store and an identical one without an index the same
+# way, checking after every change that both list the same files, and that
+# the index kept answering.
+#
+# Usage: test/index.sh [TAGMAGE]
+
+set -eu
+
+tagmage=$(cd "$(dirname "${1:-./tagmage}")" && pwd)/$(basename "${1:-./tagmage}")
+dir=$(mktemp -d "${TMPDIR:-/tmp}/tagmage-test.XXXXXX")
+trap 'rm -rf "$dir"' EXIT
+
+# Don't hand the test over to a daemon serving some other store.
+TAGMAGE_NO_DAEMON=1
+export TAGMAGE_NO_DAEMON
+
+# Run a command on both stores.
+both() {
+	"$tagmage" -f "$dir/indexed" "$@" >/dev/null
+	"$tagmage" -f "$dir/plain" "$@" >/dev/null
+}
+
+fail() {
+	echo "index: $*" >&2
+	exit 1
+}
+
+check() {
+	for filter in "" a b "a b" "a|c" "!a" "(a|b) !c" "a*" :tagged \
+	              :untagged new; do
+		want=$("$tagmage" -f "$dir/plain" list $filter)
+		got=$("$tagmage" -f "$dir/indexed" --stats list $filter \
+		      2>"$dir/stats")
+		[ "$got" = "$want" ] || fail "list $filter after $1:
+$got
+instead of:
+$want"
+		grep -q tm_get_page.index "$dir/stats" \
+			|| fail "list $filter after $1 skipped the index"
+	done
+}
+
+mkdir "$dir/src"
+for i in $(seq 1 30); do
+	echo "file $i" > "$dir/src/$i"
+done
+
+(cd "$dir/src" && both add -t a b + $(seq 1 10) \
+	&& both add -t b c + $(seq 11 20) && both add $(seq 21 30))
+"$tagmage" -f "$dir/indexed" index
+check "indexing"
+
+both tag 21 a new; check "tagging"
+both untag 1 a; check "untagging"
+both untag 11 b c; check "untagging every tag"
+both rm 2 12 22; check "removing"
+(cd "$dir/src" && both add -t new + 1); check "adding"
+both edit 3 renamed; check "renaming"
+both tag --query "b" ab; check "tagging a query"
+both untag --query "new" new; check "dropping a tag"
+
+echo "index: ok"
@@ -0,0 +1,57 @@
+#!/bin/sh
+# Move a store with more files than there are hex digits from the flat
+# layout to the sharded one and back, checking every file survives.
+#
+# Usage: test/layout.sh [TAGMAGE]
+
+set -eu
+
+tagmage=$(cd "$(dirname "${1:-./tagmage}")" && pwd)/$(basename "${1:-./tagmage}")
+dir=$(mktemp -d "${TMPDIR:-/tmp}/tagmage-test.XXXXXX")
+trap 'rm -rf "$dir"' EXIT
+
+# Don't hand the test over to a daemon serving some other store.
+TAGMAGE_NO_DAEMON=1
+export TAGMAGE_NO_DAEMON
+
+tm() {
+	"$tagmage" -f "$dir/store" "$@"
+}
+
+fail() {
+	echo "layout: $*" >&2
+	exit 1
+}
+
+# Check the contents of every file against the one it was added from.
+check() {
+	for i in $(seq 1 40); do
+		path=$(tm path "$i")
+		cmp -s "$path" "$dir/src/$i" || fail "file $i lost after $1"
+	done
+}
+
+mkdir "$dir/src"
+for i in $(seq 1 40); do
+	echo "file $i" > "$dir/src/$i"
+done
+
+tm layout flat >/dev/null
+(cd "$dir/src" && tm add $(seq 1 40)) >/dev/null
+[ "$(tm layout)" = flat ] || fail "expected a flat store"
+check "adding"
+
+tm layout sharded || fail "moving to the sharded layout failed"
+[ "$(tm layout)" = sharded ] || fail "expected a sharded store"
+check "sharding"
+
+tm layout flat || fail "moving to the flat layout failed"
+[ "$(tm layout)" = flat ] || fail "expected a flat store"
+check "flattening"
+
+# Nothing but the files and the database is left over.
+extra=$(ls "$dir/store" | grep -v -e '^[0-9]*$' -e '^db\.sqlite' -e '^tmp$' \
+	|| true)
+[ -z "$extra" ] || fail "left behind: $extra"
+
+echo "layout: ok"
@@ -0,0 +1,109 @@
+#define _XOPEN_SOURCE 700 // mkdtemp, nftw
+
+#include <err.h>
+#include <ftw.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "core.h"
+#include "libtagmage.h"
+#include "util.h"
+
+/*
+ * rollback.c -- Remove a file and add another that takes its place within
+ * one transaction, roll it back, and check the removed file's contents are
+ * still stored, for both deduplicated and plain files.
+ *
+ * Usage: build/test-rollback
+ */
+
+static char root[PATH_MAX / 2];
+
+static int remove_entry(const char *path, const struct stat *st, int type,
+                        struct FTW *ftw)
+{
+	UNUSED(st);
+	UNUSED(type);
+	UNUSED(ftw);
+	return remove(path);
+}
+
+static void cleanup(void)
+{
+	nftw(root, &remove_entry, 16, FTW_DEPTH | FTW_PHYS);
+}
+
+static void write_file(const char *path, const char *contents)
+{
+	FILE *fp = fopen(path, "w");
+
+	if (fp == NULL || fputs(contents, fp) < 0 || fclose(fp) != 0)
+		err(1, "%s", path);
+}
+
+// Check the stored copy of `file` holds `contents`.
+static void check_stored(const TMFile *file, const char *contents,
+                         const char *what)
+{
+	char path[PATH_MAX + 1], buf[64] = {0};
+	FILE *fp = NULL;
+
+	tm_file_path(file, path, sizeof(path));
+	fp = fopen(path, "r");
+	if (fp == NULL)
+		errx(1, "%s: %s is gone after the rollback", what, path);
+
+	if (fgets(buf, sizeof(buf), fp) == NULL || !STREQ(buf, contents))
+		errx(1, "%s: %s was overwritten", what, path);
+	fclose(fp);
+}
+
+// Remove `kept`, add `src` with `mode` in its place, and roll both back.
+static void rm_add_rollback(const TMFile *kept, const char *src,
+                            TMAddMode mode)
+{
+	TMFile added;
+
+	if (tm_begin() < 0 || tm_rm_file(kept) < 0
+	    || tm_add_file_mode(src, &added, mode) < 0 || tm_rollback() < 0)
+		errx(1, "%s", tm_get_error());
+}
+
+int main(void)
+{
+	char store[PATH_MAX + 1], a[PATH_MAX + 1], b[PATH_MAX + 1];
+	TMFile file;
+
+	snprintf(root, sizeof(root), "%s/tagmage-test.XXXXXX",
+	         getenv("TMPDIR") ? getenv("TMPDIR") : "/tmp");
+	if (mkdtemp(root) == NULL)
+		err(1, "mkdtemp");
+	atexit(&cleanup);
+
+	snprintf(store, sizeof(store), "%s/store", root);
+	snprintf(a, sizeof(a), "%s/a", root);
+	snprintf(b, sizeof(b), "%s/b", root);
+	write_file(a, "a\n");
+	write_file(b, "b\n");
+
+	if (tm_init(store) < 0)
+		errx(1, "tm_init: %s", tm_get_error());
+
+	// The same contents again need the blob the removal gave up.
+	if (tm_add_file_mode(a, &file, TM_ADD_DEDUP) < 0)
+		errx(1, "%s", tm_get_error());
+	rm_add_rollback(&file, a, TM_ADD_DEDUP);
+	check_stored(&file, "a\n", "blob");
+
+	// A new file after the last one must not take its id, or its path.
+	if (tm_add_file_mode(a, &file, TM_ADD_COPY) < 0)
+		errx(1, "%s", tm_get_error());
+	rm_add_rollback(&file, b, TM_ADD_COPY);
+	check_stored(&file, "a\n", "file");
+
+	puts("rollback: ok");
+	return 0;
+}
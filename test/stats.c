@@ -0,0 +1,59 @@
+#include <err.h>
+#include <stdio.h>
+
+#include "stats.h"
+#include "util.h"
+
+/*
+ * stats.c -- Check latency percentiles stay between the shortest and
+ * longest call recorded, and rise with the percentage asked for.
+ *
+ * Usage: build/test-stats
+ */
+
+static TMStat stat;
+
+static int find(const TMStat *found, void *arg)
+{
+	UNUSED(arg);
+	stat = *found;
+	return 1;
+}
+
+static void check(const char *what)
+{
+	double last = 0;
+	double ps[] = {1, 50, 90, 99, 100};
+
+	tmstat_each(&find, NULL);
+	for (size_t i = 0; i < sizeof(ps) / sizeof(ps[0]); i++) {
+		double p = tmstat_percentile(&stat, ps[i]);
+
+		if (p > stat.max || p < stat.min)
+			errx(1, "%s: p%g is %g, outside %g..%g", what, ps[i], p,
+			     stat.min, stat.max);
+		if (p < last)
+			errx(1, "%s: p%g is %g, below the one before", what,
+			     ps[i], p);
+		last = p;
+	}
+}
+
+int main(void)
+{
+	tmstat_enable(1);
+
+	// A single call is every percentile of itself.
+	tmstat_record("one", 0.000233, NULL);
+	check("one call");
+	if (tmstat_percentile(&stat, 50) != 0.000233)
+		errx(1, "one call: p50 is %g", tmstat_percentile(&stat, 50));
+
+	tmstat_reset();
+	for (int i = 1; i <= 1000; i++)
+		tmstat_record("spread", i * 1e-6, NULL);
+	check("spread calls");
+
+	puts("stats: ok");
+	return 0;
+}
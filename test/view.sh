@@ -0,0 +1,48 @@
+#!/bin/sh
+# Build views over directories holding other things, checking only the
+# view's own links are ever removed.
+#
+# Usage: test/view.sh [TAGMAGE]
+
+set -eu
+
+tagmage=$(cd "$(dirname "${1:-./tagmage}")" && pwd)/$(basename "${1:-./tagmage}")
+dir=$(mktemp -d "${TMPDIR:-/tmp}/tagmage-test.XXXXXX")
+trap 'rm -rf "$dir"' EXIT
+
+# Don't hand the test over to a daemon serving some other store.
+TAGMAGE_NO_DAEMON=1
+export TAGMAGE_NO_DAEMON
+
+tm() {
+	"$tagmage" -f "$dir/store" "$@"
+}
+
+fail() {
+	echo "view: $*" >&2
+	exit 1
+}
+
+echo a > "$dir/a.png"
+echo b > "$dir/b.png"
+(cd "$dir" && tm add -t foo + a.png && tm add -t bar + b.png) >/dev/null
+
+# A directory with other files in it isn't a view to replace.
+mkdir "$dir/docs"
+echo keep > "$dir/docs/notes.txt"
+tm view "$dir/docs" 2>/dev/null && fail "filled a directory that isn't a view"
+[ "$(ls "$dir/docs")" = notes.txt ] || fail "touched a directory that isn't a view"
+
+# Rebuilding a view leaves what the user put in it.
+tm view "$dir/view" foo
+ln -s "$dir/a.png" "$dir/view/mine"
+mkdir "$dir/view/sub"
+echo keep > "$dir/view/sub/notes.txt"
+tm view -r -t "$dir/view"
+[ -L "$dir/view/mine" ] || fail "removed a link the view didn't make"
+[ -f "$dir/view/sub/notes.txt" ] || fail "removed a file the view didn't make"
+[ -L "$dir/view/foo/00001-a.png" ] && [ -L "$dir/view/bar/00002-b.png" ] \
+	|| fail "view not rebuilt by tag"
+[ ! -e "$dir/view/00001-a.png" ] || fail "old view left behind"
+
+echo "view: ok"